@@ -8,6 +8,7 @@
 
 #define MAX_KEY_SIZE 8
 #define DIR_PATH "/tmp/cache_bench"
+#define CACHE_FN "cache_data"
 
 /***Function Prototypes***/
 double fTime();
@@ -15,6 +16,19 @@ double standardBenchmark(int cache_size, int max_bytes, int num_adds, int num_ge
 void computeKey(int key_num, char dest[MAX_KEY_SIZE]);
 uint8_t *dataForKeyNum(int key_num, int max_file_size);
 void recursiveDeletePath(char *path);
+void missLatencyBenchmark(uint32_t num_lines, DCTableLayout_t layout, uint32_t fingerprint_bits,
+                          uint32_t num_ways, int num_lookups);
+void scanBenchmark(uint32_t num_lines, DCLineFormat_t line_format, int num_scans);
+void hitRatioBenchmark(DCReplacementPolicy_t policy, bool admission_filter, int num_keys, int capacity,
+                       int num_requests);
+void mixedSizeBenchmark(DCReplacementPolicy_t policy, int num_keys, uint64_t max_bytes, int num_requests);
+void storageBenchmark(DCStorage_t storage, uint32_t inline_value_bytes, int num_keys, int value_size,
+                      int num_gets);
+void mappedLookupBenchmark(bool mapped, int num_keys, int value_size, int num_gets);
+void lookupAllocationBenchmark(int mode, DCStorage_t storage, uint32_t inline_value_bytes, int num_keys,
+                               int value_size, int num_gets);
+double *zipfCumulativeWeights(int num_keys);
+int zipfSample(const double *cumulative, int num_keys);
 
 /* Run the standard benchmark and return the run time
  * This benchmark will create num_adds files up to max_size, add them to the cache
@@ -85,6 +99,385 @@ double standardBenchmark(int cache_size, int max_bytes, int num_adds, int num_ge
   return 0.0; // TODO: Return something less stupid
 }
 
+/* Measure how long a lookup of a key that isn't in the cache takes, for a table that is 90% full.
+ * The lines are filled in directly rather than with DCAdd so that large tables don't need millions
+ * of data files; DCLoad then rebuilds the fingerprints from them.
+ */
+void missLatencyBenchmark(uint32_t num_lines, DCTableLayout_t layout, uint32_t fingerprint_bits,
+                          uint32_t num_ways, int num_lookups) {
+  DCMakeOptions_t options;
+  DCKey_t *keys = calloc(num_lookups, sizeof(DCKey_t));
+  char key[32];
+  int misses = 0;
+  double start_time, end_time;
+
+  DCMakeOptionsInit(&options);
+  options.table_layout = layout;
+  options.fingerprint_bits = fingerprint_bits;
+  options.num_ways = num_ways;
+  mkdir(DIR_PATH, 0777);
+  DCCache cache = DCMakeWithOptions(DIR_PATH, num_lines, 0, &options);
+
+  for (uint32_t i=0; i < num_lines / 10 * 9; i++) {
+    DCKey_t fill_key;
+    sprintf(key, "fill%u", i);
+    DCKeyMake(cache, key, strlen(key), &fill_key);
+    for (int j=0; j < num_ways; j++) {
+      DCCacheLine_t *line = cache->lines + fill_key.indicies[j];
+      if (line->last_access_time_in_ms_from_epoch == 0) {
+        line->last_access_time_in_ms_from_epoch = 1;
+        line->key_sha1[0] = fill_key.digest[0];
+        line->key_sha1[1] = fill_key.digest[1];
+        break;
+      }
+    }
+  }
+  DCCloseAndFree(cache);
+  markNotClosedCleanly(DIR_PATH "/" CACHE_FN);
+  cache = DCLoad(DIR_PATH);
+
+  // Hash outside of the timed loop, we only want the cost of probing the table
+  for (int i=0; i < num_lookups; i++) {
+    sprintf(key, "miss%d", i);
+    DCKeyMake(cache, key, strlen(key), keys + i);
+  }
+
+  start_time = fTime();
+  for (int i=0; i < num_lookups; i++) {
+    if (!DCLookupKey(cache, keys + i)) {
+      misses ++;
+    }
+  }
+  end_time = fTime();
+
+  printf("Lines: %9u (%7.1f MB); layout: %d; ways: %2u; fingerprint bits: %2u; Miss latency: %6.1f ns (%d misses)\n",
+         num_lines, num_lines * sizeof(DCCacheLine_t) / (1024.0 * 1024.0), (int) layout, num_ways,
+         fingerprint_bits, (end_time - start_time) * 1e9 / num_lookups, misses);
+
+  DCCloseAndFree(cache);
+  free(keys);
+  recursiveDeletePath(DIR_PATH);
+}
+
+/* Measure how long loading a half full table that wasn't closed cleanly takes, for full lines and
+ * for columnar lines. That load scans every line to count them and sum their sizes. The table is
+ * filled as in missLatencyBenchmark and then converted.
+ */
+void scanBenchmark(uint32_t num_lines, DCLineFormat_t line_format, int num_scans) {
+  char key[32];
+  uint64_t num_items = 0;
+  double load_time = 0, start_time;
+
+  mkdir(DIR_PATH, 0777);
+  DCCache cache = DCMake(DIR_PATH, num_lines, 0);
+  for (uint32_t i=0; i < num_lines / 2; i++) {
+    DCKey_t fill_key;
+    sprintf(key, "fill%u", i);
+    DCKeyMake(cache, key, strlen(key), &fill_key);
+    DCCacheLine_t *line = cache->lines + fill_key.indicies[0];
+    line->last_access_time_in_ms_from_epoch = 1 + i;
+    line->key_sha1[0] = fill_key.digest[0];
+    line->key_sha1[1] = fill_key.digest[1];
+  }
+  DCConvertLineFormat(cache, line_format);
+
+  for (int i=0; i < num_scans; i++) {
+    DCCloseAndFree(cache);
+    markNotClosedCleanly(DIR_PATH "/" CACHE_FN);
+    start_time = fTime();
+    cache = DCLoad(DIR_PATH);
+    load_time += fTime() - start_time;
+    num_items += DCNumItems(cache);
+  }
+
+  printf("Lines: %9u; line format: %d; Load time after a crash: %8.1f us (%llu items)\n",
+         num_lines, (int) line_format, load_time * 1e6 / num_scans,
+         (unsigned long long) num_items / num_scans);
+
+  DCCloseAndFree(cache);
+  recursiveDeletePath(DIR_PATH);
+}
+
+/* Measure the hit ratio of a replacement policy on a workload of keys picked with a Zipf distribution,
+ * mixed with as many requests for keys that are never requested again (as from scans). The cache
+ * holds capacity values; every miss adds the key, unless the admission filter turns it away.
+ */
+void hitRatioBenchmark(DCReplacementPolicy_t policy, bool admission_filter, int num_keys, int capacity,
+                       int num_requests) {
+  static const char *policy_names[] = {"LRU", "LFU", "ARC", "S3-FIFO", "GDSF"};
+  double *cumulative = zipfCumulativeWeights(num_keys);
+  double start_time, end_time;
+  int hits = 0, zipf_hits = 0, zipf_requests = 0, adds = 0;
+  char key[32];
+  DCMakeOptions_t options;
+
+  DCMakeOptionsInit(&options);
+  options.replacement_policy = policy;
+  mkdir(DIR_PATH, 0777);
+  DCCache cache = DCMakeWithOptions(DIR_PATH, capacity * 4, capacity * 8, &options);
+  DCSetAdmissionFilter(cache, admission_filter);
+
+  srand(1);
+  start_time = fTime();
+  for (int i=0; i < num_requests; i++) {
+    bool zipf = rand() % 2;
+    if (zipf) {
+      sprintf(key, "zipf%d", zipfSample(cumulative, num_keys));
+      zipf_requests ++;
+    } else {
+      sprintf(key, "scan%d", i);
+    }
+
+    DCData result = DCLookup(cache, key);
+    if (result) {
+      hits ++;
+      zipf_hits += zipf;
+      DCDataFree(result);
+    } else {
+      adds += DCAdd(cache, key, (uint8_t *) "01234567", 8);
+    }
+  }
+  end_time = fTime();
+
+  printf("Policy: %-7s; admission filter: %-3s; Hit ratio: %5.3f (%5.3f of the Zipf requests); "
+         "%6.1f us per request; %6d values written\n",
+         policy_names[policy], admission_filter ? "on" : "off", (double) hits / num_requests,
+         (double) zipf_hits / zipf_requests, (end_time - start_time) * 1e6 / num_requests, adds);
+
+  DCCloseAndFree(cache);
+  free(cumulative);
+  recursiveDeletePath(DIR_PATH);
+}
+
+/* Measure the hit ratio, by requests and by bytes, of a replacement policy on values from 200 bytes to
+ * 200 KB, picked with a Zipf distribution that is independent of their size. Every miss adds the key.
+ */
+void mixedSizeBenchmark(DCReplacementPolicy_t policy, int num_keys, uint64_t max_bytes, int num_requests) {
+  static const char *policy_names[] = {"LRU", "LFU", "ARC", "S3-FIFO", "GDSF"};
+  double *cumulative = zipfCumulativeWeights(num_keys);
+  uint8_t *data = calloc(200 << 10, 1);
+  uint64_t bytes_requested = 0, bytes_hit = 0, bytes_written = 0;
+  int hits = 0;
+  char key[32];
+  DCMakeOptions_t options;
+
+  DCMakeOptionsInit(&options);
+  options.replacement_policy = policy;
+  mkdir(DIR_PATH, 0777);
+  DCCache cache = DCMakeWithOptions(DIR_PATH, num_keys * 2, max_bytes, &options);
+
+  srand(1);
+  for (int i=0; i < num_requests; i++) {
+    int key_num = zipfSample(cumulative, num_keys);
+    uint64_t size = 200 << (key_num * 7 % 11);
+    sprintf(key, "sized%d", key_num);
+    bytes_requested += size;
+
+    DCData result = DCLookup(cache, key);
+    if (result) {
+      hits ++;
+      bytes_hit += size;
+      DCDataFree(result);
+    } else if (DCAdd(cache, key, data, size)) {
+      bytes_written += size;
+    }
+  }
+
+  printf("Policy: %-7s; Hit ratio: %5.3f; Byte hit ratio: %5.3f; %7.1f MB written\n",
+         policy_names[policy], (double) hits / num_requests, (double) bytes_hit / bytes_requested,
+         bytes_written / (1024.0 * 1024.0));
+
+  DCCloseAndFree(cache);
+  free(cumulative);
+  free(data);
+  recursiveDeletePath(DIR_PATH);
+}
+
+/* Measure the rate of adds, lookups and removes of small values with a data file per value, with
+ * segments, in slots of the value size and inline in the table. The cache is large enough that
+ * nothing is evicted.
+ */
+void storageBenchmark(DCStorage_t storage, uint32_t inline_value_bytes, int num_keys, int value_size,
+                      int num_gets) {
+  static const char *storage_names[] = {"files", "segments", "slots"};
+  uint8_t *data = dataForKeyNum(0, value_size);
+  double start_time, add_time, get_time, remove_time;
+  int hits = 0;
+  char key[32];
+  DCMakeOptions_t options;
+
+  DCMakeOptionsInit(&options);
+  options.storage = storage;
+  options.inline_value_bytes = inline_value_bytes;
+  options.slot_size = value_size;
+  mkdir(DIR_PATH, 0777);
+  DCCache cache = DCMakeWithOptions(DIR_PATH, num_keys * 2, 0, &options);
+
+  start_time = fTime();
+  for (int i=0; i < num_keys; i++) {
+    sprintf(key, "small%d", i);
+    DCAdd(cache, key, data, value_size);
+  }
+  add_time = fTime() - start_time;
+
+  srand(1);
+  start_time = fTime();
+  for (int i=0; i < num_gets; i++) {
+    sprintf(key, "small%d", rand() % num_keys);
+    DCData result = DCLookup(cache, key);
+    if (result) {
+      hits ++;
+      DCDataFree(result);
+    }
+  }
+  get_time = fTime() - start_time;
+
+  start_time = fTime();
+  for (int i=0; i < num_keys; i++) {
+    sprintf(key, "small%d", i);
+    DCRemove(cache, key);
+  }
+  remove_time = fTime() - start_time;
+
+  printf("Storage: %-8s; inline: %4u; %5d byte values; Add Keys/s: %9.0f; Get Keys/s: %9.0f; "
+         "Remove Keys/s: %9.0f; Hit Rate: %5.3f\n",
+         storage_names[storage], inline_value_bytes, value_size, num_keys / add_time, num_gets / get_time,
+         num_keys / remove_time, (double) hits / num_gets);
+
+  DCCloseAndFree(cache);
+  free(data);
+  recursiveDeletePath(DIR_PATH);
+}
+
+/***Helpers for the hit ratio benchmarks***/
+
+/* The cumulative weights of num_keys keys where key i has weight 1 / (i+1). Must be freed
+ */
+/* Look up large values with DCLookup, which reads them into memory, or DCLookupMapped. Every page
+ * of the value is read once, as a caller that sends it on would.
+ */
+void mappedLookupBenchmark(bool mapped, int num_keys, int value_size, int num_gets) {
+  uint8_t *data = dataForKeyNum(0, value_size);
+  double start_time, get_time;
+  uint64_t checksum = 0;
+  char key[32];
+
+  mkdir(DIR_PATH, 0777);
+  DCCache cache = DCMake(DIR_PATH, num_keys * 2, 0);
+  for (int i=0; i < num_keys; i++) {
+    sprintf(key, "large%d", i);
+    DCAdd(cache, key, data, value_size);
+  }
+
+  srand(1);
+  start_time = fTime();
+  for (int i=0; i < num_gets; i++) {
+    sprintf(key, "large%d", rand() % num_keys);
+    if (mapped) {
+      DCMappedData result = DCLookupMapped(cache, key);
+      for (uint64_t j=0; result && j < result->data_len; j += 4096) {
+        checksum += result->data[j];
+      }
+      if (result) {
+        DCMappedDataRelease(result);
+      }
+    } else {
+      DCData result = DCLookup(cache, key);
+      for (uint64_t j=0; result && j < result->data_len; j += 4096) {
+        checksum += result->data[j];
+      }
+      if (result) {
+        DCDataFree(result);
+      }
+    }
+  }
+  get_time = fTime() - start_time;
+
+  printf("Lookup: %-6s; %8d byte values; Get Keys/s: %7.0f; MB/s: %7.0f (checksum %llu)\n",
+         mapped ? "mapped" : "copied", value_size, num_gets / get_time,
+         (double) num_gets * value_size / get_time / (1 << 20), (unsigned long long) checksum);
+
+  DCCloseAndFree(cache);
+  free(data);
+  recursiveDeletePath(DIR_PATH);
+}
+
+/* Hits on small values with DCLookup (mode 0), DCLookup with a data pool (1) and DCLookupInto (2)
+ */
+void lookupAllocationBenchmark(int mode, DCStorage_t storage, uint32_t inline_value_bytes, int num_keys,
+                               int value_size, int num_gets) {
+  static const char *mode_names[] = {"DCLookup", "pooled", "DCLookupInto"};
+  uint8_t *data = dataForKeyNum(0, value_size);
+  uint8_t buf[value_size];
+  double start_time, get_time;
+  uint64_t len;
+  int hits = 0;
+  char key[32];
+  DCMakeOptions_t options;
+
+  DCMakeOptionsInit(&options);
+  options.storage = storage;
+  options.inline_value_bytes = inline_value_bytes;
+  mkdir(DIR_PATH, 0777);
+  DCCache cache = DCMakeWithOptions(DIR_PATH, num_keys * 2, 0, &options);
+  for (int i=0; i < num_keys; i++) {
+    sprintf(key, "small%d", i);
+    DCAdd(cache, key, data, value_size);
+  }
+  if (mode == 1) {
+    DCSetDataPool(cache, 16, value_size);
+  }
+
+  srand(1);
+  start_time = fTime();
+  for (int i=0; i < num_gets; i++) {
+    sprintf(key, "small%d", rand() % num_keys);
+    if (mode == 2) {
+      hits += DCLookupInto(cache, key, buf, sizeof(buf), &len);
+    } else {
+      DCData result = DCLookup(cache, key);
+      if (result) {
+        hits ++;
+        DCDataFree(result);
+      }
+    }
+  }
+  get_time = fTime() - start_time;
+
+  printf("Lookup: %-12s; inline: %4u; %5d byte values; Get Keys/s: %9.0f; Hit Rate: %5.3f\n",
+         mode_names[mode], inline_value_bytes, value_size, num_gets / get_time, (double) hits / num_gets);
+
+  DCCloseAndFree(cache);
+  free(data);
+  recursiveDeletePath(DIR_PATH);
+}
+
+double *zipfCumulativeWeights(int num_keys) {
+  double *cumulative = calloc(num_keys, sizeof(double));
+  double total = 0;
+  for (int i=0; i < num_keys; i++) {
+    total += 1.0 / (i + 1);
+    cumulative[i] = total;
+  }
+  return cumulative;
+}
+
+/* Pick a key number with a Zipf distribution, from zipfCumulativeWeights
+ */
+int zipfSample(const double *cumulative, int num_keys) {
+  double target = cumulative[num_keys - 1] * rand() / ((double) RAND_MAX + 1);
+  int low = 0, high = num_keys - 1;
+  while (low < high) {
+    int mid = (low + high) / 2;
+    if (cumulative[mid] <= target) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
 /***Helpers for standardBenchmark***/
 
 void computeKey(int key_num, char dest[MAX_KEY_SIZE]) {
@@ -106,4 +499,53 @@ uint8_t *dataForKeyNum(int key_num, int max_file_size) {
 int main (int argc, char **argv) {
   printf("Starting benchmark\n");
   standardBenchmark(1024, 0, 1024, 65536, 2048);
+
+  printf("Miss latency vs. table size\n");
+  for (uint32_t num_lines = 1 << 14; num_lines <= 1 << 22; num_lines <<= 2) {
+    missLatencyBenchmark(num_lines, DC_LAYOUT_SCATTERED, 0, 4, 1 << 20);
+    missLatencyBenchmark(num_lines, DC_LAYOUT_BUCKETED, 8, 4, 1 << 20);
+    missLatencyBenchmark(num_lines, DC_LAYOUT_BUCKETED, 16, 4, 1 << 20);
+    missLatencyBenchmark(num_lines, DC_LAYOUT_BUCKETED_TWO_CHOICE, 8, 4, 1 << 20);
+    for (uint32_t num_ways = 2; num_ways <= 16; num_ways <<= 1) {
+      missLatencyBenchmark(num_lines, DC_LAYOUT_BUCKETED, 8, num_ways, 1 << 20);
+    }
+  }
+
+  printf("Load time after a crash vs. line format\n");
+  for (uint32_t num_lines = 1 << 16; num_lines <= 1 << 22; num_lines <<= 2) {
+    scanBenchmark(num_lines, DC_LINE_FORMAT_FULL, 64);
+    scanBenchmark(num_lines, DC_LINE_FORMAT_COLUMNAR, 64);
+  }
+
+  printf("Hit ratio vs. replacement policy, Zipf keys mixed with one-off keys\n");
+  for (int policy = DC_POLICY_LRU; policy <= DC_POLICY_S3FIFO; policy++) {
+    hitRatioBenchmark(policy, false, 100000, 2000, 100000);
+    hitRatioBenchmark(policy, true, 100000, 2000, 100000);
+  }
+
+  printf("Hit ratio vs. replacement policy, values from 200 bytes to 200 KB\n");
+  for (int policy = DC_POLICY_LRU; policy <= DC_POLICY_GDSF; policy++) {
+    mixedSizeBenchmark(policy, 20000, 32 << 20, 50000);
+  }
+
+  printf("Small value throughput vs. storage\n");
+  for (int value_size = 64; value_size <= 4096; value_size <<= 2) {
+    storageBenchmark(DC_STORAGE_FILES, 0, 50000, value_size, 200000);
+    storageBenchmark(DC_STORAGE_SEGMENTS, 0, 50000, value_size, 200000);
+  }
+  storageBenchmark(DC_STORAGE_FILES, 64, 50000, 64, 200000);
+  storageBenchmark(DC_STORAGE_FILES, 0, 20000, 16384, 100000);
+  storageBenchmark(DC_STORAGE_SLOTS, 0, 20000, 16384, 100000);
+
+  printf("Large value lookups, copied vs. mapped\n");
+  for (int value_size = 64 << 10; value_size <= 16 << 20; value_size <<= 4) {
+    mappedLookupBenchmark(false, 32, value_size, (1 << 28) / value_size);
+    mappedLookupBenchmark(true, 32, value_size, (1 << 28) / value_size);
+  }
+
+  printf("Small value lookups vs. allocation\n");
+  for (int mode = 0; mode <= 2; mode++) {
+    lookupAllocationBenchmark(mode, DC_STORAGE_FILES, 64, 50000, 64, 1000000);
+    lookupAllocationBenchmark(mode, DC_STORAGE_SEGMENTS, 0, 50000, 1024, 500000);
+  }
 }
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // For fallocate, to punch the values removed from segments out of them
 #include <assert.h>
 #include <errno.h>
 #include <inttypes.h>
@@ -5,59 +6,360 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
+#include <dirent.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <strings.h>
 #include <unistd.h>
 
-#include "sha1/sha1.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DC_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "key_hash.h"
 
 #include "disk_cache.h"
 
 /***CONSTANTS***/
 #define FILENAME_MAX_LEN 128 //The max length of the cache filename
 #define CACHE_FN "cache_data"
-#define NUM_LOOKUP_INDICIES 4
+#define RESIZE_NEW_FN "cache_data.new" // A resized table before it is swapped in
+#define RESIZE_SOURCE_FN "cache_data.migrating" // The previous table while its lines are migrated
+#define UNLINKS_FN "cache_data.unlinks" // The data files queued for deferred unlinking
+#define SEGMENT_FN_PREFIX "cache_data.segment." // Followed by the segment id, in hex
+#define SLOTS_FN "cache_data.slots" // The value slots of DC_STORAGE_SLOTS
+#define DC_HEADER_MAGIC 0x3152444843534944ULL // "DISCHDR1" in little endian
+#define DC_HEADER_VERSION 1
+#define LEGACY_HEADER_SIZE 12 // Legacy caches only have num_lines and max_bytes
+#define NUM_LOOKUP_INDICIES DC_MAX_LOOKUP_INDICIES
+#define DEFAULT_NUM_WAYS 4 // The only associativity of caches made before it was configurable
 #define UNUSED_LAST_ACCESS_TIME 0
-#define EVICT_TO_THIS_RATIO .75 //Eviction is expensive, so we want to evict more than what we need
+#define NO_LINE UINT32_MAX // Returned by the line finding helpers when there is no such line
+#define COMPACT_TIME_UNIT_MS 1000 // The resolution of the access times of compact lines
+#define EMPTY_FINGERPRINT 0
+#define EVICTION_SAMPLE_LINES 16 // Used lines an add compares to pick the one it evicts
+#define EVICTION_HISTOGRAM_BUCKETS 64 // Access time ranges DCEvictToSize picks its cutoff from
+#define MAX_CUCKOO_KICKS 256 // Bounds the search state of a displacement, which lives on the stack
+#define RESIZE_LINES_PER_OPERATION 32 // Lines of the old table migrated by each add, lookup and remove
+#define EVICTOR_BATCH_LINES 64 // The most lines the background evictor evicts before letting others in
+#define EVICTOR_IDLE_WAIT_MS 100 // How often an idle background evictor checks the cache size
+#define MAX_UNLINK_THREADS 16
+#define UNLINK_QUEUE_CAPACITY 65536 // Files; removing more while the queue is full unlinks them directly
+#define UNLINK_BATCH 64 // Files an unlink thread takes off the queue at once
+#define UNLINK_BUCKETS 4096 // Of the counts of queued files that let adds skip searching the queue
+#define DEFAULT_SEGMENT_SIZE (64U << 20)
+#define MIN_SEGMENT_SIZE (64U << 10)
+#define SEGMENT_VALUE_FRACTION 16 // Values of at most segment_size / this are stored in a segment
+#define SEGMENT_COMPACT_FRACTION 4 // Segments less than 1 / this full are compacted by DCEvictToSize
+#define MIN_PUNCH_BYTES (64U << 10) // Smaller ranges are left to compaction, punching costs as much as an unlink
+#define MAX_OPEN_SEGMENTS 256 // Opening another closes the others, so a large cache doesn't run out of fds
+#define MAX_INLINE_VALUE_BYTES 1024
+#define DEFAULT_SLOT_SIZE 4096
+#define MAX_SLOT_SIZE (1U << 30)
+#define PIN_FILE 1 // A value mapped from its own file, pinned by its file id
+#define PIN_SEGMENT 2 // A value mapped from a segment, pinned by the segment id and its offset
+
+// The low byte of the flags of a line holds the replacement policy's state of it, the rest its expiry
+#define POLICY_FLAGS_MASK 0xff
+#define EXPIRY_SHIFT 8 // 0 = never expires, otherwise the line expires 1 + this many seconds after its time
+#define MAX_TTL_IN_SECONDS ((1U << (32 - EXPIRY_SHIFT)) - 2) // A little over 194 days
+#define LFU_COUNT_MASK 0xff
+#define LFU_INITIAL_COUNT 5 // So that a new line isn't the first to go
+#define LFU_LOG_FACTOR 10 // The higher, the more accesses each step of the counter takes
+#define LFU_DECAY_PERIOD_MS 60000 // The counter drops by one for every period without an access
+#define ARC_FLAG_T2 1 // Used again since it was inserted
+#define S3FIFO_FLAG_MAIN 1 // In the main FIFO, otherwise in the small one
+#define S3FIFO_FREQUENCY_SHIFT 1 // Above the flag, 2 bits counting uses since insertion or last spared
+#define S3FIFO_MAX_FREQUENCY 3
+#define S3FIFO_SMALL_FRACTION 0.1 // The share of the cache the small FIFO should have
+#define GDSF_FREQUENCY_MASK 0x0f // Uses since insertion, saturating
+#define GDSF_COST_SHIFT 4 // Above it, log2 of the cost hint
+#define GDSF_MAX_COST_CLASS 15
+#define GDSF_BYTE_MS (60000ULL * 1024) // A use of a 1 KB value of cost 1 is worth a minute of recency
+#define PROBATION_ESTIMATE_WEIGHT 64 // How many looked at lines probation_fraction averages over
+#define RANK_CLASS_SHIFT 44 // Ranks are a class above a time in ms, which fits 44 bits until 2527
+#define SKETCH_DEPTH 4 // Rows of the admission filter's count-min sketch
+#define SKETCH_MIN_WIDTH_BITS 6
+#define SKETCH_MAX_COUNT 15 // Counters saturate, frequencies above it don't matter for admission
+#define SKETCH_SAMPLE_FACTOR 10 // Counters are halved after this many increments per column
 
 /***INTERNAL STRUCTS***/
+// A line visited by the displacement search, and the node whose occupant would move into it
 typedef struct {
-  DCCacheLine_t *line;
-  int line_idx; //Probably not needed
-  uint64_t last_access_time_in_ms_from_epoch;
+  uint32_t line_idx;
+  int32_t parent;
+} DisplacementNode_t;
+
+typedef struct {
+  uint32_t line_idx;
+  uint64_t eviction_rank;
 } LineSortable_t;
 
+// A running background evictor, see DCStartEvictor
+struct DCEvictor_s {
+  pthread_t thread;
+  pthread_mutex_t lock; // Held by the public functions and by the evictor while it evicts
+  pthread_cond_t wake; // Signaled when the evictor should look at the cache again
+  DCEvictorOptions_t options;
+  bool evicting; // Set on reaching the high watermark, cleared on reaching the low one
+  bool stop;
+};
+
+// Running deferred unlink threads, see DCStartDeferredUnlink. The queue is a ring of file ids in a
+// mapped file, so the ids outlive a crash; a slot is only cleared once its file is unlinked
+struct DCUnlinker_s {
+  pthread_t threads[MAX_UNLINK_THREADS];
+  uint32_t num_threads;
+  pthread_mutex_t lock;
+  pthread_cond_t work; // Signaled when files are queued or the threads should stop
+  pthread_cond_t done; // Broadcast when a batch of files was unlinked
+  uint64_t (*slots)[2]; // UNLINK_QUEUE_CAPACITY file ids, 0 = unlinked or cancelled
+  uint64_t head, next, tail; // Slots [head, next) are being unlinked and [next, tail) are queued
+  uint32_t queued_by_bucket[UNLINK_BUCKETS]; // Of slots in [head, tail), by unlinkBucket
+  char *directory_path; // A copy, a resize may replace the cache's while the threads run
+  bool stop;
+};
+
+// The segments of a cache with DC_STORAGE_SEGMENTS. Values are only ever appended to the active
+// segment; a segment is dropped once none of its values is in a line anymore
+struct DCSegments_s {
+  uint32_t segment_size;
+  uint32_t max_value_size;
+  uint32_t num_segments; // Every segment id is below it, it is the id the next segment gets
+  uint64_t *live_bytes; // By segment id, the bytes of the values lines point to
+  int *fds; // By segment id, -1 = not open
+  uint32_t num_open;
+  uint32_t active_id; // 0 = no segment was started yet
+  uint32_t write_offset; // Where the next value is appended to the active segment
+};
+
+// The values mapped by DCLookupMapped. A mapping keeps its file even once it is unlinked, so a pin
+// only has to keep the file from being truncated and rewritten, or its range from being punched out
+struct DCPins_s {
+  struct {
+    uint32_t kind;
+    uint32_t count; // Of views of the value that haven't been released
+    uint64_t id[2];
+  } *pins;
+  uint32_t num_pins;
+  uint32_t capacity;
+};
+
+// The DCData that lookups reuse, see DCSetDataPool. A pooled DCData is freed by DCDataFree, which
+// doesn't hold the cache's lock and may come after the cache dropped the pool, so it has its own
+struct DCDataPool_s {
+  pthread_mutex_t lock;
+  DCData *free_data; // Each with a buffer of buffer_size bytes
+  uint32_t num_free;
+  uint32_t max_data; // The most DCData the pool allocates, free or not
+  uint32_t num_outstanding; // Returned by lookups and not freed yet
+  uint64_t buffer_size;
+  bool dropped; // By the cache; the last of the outstanding DCData frees the pool
+};
+
+// The admission filter's count-min sketch of how often keys were recently used, see
+// DCSetAdmissionFilter. Keys are counted in every row, their frequency is the lowest of their counters
+struct DCSketch_s {
+  uint8_t *counters; // SKETCH_DEPTH rows of 1 << width_bits counters
+  uint32_t width_bits;
+  uint64_t num_increments; // Since the counters were last halved
+  uint64_t sample_size; // num_increments at which they are halved
+};
+
 /***PREPROCESSOR FUNCTION DECLARATIONS***/
 static size_t computeMaxFilePathSize(char *cache_directory_path);
-static void computeCachePath(char *cache_directory_path, char *dest, int dest_len);
-static bool createDataFile(char *file_path, uint32_t num_lines, uint64_t max_bytes);
+static void computeCachePath(char *cache_directory_path, char *file_name, char *dest);
+static DCCache loadTable(char *cache_directory_path, char *file_path, DCLoadOptions_t *options);
+static void abandonLoad(DCCache cache);
+static void touchPages(void *start, size_t size);
+static void markClosedCleanly(DCCache cache);
+static void closeTable(DCCache cache);
+static bool createDataFile(char *file_path, DCCacheHeader_t *header);
+static bool createSlotsFile(char *file_path, uint64_t file_size);
 static bool createSubDirs(char *cache_directory_path);
-static void computeLookupIndiciesForKey(uint64_t key_sha1[2], uint32_t indicies[NUM_LOOKUP_INDICIES], uint32_t num_lines);
-static void SHA1ForKey(char *key, uint64_t sha1[2]);
+static bool isSupportedNumWays(uint32_t num_ways);
+static uint32_t linesPerBucket(uint32_t table_layout, uint32_t num_ways);
+static void computeLookupIndiciesForKey(uint64_t key_sha1[2], uint32_t indicies[NUM_LOOKUP_INDICIES], uint32_t num_lines, uint32_t table_layout, uint32_t num_ways);
+static void digestForKey(DCCache cache, const void *key, size_t key_len, uint64_t digest[2]);
+static void randomSeed(uint64_t seed[2]);
+static inline void prepareKey(DCCache cache, DCKey_t *key);
 static bool mkdirForSHA1IfNotExists(DCCache cache, uint64_t sha[2]);
 static void dirForSHA1(DCCache cache, uint64_t sha[2], char *dest);
 static void pathForSHA1(DCCache cache, uint64_t sha1[2], char *dest);
-static void removeLine(DCCache cache, DCCacheLine_t *line);
-static void removeFileForLine(DCCache cache, DCCacheLine_t *line);
+static void pathForFileIdInDirectory(char *cache_directory_path, uint64_t file_id[2], char *dest);
+static void removeLine(DCCache cache, uint32_t idx);
+static void removeFileForLine(DCCache cache, uint32_t idx);
 static uint64_t currentTimeInMSFromEpoch();
-static void recomputeCacheSizeFromLines(DCCache cache);
+static uint64_t coarseTimeInMSFromEpoch();
+static void carryOverSettings(DCCache to, DCCache from);
+static void recomputeStateFromLines(DCCache cache);
+static void rebuildFingerprints(DCCache cache);
 static void maybeEvict(DCCache cache, uint64_t proposed_increase_bytes);
-static inline bool isLineUsed(DCCacheLine_t *line);
+static uint32_t lineToEvictAtEvictionHand(DCCache cache);
+static uint32_t sampleAtEvictionHand(DCCache cache, uint32_t *hand, uint32_t sampled_lines[EVICTION_SAMPLE_LINES], uint32_t *num_sampled);
+static void evictLine(DCCache cache, uint32_t idx);
+
+//The public functions of the same name, called with the cache locked
+static bool addKey(DCCache cache, DCKey_t *key, uint8_t *data, uint64_t data_len, DCAddOptions_t *options);
+static void removeKey(DCCache cache, DCKey_t *key);
+static DCData lookupKey(DCCache cache, DCKey_t *key, bool *is_stale);
+static DCMappedData lookupKeyMapped(DCCache cache, DCKey_t *key);
+static bool lookupKeyInto(DCCache cache, DCKey_t *key, uint8_t *buf, uint64_t cap, uint64_t *len);
+static void evictToSize(DCCache cache, uint64_t allowed_bytes);
+static bool resize(DCCache cache, uint32_t new_num_lines);
+static bool resizeStep(DCCache cache, uint32_t max_lines);
+static bool convertLineFormat(DCCache cache, DCLineFormat_t line_format);
+
+//Background eviction
+static inline void lockCache(DCCache cache);
+static inline void unlockCache(DCCache cache);
+static void *evictorMain(void *arg);
+static bool evictorShouldRun(DCCache cache);
+static void evictorWait(struct DCEvictor_s *evictor, uint64_t wait_in_ms);
+
+//Line Accessors
+static inline bool isLineUsed(DCCache cache, uint32_t idx);
+static inline uint64_t lineAccessTime(DCCache cache, uint32_t idx);
+static inline void setLineAccessTime(DCCache cache, uint32_t idx, uint64_t time_in_ms);
+static inline void touchLine(DCCache cache, uint32_t idx);
+static inline uint32_t compactTime(DCCache cache, uint64_t time_in_ms);
+static inline uint32_t lineSize(DCCache cache, uint32_t idx);
+static inline uint64_t lineKeyFingerprint(DCCache cache, uint32_t idx);
+static inline void lineDigest(DCCache cache, uint32_t idx, uint64_t digest[2]);
+static inline bool lineMatchesDigest(DCCache cache, uint32_t idx, uint64_t digest[2]);
+static inline void writeLine(DCCache cache, uint32_t idx, uint64_t digest[2], uint64_t time_in_ms, uint32_t size_in_bytes);
+static inline void clearLine(DCCache cache, uint32_t idx);
+static inline void copyLine(DCCache cache, uint32_t from_idx, uint32_t to_idx);
+static inline uint32_t lineFlags(DCCache cache, uint32_t idx);
+static inline void setLineFlags(DCCache cache, uint32_t idx, uint32_t flags);
+static inline uint32_t policyFlags(DCCache cache, uint32_t idx);
+static inline void setPolicyFlags(DCCache cache, uint32_t idx, uint32_t flags);
+static inline uint64_t lineExpiry(DCCache cache, uint32_t idx);
+static inline void setLineExpiry(DCCache cache, uint32_t idx, uint64_t expiry_in_ms);
+static inline bool isLineExpired(DCCache cache, uint32_t idx);
+static inline void fileIdForLine(DCCache cache, uint32_t idx, uint64_t file_id[2]);
+static inline void fileIdForKey(DCCache cache, DCKey_t *key, uint64_t file_id[2]);
+static inline bool isLineInline(DCCache cache, uint32_t idx);
+static inline uint8_t *inlineValueSlot(DCCache cache, uint32_t idx);
+static inline bool isLineInSlot(DCCache cache, uint32_t idx);
+static inline off_t slotOffset(DCCache cache, uint32_t idx);
+
+//Replacement Policies
+static inline uint64_t evictionRank(DCCache cache, uint32_t idx);
+static inline uint64_t gdsfValueInMS(DCCache cache, uint32_t idx);
+static inline uint32_t lfuDecayedCount(DCCache cache, uint32_t idx, uint64_t now);
+static void policyOnInsert(DCCache cache, uint32_t idx, DCKey_t *key, uint32_t cost);
+static inline void policyOnHit(DCCache cache, uint32_t idx);
+static void policyOnEvict(DCCache cache, uint32_t idx);
+static void policyOnSpared(DCCache cache, uint32_t idx);
+static inline void observeForPolicy(DCCache cache, uint32_t flags);
+static void adaptProbationTarget(DCCache cache, int ghost_list);
+static void putGhost(DCCache cache, uint64_t digest[2], int list);
+static int takeGhost(DCCache cache, uint64_t digest[2]);
+
+//Deferred unlinking
+static bool queueUnlink(struct DCUnlinker_s *unlinker, uint64_t file_id[2]);
+static void awaitUnlink(struct DCUnlinker_s *unlinker, uint64_t file_id[2]);
+static void *unlinkerMain(void *arg);
+static inline uint32_t unlinkBucket(uint64_t file_id[2]);
+static bool sameFileId(uint64_t a[2], uint64_t b[2]);
+static void unlinkFilesQueuedBeforeCrash(char *cache_directory_path);
+
+// Segment storage helpers
+static bool openSegments(DCCache cache);
+static void countSegmentBytes(struct DCSegments_s *segments, DCCache table);
+static void closeSegments(struct DCSegments_s *segments);
+static bool growSegments(struct DCSegments_s *segments, uint32_t num_segments);
+static void pathForSegment(DCCache cache, uint32_t segment_id, char *dest);
+static bool parseSegmentFileName(char *file_name, uint32_t *segment_id);
+static int segmentFd(DCCache cache, uint32_t segment_id);
+static bool startSegment(DCCache cache);
+static bool appendToSegment(DCCache cache, uint32_t idx, uint8_t *data, uint64_t data_len);
+static void releaseSegmentRange(DCCache cache, DCSegmentLocation_t location, uint32_t size_in_bytes);
+static void dropSegment(DCCache cache, uint32_t segment_id);
+static void compactSegments(DCCache cache);
+
+// Mapped value helpers
+static DCMappedData mapValue(DCCache cache, uint32_t idx, DCKey_t *key);
+static bool mapRange(int fd, uint64_t offset, uint64_t len, DCMappedData mapped);
+static void pinValue(DCCache cache, uint32_t kind, uint64_t id[2]);
+static void unpinValue(DCCache cache, uint32_t kind, uint64_t id[2]);
+static bool isFilePinned(DCCache cache, uint64_t file_id[2]);
+static bool isSegmentPinned(DCCache cache, uint32_t segment_id);
+
+// Data pool helpers
+static DCData allocData(DCCache cache, uint64_t data_len);
+static void returnPooledData(DCData data);
+static void dropDataPool(struct DCDataPool_s *pool);
+
+//Admission filter
+static bool admitKey(DCCache cache, DCKey_t *key, uint64_t data_len);
+static bool admitKeyOverLine(DCCache cache, DCKey_t *key, uint32_t victim);
+static struct DCSketch_s *makeSketch(uint32_t num_lines);
+static inline uint32_t sketchColumn(struct DCSketch_s *sketch, uint64_t key_fingerprint, int row);
+static void sketchIncrement(struct DCSketch_s *sketch, uint64_t key_fingerprint);
+static uint32_t sketchEstimate(struct DCSketch_s *sketch, uint64_t key_fingerprint);
+
+//Line Scans
+static uint32_t countUsedLines(DCCache cache);
+static uint64_t sumLineSizes(DCCache cache);
+static uint32_t selectLinesAccessedBefore(DCCache cache, uint64_t threshold_in_ms, uint32_t *dest);
+static uint32_t countNonZero64(const uint64_t *values, uint32_t n);
+static uint64_t sum32(const uint32_t *values, uint32_t n);
+static uint32_t selectNonZeroBelow64(const uint64_t *values, uint32_t n, uint64_t threshold, uint32_t *dest);
+#ifdef DC_X86
+static uint32_t countNonZero64AVX2(const uint64_t *values, uint32_t n);
+static uint64_t sum32AVX2(const uint32_t *values, uint32_t n);
+static uint32_t selectNonZeroBelow64AVX2(const uint64_t *values, uint32_t n, uint64_t limit, uint32_t *dest);
+#endif
+
+//Fingerprint Helpers
+static inline uint16_t fingerprintForDigest(uint64_t digest[2], uint32_t fingerprint_bits);
+static inline uint16_t fingerprintAt(DCCache cache, uint32_t idx);
+static inline void setFingerprint(DCCache cache, uint32_t idx, uint16_t fingerprint);
+static inline uint32_t matchFingerprints8(const uint8_t *fingerprints, uint32_t n, uint8_t fingerprint);
+static inline uint32_t matchFingerprints16(const uint16_t *fingerprints, uint32_t n, uint16_t fingerprint);
+static inline uint32_t matchFingerprintRun(DCCache cache, uint32_t start_idx, uint32_t n, uint16_t fingerprint);
+static inline uint32_t candidatesMatchingFingerprint(DCCache cache, DCKey_t *key);
+static inline uint32_t candidatesMatchingFingerprintN(DCCache cache, DCKey_t *key, const uint32_t ways);
 
 //DCAdd Helpers
-static DCCacheLine_t *findBestLineToWriteKeyTo(DCCache cache, uint64_t key_sha1[2]);
+static uint32_t findBestLineToWriteKeyTo(DCCache cache, DCKey_t *key);
+static inline uint32_t findBestLineToWriteKeyToN(DCCache cache, DCKey_t *key, const uint32_t ways);
+static uint32_t findLineToClaimForKey(DCCache cache, DCKey_t *key);
 static bool saveDataFileForKey(DCCache cache, uint64_t sha1[2], uint8_t *data, uint64_t data_len);
+static uint32_t freeLineByDisplacement(DCCache cache, DCKey_t *key);
+static void moveLine(DCCache cache, uint32_t from_idx, uint32_t to_idx);
 
 //DCLookup Helpers
-static DCCacheLine_t *findLineThatMatchesKey(DCCache cache, uint64_t key_sha1[2]);
-static DCData readDataFileForKey(DCCache cache, uint64_t key_sha1[2]);
+static uint32_t findLineThatMatchesKey(DCCache cache, DCKey_t *key);
+static uint32_t findLineForLookup(DCCache cache, DCKey_t *key, bool *is_stale);
+static DCData readValue(DCCache cache, uint32_t idx);
+static bool readValueInto(DCCache cache, uint32_t idx, uint8_t *buf, uint64_t cap, uint64_t *len);
+static bool readDataFileInto(DCCache cache, uint64_t file_id[2], uint8_t *buf, uint64_t cap, uint64_t *len);
+static bool preadFully(int fd, uint8_t *buf, uint64_t len, uint64_t offset);
+
+//DCResize Helpers
+static void resumeResize(DCCache cache);
+static void finishResize(DCCache cache);
+static uint32_t migrateLine(DCCache cache, uint32_t source_idx);
+static uint32_t migrateKey(DCCache cache, DCKey_t *key);
+static bool removeKeyFromResizeSource(DCCache cache, DCKey_t *key);
+static void dropSourceLine(DCCache cache, uint32_t source_idx, bool remove_file);
+static inline void advanceResize(DCCache cache);
 
 //Evict Helpers
-static LineSortable_t *lineSortablesFromOldestToNewest(DCCache cache, int *num_used_lines);
+static LineSortable_t *lineSortablesFromOldestToNewest(DCCache cache, uint64_t bytes_to_free, int *num_sortables);
+static uint64_t evictionCutoff(DCCache cache, uint64_t bytes_to_free, uint32_t *num_candidates);
 static int sortableCompareFunc(const void *a, const void *b);
 
 
@@ -65,16 +367,120 @@ static int sortableCompareFunc(const void *a, const void *b);
 
 
 DCCache DCMake(char *cache_directory_path, uint32_t num_lines, uint64_t max_bytes) {
+  return DCMakeWithOptions(cache_directory_path, num_lines, max_bytes, NULL);
+}
+
+void DCMakeOptionsInit(DCMakeOptions_t *options) {
+  options->hash_engine = DC_HASH_FAST128;
+  options->seed_hash = true;
+  options->table_layout = DC_LAYOUT_BUCKETED;
+  options->fingerprint_bits = 8;
+  options->cuckoo_max_kicks = 32;
+  options->num_ways = DEFAULT_NUM_WAYS;
+  options->line_format = DC_LINE_FORMAT_FULL;
+  options->replacement_policy = DC_POLICY_LRU;
+  options->storage = DC_STORAGE_FILES;
+  options->segment_size = DEFAULT_SEGMENT_SIZE;
+  options->inline_value_bytes = 0;
+  options->slot_size = DEFAULT_SLOT_SIZE;
+}
+
+DCCache DCMakeWithOptions(char *cache_directory_path, uint32_t num_lines, uint64_t max_bytes,
+                          DCMakeOptions_t *options) {
   size_t file_path_size = computeMaxFilePathSize(cache_directory_path);
   char file_path[file_path_size];
   bool data_file_created_successfully, dirs_created_successfully;
-  computeCachePath(cache_directory_path, file_path, file_path_size);
-  data_file_created_successfully = createDataFile(file_path, num_lines, max_bytes);
+  // Without options the table keeps the legacy hashing and layout, but stores its fingerprints so
+  // that loading it after a clean close doesn't have to build them from the lines
+  DCCacheHeader_t header = {.num_lines=num_lines, .max_bytes=max_bytes, .magic=DC_HEADER_MAGIC,
+                            .version=DC_HEADER_VERSION, .hash_engine=DC_HASH_SHA1,
+                            .num_ways=DEFAULT_NUM_WAYS, .fingerprint_bits=8,
+                            .time_epoch_in_ms=currentTimeInMSFromEpoch()};
+
+  if (options) {
+    if (options->hash_engine != DC_HASH_SHA1 && options->hash_engine != DC_HASH_FAST128) {
+      fprintf(stderr, "ERROR: Unknown hash engine %d\n", (int) options->hash_engine);
+      return NULL;
+    }
+    if (options->table_layout > DC_LAYOUT_BUCKETED_TWO_CHOICE) {
+      fprintf(stderr, "ERROR: Unknown table layout %d\n", (int) options->table_layout);
+      return NULL;
+    }
+    if (options->fingerprint_bits != 0 && options->fingerprint_bits != 8 &&
+        options->fingerprint_bits != 16) {
+      fprintf(stderr, "ERROR: Fingerprints must be 0, 8 or 16 bits\n");
+      return NULL;
+    }
+    if (!isSupportedNumWays(options->num_ways)) {
+      fprintf(stderr, "ERROR: num_ways must be 2, 4, 8 or 16\n");
+      return NULL;
+    }
+    if (options->line_format > DC_LINE_FORMAT_COLUMNAR ||
+        (options->line_format == DC_LINE_FORMAT_COMPACT &&
+         options->table_layout != DC_LAYOUT_BUCKETED)) {
+      fprintf(stderr, "ERROR: Compact lines require the bucketed layout\n");
+      return NULL;
+    }
+    if (options->replacement_policy > DC_POLICY_GDSF ||
+        (options->line_format == DC_LINE_FORMAT_COMPACT &&
+         options->replacement_policy != DC_POLICY_LRU)) {
+      fprintf(stderr, "ERROR: Unknown replacement policy, or not LRU with compact lines\n");
+      return NULL;
+    }
+    if (options->storage > DC_STORAGE_SLOTS ||
+        (options->storage == DC_STORAGE_SEGMENTS && options->segment_size < MIN_SEGMENT_SIZE) ||
+        (options->storage == DC_STORAGE_SLOTS &&
+         (options->slot_size == 0 || options->slot_size > MAX_SLOT_SIZE))) {
+      fprintf(stderr, "ERROR: Unknown storage, segments smaller than 64 KB or slots over 1 GB\n");
+      return NULL;
+    }
+    if (options->inline_value_bytes > MAX_INLINE_VALUE_BYTES) {
+      fprintf(stderr, "ERROR: Inline values can be at most %d bytes\n", MAX_INLINE_VALUE_BYTES);
+      return NULL;
+    }
+    header.hash_engine = options->hash_engine;
+    header.table_layout = options->table_layout;
+    header.fingerprint_bits = options->fingerprint_bits;
+    header.cuckoo_max_kicks = options->cuckoo_max_kicks < MAX_CUCKOO_KICKS ?
+                              options->cuckoo_max_kicks : MAX_CUCKOO_KICKS;
+    header.num_ways = options->num_ways;
+    header.line_format = options->line_format;
+    header.replacement_policy = options->replacement_policy;
+    header.storage = options->storage;
+    header.segment_size = options->storage == DC_STORAGE_SEGMENTS ? options->segment_size : 0;
+    header.inline_value_bytes = options->inline_value_bytes;
+    header.slot_size = options->storage == DC_STORAGE_SLOTS ? options->slot_size : 0;
+    if (header.line_format == DC_LINE_FORMAT_COMPACT) {
+      header.cuckoo_max_kicks = 0; // Relocating needs the whole digest, which compact lines lack
+    }
+    if (header.storage == DC_STORAGE_SLOTS) {
+      header.cuckoo_max_kicks = 0; // A value is at its line's position, relocating would copy it
+    }
+    // Only whole buckets; a partial one at the end would never be used
+    uint32_t bucket_lines = linesPerBucket(header.table_layout, header.num_ways);
+    header.num_lines = (num_lines + bucket_lines - 1) / bucket_lines * bucket_lines;
+    if (options->seed_hash) {
+      uint64_t seed[2];
+      randomSeed(seed);
+      header.hash_seed[0] = seed[0];
+      header.hash_seed[1] = seed[1];
+    }
+  }
+
+  computeCachePath(cache_directory_path, CACHE_FN, file_path);
+  data_file_created_successfully = createDataFile(file_path, &header);
 
   if (!data_file_created_successfully) {
     return NULL;
   }
 
+  if (header.storage == DC_STORAGE_SLOTS) {
+    computeCachePath(cache_directory_path, SLOTS_FN, file_path);
+    if (!createSlotsFile(file_path, (uint64_t) header.num_lines * header.slot_size)) {
+      return NULL;
+    }
+  }
+
   dirs_created_successfully = createSubDirs(cache_directory_path);
   if (!dirs_created_successfully) {
     return NULL;
@@ -86,119 +492,304 @@ DCCache DCMake(char *cache_directory_path, uint32_t num_lines, uint64_t max_byte
 //TODO: Implement a LOAD or Make function
 
 DCCache DCLoad(char *cache_directory_path) {
-  size_t file_path_size = computeMaxFilePathSize(cache_directory_path);
-  char file_path[file_path_size];
-  computeCachePath(cache_directory_path, file_path, file_path_size);
+  return DCLoadWithOptions(cache_directory_path, NULL);
+}
 
-  DCCache cache = calloc(1, sizeof(DCCache_t));
-  cache->fd = open(file_path, O_RDWR);
+void DCLoadOptionsInit(DCLoadOptions_t *options) {
+  options->populate = false;
+  options->huge_pages = false;
+  options->lock = false;
+}
 
-  // We failed to open it; return NULL
-  if (cache->fd < 0) {
-    free(cache);
-    return NULL;
-  }
-  cache->directory_path = strdup(cache_directory_path); // cache_directory_path could be freed
+DCCache DCLoadWithOptions(char *cache_directory_path, DCLoadOptions_t *options) {
+  char file_path[computeMaxFilePathSize(cache_directory_path)];
+  DCLoadOptions_t default_options;
+  computeCachePath(cache_directory_path, CACHE_FN, file_path);
 
-  //Read in the header
-  size_t amt_read;
-  amt_read = read(cache->fd, &(cache->header), sizeof(DCCacheHeader_t));
-  if (amt_read != sizeof(DCCacheHeader_t)) {
-    fprintf(stderr, "ERROR: Unable to read cache header\n");
-    return NULL;
+  if (!options) {
+    DCLoadOptionsInit(&default_options);
+    options = &default_options;
   }
-
-  if (cache->header.num_lines == 0) {
-    fprintf(stderr, "ERROR: Cache Header is Invalid\n");
-    return NULL;
+  unlinkFilesQueuedBeforeCrash(cache_directory_path);
+  DCCache cache = loadTable(cache_directory_path, file_path, options);
+  if (cache) {
+    resumeResize(cache);
+    cache->pins = calloc(1, sizeof(struct DCPins_s));
+    if (cache->resize_source) {
+      cache->resize_source->pins = cache->pins;
+    }
   }
-
-  //mmap the lines
-  size_t lines_start_offset = sizeof(DCCacheHeader_t); // The lines starts after the header
-  size_t lines_size = cache->header.num_lines * sizeof(DCCacheLine_t);
-  size_t total_file_size = lines_start_offset + lines_size;
-  cache->mmap_start = mmap(0, total_file_size, PROT_READ | PROT_WRITE, MAP_SHARED, cache->fd, 0);
-  if (cache->mmap_start == MAP_FAILED) {
-    fprintf(stderr, "Map Failed! fd=%d, lines_size=%d, error:%s\n", (int)cache->fd, (int)lines_size,
-            strerror(errno));
-    return NULL; // If it's corrupt, we it might as well not exist
+  if (cache && cache->header.storage == DC_STORAGE_SEGMENTS && !openSegments(cache)) {
+    DCCloseAndFree(cache);
+    return NULL;
   }
-  cache->lines = cache->mmap_start + lines_start_offset;
-  recomputeCacheSizeFromLines(cache);
   return cache;
 }
 
 void DCCloseAndFree(DCCache cache) {
-  size_t lines_size = cache->header.num_lines * sizeof(DCCacheLine_t);
-  munmap(cache->lines, lines_size);
-  close(cache->fd);
-  free(cache->directory_path);
-  free(cache);
+  struct DCSegments_s *segments = cache->segments;
+  struct DCPins_s *pins = cache->pins;
+  DCStopEvictor(cache);
+  DCStopDeferredUnlink(cache);
+  DCSetAdmissionFilter(cache, false);
+  DCSetDataPool(cache, 0, 0);
+
+  // An unfinished resize is left on disk, the next DCLoad resumes it. The size is then shared by
+  // two tables, so they are left to be scanned
+  if (cache->resize_source) {
+    closeTable(cache->resize_source);
+  } else {
+    markClosedCleanly(cache);
+  }
+  closeTable(cache);
+  if (segments) {
+    closeSegments(segments);
+  }
+  if (pins) {
+    free(pins->pins);
+    free(pins);
+  }
 }
 
 bool DCAdd(DCCache cache, char *key, uint8_t *data, uint64_t data_len) {
-  uint64_t key_sha1[2];
-  SHA1ForKey(key, key_sha1);
+  return DCAddBin(cache, key, strlen(key), data, data_len);
+}
+
+bool DCAddBin(DCCache cache, const void *key, size_t key_len, uint8_t *data, uint64_t data_len) {
+  DCKey_t dc_key;
+  DCKeyMake(cache, key, key_len, &dc_key);
+  return DCAddKey(cache, &dc_key, data, data_len);
+}
+
+bool DCAddKey(DCCache cache, DCKey_t *key, uint8_t *data, uint64_t data_len) {
+  return DCAddKeyWithOptions(cache, key, data, data_len, NULL);
+}
+
+void DCAddOptionsInit(DCAddOptions_t *options) {
+  options->ttl_in_seconds = 0;
+  options->cost = 1;
+}
+
+bool DCAddWithOptions(DCCache cache, char *key, uint8_t *data, uint64_t data_len, DCAddOptions_t *options) {
+  DCKey_t dc_key;
+  DCKeyMake(cache, key, strlen(key), &dc_key);
+  return DCAddKeyWithOptions(cache, &dc_key, data, data_len, options);
+}
+
+bool DCAddKeyWithOptions(DCCache cache, DCKey_t *key, uint8_t *data, uint64_t data_len, DCAddOptions_t *options) {
+  DCAddOptions_t default_options;
+  if (!options) {
+    DCAddOptionsInit(&default_options);
+    options = &default_options;
+  }
+  if (options->ttl_in_seconds && cache->compact_lines) {
+    fprintf(stderr, "ERROR: Compact lines have no room for an expiry\n");
+    return false;
+  }
+  lockCache(cache);
+  bool added = addKey(cache, key, data, data_len, options);
+  unlockCache(cache);
+  return added;
+}
+
+bool DCAddWithTTL(DCCache cache, char *key, uint8_t *data, uint64_t data_len, uint32_t ttl_in_seconds) {
+  DCKey_t dc_key;
+  DCKeyMake(cache, key, strlen(key), &dc_key);
+  return DCAddKeyWithTTL(cache, &dc_key, data, data_len, ttl_in_seconds);
+}
+
+bool DCAddKeyWithTTL(DCCache cache, DCKey_t *key, uint8_t *data, uint64_t data_len, uint32_t ttl_in_seconds) {
+  DCAddOptions_t options;
+  DCAddOptionsInit(&options);
+  options.ttl_in_seconds = ttl_in_seconds;
+  return DCAddKeyWithOptions(cache, key, data, data_len, &options);
+}
+
+static bool addKey(DCCache cache, DCKey_t *key, uint8_t *data, uint64_t data_len, DCAddOptions_t *options) {
+  uint64_t file_id[2];
+  uint64_t now;
 
-  // Remove the line if already exists, otherwise find the best candidate and remove it
-  DCCacheLine_t *line_to_replace = findLineThatMatchesKey(cache, key_sha1);
-  if (line_to_replace) {
+  advanceResize(cache);
+  prepareKey(cache, key);
+
+  // Remove the line if already exists, in this table or in the one being resized from
+  uint32_t line_to_replace = findLineThatMatchesKey(cache, key);
+  bool replaces_key = line_to_replace != NO_LINE;
+  if (replaces_key) {
     removeLine(cache, line_to_replace);
-  } else {
-    line_to_replace = findBestLineToWriteKeyTo(cache, key_sha1);
-    if (isLineUsed(line_to_replace)) {
-      removeLine(cache, line_to_replace);
+  } else if (cache->resize_source) {
+    replaces_key = removeKeyFromResizeSource(cache, key);
+  }
+
+  // Turn the key away before anything is evicted to make room in bytes for it. A new value of a
+  // key that is in the cache was let in before, so it isn't checked: its old value is already gone
+  bool check_admission = cache->admission_filter && !replaces_key;
+  if (cache->admission_filter) {
+    sketchIncrement(cache->admission_filter, key->digest[0] ^ key->digest[1]);
+    if (check_admission && !admitKey(cache, key, data_len)) {
+      return false;
     }
   }
 
+  // Evict before picking the line, eviction finishes a resize which moves lines around
   maybeEvict(cache, data_len);
 
+  // Find the best candidate and remove it, unless the key that holds it is used more. A key that
+  // gets a free line, if need be by moving others, doesn't evict anything so is always let in
+  line_to_replace = findLineToClaimForKey(cache, key);
+  if (isLineUsed(cache, line_to_replace)) {
+    if (check_admission && !admitKeyOverLine(cache, key, line_to_replace)) {
+      return false;
+    }
+    for (int i=0; i < cache->num_ways; i++) {
+      if (key->indicies[i] != line_to_replace) {
+        policyOnSpared(cache, key->indicies[i]);
+      }
+    }
+    evictLine(cache, line_to_replace);
+  }
+
   // Set the line state
-  line_to_replace->last_access_time_in_ms_from_epoch = currentTimeInMSFromEpoch();
-  line_to_replace->key_sha1[0] = key_sha1[0];
-  line_to_replace->key_sha1[1] = key_sha1[1];
-  line_to_replace->size_in_bytes = data_len;
-  line_to_replace->flags = 0; // We currently don't have any flags
+  now = currentTimeInMSFromEpoch();
+  writeLine(cache, line_to_replace, key->digest, now, data_len);
+  policyOnInsert(cache, line_to_replace, key, options->cost);
+  if (options->ttl_in_seconds) {
+    setLineExpiry(cache, line_to_replace, now + (uint64_t) options->ttl_in_seconds * 1000);
+  }
+  setFingerprint(cache, line_to_replace, key->fingerprint);
 
   // Increment the cache size
   cache->current_size_in_bytes += data_len;
+  if (cache->evictor && !cache->evictor->evicting && evictorShouldRun(cache)) {
+    pthread_cond_signal(&cache->evictor->wake);
+  }
+
+  // Tiny values go in the line's inline slot, values that fit it in the line's slot of the slots
+  // file, small values are appended to a segment, the rest get a file of their own
+  if (isLineInline(cache, line_to_replace)) {
+    memcpy(inlineValueSlot(cache, line_to_replace), data, data_len);
+    return true;
+  }
+  if (isLineInSlot(cache, line_to_replace)) {
+    if (pwrite(cache->slots_fd, data, data_len, slotOffset(cache, line_to_replace)) != (ssize_t) data_len) {
+      fprintf(stderr, "ERROR: Unable to write to the slots: %s\n", strerror(errno));
+      removeLine(cache, line_to_replace);
+      return false;
+    }
+    return true;
+  }
+  if (cache->segments && data_len <= cache->segments->max_value_size) {
+    if (!appendToSegment(cache, line_to_replace, data, data_len)) {
+      removeLine(cache, line_to_replace);
+      return false;
+    }
+    return true;
+  }
 
   // Save the actual file
-  return saveDataFileForKey(cache, key_sha1, data, data_len);
+  fileIdForKey(cache, key, file_id);
+  return saveDataFileForKey(cache, file_id, data, data_len);
 }
 
 void DCRemove(DCCache cache, char *key) {
-  uint64_t key_sha1[2];
-  DCCacheLine_t *line;
+  DCRemoveBin(cache, key, strlen(key));
+}
+
+void DCRemoveBin(DCCache cache, const void *key, size_t key_len) {
+  DCKey_t dc_key;
+  DCKeyMake(cache, key, key_len, &dc_key);
+  DCRemoveKey(cache, &dc_key);
+}
+
+void DCRemoveKey(DCCache cache, DCKey_t *key) {
+  lockCache(cache);
+  removeKey(cache, key);
+  unlockCache(cache);
+}
 
-  SHA1ForKey(key, key_sha1);
+static void removeKey(DCCache cache, DCKey_t *key) {
+  uint32_t line;
 
-  line = findLineThatMatchesKey(cache, key_sha1);
+  advanceResize(cache);
+  prepareKey(cache, key);
+  line = findLineThatMatchesKey(cache, key);
 
-  if (line) {
+  if (line != NO_LINE) {
     removeLine(cache, line);
+  } else if (cache->resize_source) {
+    removeKeyFromResizeSource(cache, key);
   }
 }
 
 DCData DCLookup(DCCache cache, char *key) {
-  uint64_t key_sha1[2];
-  DCCacheLine_t *line;
-  DCData result_to_return;
+  return DCLookupBin(cache, key, strlen(key));
+}
 
-  SHA1ForKey(key, key_sha1);
+DCData DCLookupBin(DCCache cache, const void *key, size_t key_len) {
+  DCKey_t dc_key;
+  DCKeyMake(cache, key, key_len, &dc_key);
+  return DCLookupKey(cache, &dc_key);
+}
 
-  line = findLineThatMatchesKey(cache, key_sha1);
+DCData DCLookupKey(DCCache cache, DCKey_t *key) {
+  lockCache(cache);
+  DCData result = lookupKey(cache, key, NULL);
+  unlockCache(cache);
+  return result;
+}
 
-  // None was found we don't have this data
-  if (!line) {
+DCData DCLookupStale(DCCache cache, char *key, bool *is_stale) {
+  DCKey_t dc_key;
+  DCKeyMake(cache, key, strlen(key), &dc_key);
+  return DCLookupKeyStale(cache, &dc_key, is_stale);
+}
+
+DCData DCLookupKeyStale(DCCache cache, DCKey_t *key, bool *is_stale) {
+  lockCache(cache);
+  DCData result = lookupKey(cache, key, is_stale);
+  unlockCache(cache);
+  return result;
+}
+
+bool DCLookupInto(DCCache cache, char *key, uint8_t *buf, uint64_t cap, uint64_t *len) {
+  DCKey_t dc_key;
+  DCKeyMake(cache, key, strlen(key), &dc_key);
+  return DCLookupKeyInto(cache, &dc_key, buf, cap, len);
+}
+
+bool DCLookupKeyInto(DCCache cache, DCKey_t *key, uint8_t *buf, uint64_t cap, uint64_t *len) {
+  lockCache(cache);
+  bool found = lookupKeyInto(cache, key, buf, cap, len);
+  unlockCache(cache);
+  return found;
+}
+
+DCMappedData DCLookupMapped(DCCache cache, char *key) {
+  DCKey_t dc_key;
+  DCKeyMake(cache, key, strlen(key), &dc_key);
+  return DCLookupKeyMapped(cache, &dc_key);
+}
+
+DCMappedData DCLookupKeyMapped(DCCache cache, DCKey_t *key) {
+  lockCache(cache);
+  DCMappedData result = lookupKeyMapped(cache, key);
+  unlockCache(cache);
+  return result;
+}
+
+/* Look the key up. If is_stale is NULL expired keys are misses, otherwise they are returned and
+ * is_stale is set to whether the key expired
+ */
+static DCData lookupKey(DCCache cache, DCKey_t *key, bool *is_stale) {
+  DCData result_to_return;
+  uint32_t line = findLineForLookup(cache, key, is_stale);
+
+  if (line == NO_LINE) {
     return NULL;
   }
 
-  //Update the line's last accessed time
-  line->last_access_time_in_ms_from_epoch = currentTimeInMSFromEpoch();
-
-  //Return the file
-  result_to_return = readDataFileForKey(cache, key_sha1);
+  //Return the file, the value's range of its segment, its slot or its inline value
+  result_to_return = readValue(cache, line);
 
   //Check if the the cache is inconsistent: we think we have a key but no file exists
   if (!result_to_return) {
@@ -207,376 +798,3527 @@ DCData DCLookup(DCCache cache, char *key) {
   return result_to_return;
 }
 
+static DCMappedData lookupKeyMapped(DCCache cache, DCKey_t *key) {
+  uint32_t line = findLineForLookup(cache, key, NULL);
+  DCMappedData result_to_return;
+
+  if (line == NO_LINE) {
+    return NULL;
+  }
+  result_to_return = mapValue(cache, line, key);
+  if (!result_to_return) {
+    removeLine(cache, line);
+  }
+  return result_to_return;
+}
+
+static bool lookupKeyInto(DCCache cache, DCKey_t *key, uint8_t *buf, uint64_t cap, uint64_t *len) {
+  uint32_t line = findLineForLookup(cache, key, NULL);
+
+  if (line == NO_LINE) {
+    return false;
+  }
+  if (!readValueInto(cache, line, buf, cap, len)) {
+    removeLine(cache, line);
+    return false;
+  }
+  return true;
+}
+
 void DCEvictToSize(DCCache cache, uint64_t allowed_bytes) {
-  int num_used_lines;
+  lockCache(cache);
+  evictToSize(cache, allowed_bytes);
+  if (cache->segments) {
+    compactSegments(cache);
+  }
+  unlockCache(cache);
+}
+
+static void evictToSize(DCCache cache, uint64_t allowed_bytes) {
+  int num_sortables;
   // We don't have evict if we are already below allowed_bytes
   if (cache->current_size_in_bytes <= allowed_bytes) {
     return;
   }
 
-  LineSortable_t *sortables = lineSortablesFromOldestToNewest(cache, &num_used_lines);
+  // The oldest lines may still be in the old table of a resize; move them all first
+  resizeStep(cache, UINT32_MAX);
+
+  LineSortable_t *sortables = lineSortablesFromOldestToNewest(cache,
+                                                              cache->current_size_in_bytes - allowed_bytes,
+                                                              &num_sortables);
   //Sort {line_pos, last_access_time_in_ms_from_epoch} by last_access_time_in_ms_from_epoch asc
     // Keep deleting until we're under allowed_bytes
-  for (int i=0; i < num_used_lines; i++) {
+  for (int i=0; i < num_sortables; i++) {
     // We've hit the target size; we're done
     if (cache->current_size_in_bytes <= allowed_bytes) {
       break;
     }
 
     // Otherwise let's cheap lopping lines out of the cache
-    DCCacheLine_t *line = sortables[i].line;
-    removeLine(cache, line);
+    evictLine(cache, sortables[i].line_idx);
   }
 
   free(sortables);
 }
 
-void DCDataFree(DCData data) {
-  free(data->data);
-  free(data);
+bool DCResize(DCCache cache, uint32_t new_num_lines) {
+  lockCache(cache);
+  bool resized = resize(cache, new_num_lines);
+  unlockCache(cache);
+  return resized;
 }
 
+static bool resize(DCCache cache, uint32_t new_num_lines) {
+  char path[computeMaxFilePathSize(cache->directory_path)];
+  char new_path[computeMaxFilePathSize(cache->directory_path)];
+  char source_path[computeMaxFilePathSize(cache->directory_path)];
+  uint32_t bucket_lines = linesPerBucket(cache->header.table_layout, cache->num_ways);
+  DCCacheHeader_t header = cache->header;
 
-/***Public debugging functions***/
+  if (new_num_lines == 0) {
+    fprintf(stderr, "ERROR: A cache needs at least one line\n");
+    return false;
+  }
+  // A compact line's bucket is part of its key, which can't be recomputed for a new table size
+  if (cache->compact_lines) {
+    fprintf(stderr, "ERROR: Caches with compact lines can't be resized\n");
+    return false;
+  }
+  // Nor can the values in slots move to the positions of the new table while it is used
+  if (cache->slots_fd >= 0) {
+    fprintf(stderr, "ERROR: Caches with slot storage can't be resized\n");
+    return false;
+  }
 
+  // Only one resize at a time
+  resizeStep(cache, UINT32_MAX);
 
-void DCPrint(DCCache cache) {
-  // Note: In this function we cast to long long unsigned instead of using the PRIu64 from
-  // inttypes, this is because these format strings appear more readable to the author
-  printf("***PRINTING CACHE DATA***\n");
-  printf("\tDirectory Path: %s\n", cache->directory_path);
-  printf("\tHeader num_lines: %d\n", cache->header.num_lines);
-  printf("\tHeader max_bytes: %llu\n", (long long unsigned) cache->header.max_bytes);
-  printf("\tfd: %d\n", cache->fd);
-  printf("\tcurrent_size_in_bytes: %llu\n", (long long unsigned) cache->current_size_in_bytes);
-  printf("\tlines address: %llx\n", (long long unsigned) cache->lines);
-  printf("\tmmap_start address: %llx\n", (long long unsigned) cache->mmap_start);
-  for (uint32_t i=0; i < cache->header.num_lines; i++) {
-    DCCacheLine_t *line = cache->lines + i;
-    if (line->last_access_time_in_ms_from_epoch == 0) {
-      printf("\t\tLine %03d: EMPTY\n", i);
-    } else {
-      printf("\t\tLine %03d: %016llx%016llx | %llu ms | %x flags | %u bytes\n", i,
-             (long long unsigned) line->key_sha1[0], (long long unsigned) line->key_sha1[1],
-             (long long unsigned) line->last_access_time_in_ms_from_epoch, line->flags,
-             line->size_in_bytes);
-    }
+  // Everything but the size carries over, a legacy cache gets the extended header
+  header.num_lines = (new_num_lines + bucket_lines - 1) / bucket_lines * bucket_lines;
+  header.magic = DC_HEADER_MAGIC;
+  header.version = DC_HEADER_VERSION;
+  header.num_ways = cache->num_ways;
+
+  computeCachePath(cache->directory_path, CACHE_FN, path);
+  computeCachePath(cache->directory_path, RESIZE_NEW_FN, new_path);
+  computeCachePath(cache->directory_path, RESIZE_SOURCE_FN, source_path);
+  if (!createDataFile(new_path, &header)) {
+    return false;
   }
-}
 
-int DCNumItems(DCCache cache) {
-  int items_count = 0;
+  // Keep the old table under a second name, then swap the new one in with a single rename. Until
+  // the rename happens both names are the same file, which DCLoad treats as no resize at all
+  if (link(path, source_path)) {
+    fprintf(stderr, "ERROR: Unable to link '%s': %s\n", source_path, strerror(errno));
+    remove(new_path);
+    return false;
+  }
+  if (rename(new_path, path)) {
+    fprintf(stderr, "ERROR: Unable to rename '%s': %s\n", new_path, strerror(errno));
+    remove(source_path);
+    remove(new_path);
+    return false;
+  }
 
-  for (int i=0; i < cache->header.num_lines; i++) {
-    if (isLineUsed(cache->lines + i)) {
-      items_count ++;
-    }
+  // From here on the old table is the resize source; if the new one can't be mapped we keep using
+  // the old one and the next DCLoad does the migration
+  DCCache table = loadTable(cache->directory_path, path, &cache->load_options);
+  if (!table) {
+    return false;
   }
+  DCCache source = malloc(sizeof(DCCache_t));
+  *source = *cache;
+  *cache = *table;
+  free(table);
+  carryOverSettings(cache, source);
+  cache->current_size_in_bytes = source->current_size_in_bytes;
+  cache->resize_source = source;
+  cache->resize_cursor = 0;
+  return true;
+}
 
-  return items_count;
+bool DCResizeStep(DCCache cache, uint32_t max_lines) {
+  lockCache(cache);
+  bool done = resizeStep(cache, max_lines);
+  unlockCache(cache);
+  return done;
 }
 
+static bool resizeStep(DCCache cache, uint32_t max_lines) {
+  DCCache source = cache->resize_source;
 
-/***STATIC HELPERS***/
-static size_t computeMaxFilePathSize(char *cache_directory_path) {
-  return FILENAME_MAX_LEN + strlen(cache_directory_path);
+  if (!source) {
+    return true;
+  }
+  for (uint32_t i=0; i < max_lines && cache->resize_cursor < source->header.num_lines; i++) {
+    if (isLineUsed(source, cache->resize_cursor)) {
+      migrateLine(cache, cache->resize_cursor);
+    }
+    cache->resize_cursor ++;
+  }
+  if (cache->resize_cursor == source->header.num_lines) {
+    finishResize(cache);
+  }
+  return !cache->resize_source;
 }
 
-static void computeCachePath(char *cache_directory_path, char *dest, int dest_len) {
-  sprintf(dest, "%s/%s", cache_directory_path, CACHE_FN);
+bool DCConvertLineFormat(DCCache cache, DCLineFormat_t line_format) {
+  lockCache(cache);
+  bool converted = convertLineFormat(cache, line_format);
+  unlockCache(cache);
+  return converted;
 }
 
-static bool createDataFile(char *file_path, uint32_t num_lines, uint64_t max_bytes) {
-  FILE *outfile = fopen(file_path, "w");
+static bool convertLineFormat(DCCache cache, DCLineFormat_t line_format) {
+  char path[computeMaxFilePathSize(cache->directory_path)];
+  char new_path[computeMaxFilePathSize(cache->directory_path)];
+  char data_path[computeMaxFilePathSize(cache->directory_path)];
+  char new_data_path[computeMaxFilePathSize(cache->directory_path)];
+  uint32_t num_ways = cache->num_ways;
+  bool to_compact = line_format == DC_LINE_FORMAT_COMPACT;
+  DCCacheHeader_t header = cache->header;
 
-  if (!outfile) {
+  if (header.line_format == line_format) {
+    return true;
+  }
+  if (line_format > DC_LINE_FORMAT_COLUMNAR || header.line_format == DC_LINE_FORMAT_COMPACT) {
+    fprintf(stderr, "ERROR: Can't convert from line format %u to %d\n", header.line_format,
+            (int) line_format);
+    return false;
+  }
+  if (to_compact && header.replacement_policy != DC_POLICY_LRU) {
+    fprintf(stderr, "ERROR: Compact lines have no flags for the replacement policy\n");
+    return false;
+  }
+  // Lines move to other positions, which the old table's segment locations and slots would have to follow
+  if (to_compact && (cache->segments || cache->slots_fd >= 0)) {
+    fprintf(stderr, "ERROR: Caches with segment or slot storage can't be converted to compact lines\n");
+    return false;
+  }
+  resizeStep(cache, UINT32_MAX);
+
+  header.magic = DC_HEADER_MAGIC;
+  header.version = DC_HEADER_VERSION;
+  header.num_ways = num_ways;
+  header.line_format = line_format;
+  if (to_compact) {
+    header.num_lines = (header.num_lines + num_ways - 1) / num_ways * num_ways;
+    header.table_layout = DC_LAYOUT_BUCKETED;
+    header.cuckoo_max_kicks = 0;
+    // Compact times can't be earlier than the epoch, so start it at the oldest access
+    header.time_epoch_in_ms = currentTimeInMSFromEpoch();
+    for (uint32_t i=0; i < cache->header.num_lines; i++) {
+      if (isLineUsed(cache, i) && lineAccessTime(cache, i) < header.time_epoch_in_ms) {
+        header.time_epoch_in_ms = lineAccessTime(cache, i);
+      }
+    }
+  }
+
+  computeCachePath(cache->directory_path, CACHE_FN, path);
+  computeCachePath(cache->directory_path, RESIZE_NEW_FN, new_path);
+  if (!createDataFile(new_path, &header)) {
     return false;
   }
+  DCCache table = loadTable(cache->directory_path, new_path, &cache->load_options);
+  if (!table) {
+    remove(new_path);
+    return false;
+  }
+
+  // Copy every line to the new table. Unless the layout changes a line keeps its position; when it
+  // does (to compact lines) its data file gets its new name as well. The old names stay until the
+  // new table is swapped in, so the old table stays valid if we're interrupted
+  for (uint32_t i=0; i < cache->header.num_lines; i++) {
+    if (!isLineUsed(cache, i)) {
+      continue;
+    }
+    DCKey_t key = {.num_lines=0};
+    uint64_t access_time = lineAccessTime(cache, i);
+    uint32_t size = lineSize(cache, i);
+    lineDigest(cache, i, key.digest);
+    prepareKey(table, &key);
 
-  // Create the header
-  DCCacheHeader_t header = {.num_lines=num_lines, .max_bytes=max_bytes};
-  fwrite(&header, sizeof(DCCacheHeader_t), 1, outfile);
+    uint32_t to = to_compact ? findBestLineToWriteKeyTo(table, &key) : i;
+    if (isLineUsed(table, to)) {
+      if (lineAccessTime(table, to) >= access_time) {
+        continue; // No room for it; its data goes with the old names
+      }
+      removeLine(table, to);
+    }
+    writeLine(table, to, key.digest, access_time, size);
+    setLineFlags(table, to, lineFlags(cache, i));
+    setFingerprint(table, to, key.fingerprint);
+    if (table->locations) {
+      table->locations[to] = cache->locations[i];
+    }
+    if (isLineInline(table, to)) {
+      memcpy(inlineValueSlot(table, to), inlineValueSlot(cache, i), size);
+    }
+    table->current_size_in_bytes += size;
 
-  // Create the empty lines
-  uint32_t line_size = sizeof(DCCacheLine_t);
-  uint8_t line_buf[line_size];
-  bzero(line_buf, line_size);
-  for (uint32_t i=0; i < num_lines; i++) {
-    fwrite(line_buf, sizeof(uint8_t), line_size, outfile);
+    if (to_compact) {
+      uint64_t file_id[2];
+      if (isLineInline(table, to)) {
+        continue;
+      }
+      fileIdForKey(table, &key, file_id);
+      pathForSHA1(cache, key.digest, data_path);
+      pathForSHA1(table, file_id, new_data_path);
+      mkdirForSHA1IfNotExists(table, file_id);
+      remove(new_data_path);
+      if (link(data_path, new_data_path)) {
+        removeLine(table, to); // Its data is gone, so is it
+      }
+    }
   }
-  fclose(outfile);
-  return true;
-}
 
+  if (rename(new_path, path)) {
+    fprintf(stderr, "ERROR: Unable to rename '%s': %s\n", new_path, strerror(errno));
+    closeTable(table);
+    remove(new_path);
+    return false;
+  }
 
-// We want to create create subdirs from 00 to FF
-static bool createSubDirs(char *cache_directory_path) {
-  char subdir_path[strlen(cache_directory_path) + 16];
-  int mkdir_rv;
-  for (int i=0; i < 256; i++) {
-    sprintf(subdir_path, "%s/%02x", cache_directory_path, i);
-    mkdir_rv = mkdir(subdir_path, 0777);
-    if (mkdir_rv && errno != EEXIST) {
-      return false;
+  // The new table is in place, drop the old names and the old table
+  for (uint32_t i=0; i < cache->header.num_lines && to_compact; i++) {
+    if (isLineUsed(cache, i)) {
+      removeFileForLine(cache, i);
     }
   }
+  DCCache old_table = malloc(sizeof(DCCache_t));
+  *old_table = *cache;
+  *cache = *table;
+  free(table);
+  carryOverSettings(cache, old_table);
+  closeTable(old_table);
   return true;
 }
 
-static void computeLookupIndiciesForKey(uint64_t key_sha1[2], uint32_t indicies[NUM_LOOKUP_INDICIES], uint32_t num_lines) {
-  uint32_t *key_in_32_bit_chunks = (uint32_t*) key_sha1;
-  for (int i=0; i < NUM_LOOKUP_INDICIES; i++) {
-    indicies[i] = key_in_32_bit_chunks[i] % num_lines;
+uint64_t DCResidentBytes(DCCache cache) {
+  long page_size = sysconf(_SC_PAGESIZE);
+  uint64_t resident_bytes = 0;
+
+  lockCache(cache);
+  size_t num_pages = (cache->mmap_size + page_size - 1) / page_size;
+  unsigned char *pages_resident = malloc(num_pages);
+  if (mincore(cache->mmap_start, cache->mmap_size, (void *) pages_resident) == 0) {
+    for (size_t i=0; i < num_pages; i++) {
+      resident_bytes += (pages_resident[i] & 1) ? page_size : 0;
+    }
+  }
+  if (resident_bytes > cache->mmap_size) {
+    resident_bytes = cache->mmap_size; // The last page is only partly the mapping's
   }
+  unlockCache(cache);
+  free(pages_resident);
+  return resident_bytes;
 }
 
-static void removeLine(DCCache cache, DCCacheLine_t *line) {
-  cache->current_size_in_bytes -= line->size_in_bytes;
-  removeFileForLine(cache, line);
+void DCEvictorOptionsInit(DCEvictorOptions_t *options) {
+  options->high_watermark = 0.9;
+  options->low_watermark = 0.75;
+  options->max_evictions_per_second = 0;
+}
+
+bool DCStartEvictor(DCCache cache, DCEvictorOptions_t *options) {
+  struct DCEvictor_s *evictor = cache->evictor;
+
+  if (!(options->low_watermark > 0 && options->low_watermark <= options->high_watermark &&
+        options->high_watermark <= 1)) {
+    fprintf(stderr, "ERROR: Evictor watermarks must satisfy 0 < low <= high <= 1\n");
+    return false;
+  }
+
+  // Already running, just take the new options
+  if (evictor) {
+    pthread_mutex_lock(&evictor->lock);
+    evictor->options = *options;
+    pthread_cond_signal(&evictor->wake);
+    pthread_mutex_unlock(&evictor->lock);
+    return true;
+  }
+
+  evictor = calloc(1, sizeof(struct DCEvictor_s));
+  evictor->options = *options;
+  pthread_mutex_init(&evictor->lock, NULL);
+  pthread_cond_init(&evictor->wake, NULL);
+  cache->evictor = evictor;
+  if (pthread_create(&evictor->thread, NULL, evictorMain, cache)) {
+    fprintf(stderr, "ERROR: Unable to start the evictor thread: %s\n", strerror(errno));
+    cache->evictor = NULL;
+    pthread_cond_destroy(&evictor->wake);
+    pthread_mutex_destroy(&evictor->lock);
+    free(evictor);
+    return false;
+  }
+  return true;
+}
+
+void DCStopEvictor(DCCache cache) {
+  struct DCEvictor_s *evictor = cache->evictor;
+
+  if (!evictor) {
+    return;
+  }
+  pthread_mutex_lock(&evictor->lock);
+  evictor->stop = true;
+  pthread_cond_signal(&evictor->wake);
+  pthread_mutex_unlock(&evictor->lock);
+  pthread_join(evictor->thread, NULL);
+
+  cache->evictor = NULL;
+  pthread_cond_destroy(&evictor->wake);
+  pthread_mutex_destroy(&evictor->lock);
+  free(evictor);
+}
+
+bool DCStartDeferredUnlink(DCCache cache, uint32_t num_threads) {
+  char journal_path[computeMaxFilePathSize(cache->directory_path)];
+  struct DCUnlinker_s *unlinker;
+  size_t journal_size = UNLINK_QUEUE_CAPACITY * sizeof(uint64_t[2]);
+  int fd;
+
+  if (cache->unlinker) {
+    return true;
+  }
+  if (num_threads < 1 || num_threads > MAX_UNLINK_THREADS) {
+    fprintf(stderr, "ERROR: Deferred unlinking needs 1 to %d threads\n", MAX_UNLINK_THREADS);
+    return false;
+  }
+
+  // A sparse file, only the pages of the queue that were used take space
+  computeCachePath(cache->directory_path, UNLINKS_FN, journal_path);
+  fd = open(journal_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, journal_size)) {
+    fprintf(stderr, "ERROR: Unable to create %s: %s\n", journal_path, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return false;
+  }
+  unlinker = calloc(1, sizeof(struct DCUnlinker_s));
+  unlinker->slots = mmap(0, journal_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (unlinker->slots == MAP_FAILED) {
+    fprintf(stderr, "ERROR: Unable to map %s: %s\n", journal_path, strerror(errno));
+    free(unlinker);
+    remove(journal_path);
+    return false;
+  }
+  unlinker->directory_path = strdup(cache->directory_path);
+  pthread_mutex_init(&unlinker->lock, NULL);
+  pthread_cond_init(&unlinker->work, NULL);
+  pthread_cond_init(&unlinker->done, NULL);
+
+  for (; unlinker->num_threads < num_threads; unlinker->num_threads++) {
+    if (pthread_create(unlinker->threads + unlinker->num_threads, NULL, unlinkerMain, unlinker)) {
+      fprintf(stderr, "WARNING: Started %u of %u unlink threads: %s\n", unlinker->num_threads,
+              num_threads, strerror(errno));
+      break;
+    }
+  }
+  lockCache(cache);
+  cache->unlinker = unlinker;
+  unlockCache(cache);
+
+  // Without a single thread nothing would ever be unlinked
+  if (!unlinker->num_threads) {
+    DCStopDeferredUnlink(cache);
+    return false;
+  }
+  return true;
+}
+
+void DCDrainUnlinks(DCCache cache) {
+  struct DCUnlinker_s *unlinker = cache->unlinker;
+
+  if (!unlinker) {
+    return;
+  }
+  pthread_mutex_lock(&unlinker->lock);
+  while (unlinker->head != unlinker->tail) {
+    pthread_cond_wait(&unlinker->done, &unlinker->lock);
+  }
+  pthread_mutex_unlock(&unlinker->lock);
+}
+
+void DCStopDeferredUnlink(DCCache cache) {
+  char journal_path[computeMaxFilePathSize(cache->directory_path)];
+  struct DCUnlinker_s *unlinker = cache->unlinker;
+
+  if (!unlinker) {
+    return;
+  }
+  DCDrainUnlinks(cache);
+  lockCache(cache);
+  cache->unlinker = NULL;
+  unlockCache(cache);
+
+  pthread_mutex_lock(&unlinker->lock);
+  unlinker->stop = true;
+  pthread_cond_broadcast(&unlinker->work);
+  pthread_mutex_unlock(&unlinker->lock);
+  for (uint32_t i=0; i < unlinker->num_threads; i++) {
+    pthread_join(unlinker->threads[i], NULL);
+  }
+
+  // Every queued file was unlinked, so the queue can go
+  munmap(unlinker->slots, UNLINK_QUEUE_CAPACITY * sizeof(uint64_t[2]));
+  computeCachePath(cache->directory_path, UNLINKS_FN, journal_path);
+  remove(journal_path);
+  pthread_cond_destroy(&unlinker->done);
+  pthread_cond_destroy(&unlinker->work);
+  pthread_mutex_destroy(&unlinker->lock);
+  free(unlinker->directory_path);
+  free(unlinker);
+}
+
+void DCSetAccessTimeGranularity(DCCache cache, uint32_t granularity_in_ms) {
+  lockCache(cache);
+  cache->access_time_granularity_in_ms = granularity_in_ms;
+  unlockCache(cache);
+}
+
+bool DCSetAdmissionFilter(DCCache cache, bool enabled) {
+  lockCache(cache);
+  if (enabled && !cache->admission_filter) {
+    cache->admission_filter = makeSketch(cache->header.num_lines);
+  } else if (!enabled && cache->admission_filter) {
+    free(cache->admission_filter->counters);
+    free(cache->admission_filter);
+    cache->admission_filter = NULL;
+  }
+  bool is_enabled = cache->admission_filter != NULL;
+  unlockCache(cache);
+  return is_enabled == enabled;
+}
+
+void DCKeyMake(DCCache cache, const void *key, size_t key_len, DCKey_t *dest) {
+  digestForKey(cache, key, key_len, dest->digest);
+  dest->num_lines = 0;
+  prepareKey(cache, dest);
+}
+
+void DCKeyFromDigest(DCCache cache, const uint8_t digest[16], DCKey_t *dest) {
+  memcpy(dest->digest, digest, sizeof(dest->digest));
+  dest->num_lines = 0;
+  prepareKey(cache, dest);
+}
+
+bool DCSetDataPool(DCCache cache, uint32_t num_buffers, uint64_t buffer_size) {
+  struct DCDataPool_s *pool = NULL;
+
+  if (num_buffers) {
+    pool = calloc(1, sizeof(struct DCDataPool_s));
+    if (!pool || !(pool->free_data = calloc(num_buffers, sizeof(DCData)))) {
+      free(pool);
+      return false;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->max_data = num_buffers;
+    pool->buffer_size = buffer_size;
+  }
+  lockCache(cache);
+  if (cache->data_pool) {
+    dropDataPool(cache->data_pool);
+  }
+  cache->data_pool = pool;
+  unlockCache(cache);
+  return true;
+}
+
+void DCDataFree(DCData data) {
+  if (data->pool) {
+    returnPooledData(data);
+    return;
+  }
+  free(data->data);
+  free(data);
+}
+
+void DCMappedDataRelease(DCMappedData mapped) {
+  if (mapped->pin_kind) {
+    munmap(mapped->map_start, mapped->map_size);
+    lockCache(mapped->cache);
+    unpinValue(mapped->cache, mapped->pin_kind, mapped->pin_id);
+    unlockCache(mapped->cache);
+  } else {
+    free(mapped->map_start);
+  }
+  free(mapped);
+}
+
+
+/***Public debugging functions***/
+
+
+void DCPrint(DCCache cache) {
+  // Note: In this function we cast to long long unsigned instead of using the PRIu64 from
+  // inttypes, this is because these format strings appear more readable to the author
+  printf("***PRINTING CACHE DATA***\n");
+  printf("\tDirectory Path: %s\n", cache->directory_path);
+  printf("\tHeader num_lines: %d\n", cache->header.num_lines);
+  printf("\tHeader max_bytes: %llu\n", (long long unsigned) cache->header.max_bytes);
+  printf("\tHeader hash_engine: %s\n",
+         cache->header.hash_engine == DC_HASH_FAST128 ? "FAST128" : "SHA1");
+  printf("\tHeader hash_seed: %016llx%016llx\n", (long long unsigned) cache->header.hash_seed[0],
+         (long long unsigned) cache->header.hash_seed[1]);
+  printf("\tHeader fingerprint_bits: %u%s\n", cache->fingerprint_bits,
+         cache->fingerprints_in_memory ? " (in memory)" : "");
+  printf("\tHeader cuckoo_max_kicks: %u\n", cache->header.cuckoo_max_kicks);
+  printf("\tHeader num_ways: %u\n", cache->num_ways);
+  printf("\tHeader line_format: %s\n",
+         cache->header.line_format == DC_LINE_FORMAT_COMPACT ? "COMPACT" :
+         cache->header.line_format == DC_LINE_FORMAT_COLUMNAR ? "COLUMNAR" : "FULL");
+  printf("\tHeader table_layout: %s\n",
+         cache->header.table_layout == DC_LAYOUT_BUCKETED ? "BUCKETED" :
+         cache->header.table_layout == DC_LAYOUT_BUCKETED_TWO_CHOICE ? "BUCKETED_TWO_CHOICE" :
+         "SCATTERED");
+  printf("\tHeader replacement_policy: %s\n",
+         cache->header.replacement_policy == DC_POLICY_LFU ? "LFU" :
+         cache->header.replacement_policy == DC_POLICY_ARC ? "ARC" :
+         cache->header.replacement_policy == DC_POLICY_S3FIFO ? "S3FIFO" :
+         cache->header.replacement_policy == DC_POLICY_GDSF ? "GDSF" : "LRU");
+  printf("\tfd: %d\n", cache->fd);
+  printf("\tcurrent_size_in_bytes: %llu\n", (long long unsigned) cache->current_size_in_bytes);
+  printf("\tlines address: %llx\n", (long long unsigned) cache->lines);
+  printf("\tmmap_start address: %llx\n", (long long unsigned) cache->mmap_start);
+  if (cache->resize_source) {
+    printf("\tResizing from %u lines, %u migrated\n", cache->resize_source->header.num_lines,
+           cache->resize_cursor);
+  }
+  for (uint32_t i=0; i < cache->header.num_lines; i++) {
+    uint64_t digest[2];
+    if (!isLineUsed(cache, i)) {
+      printf("\t\tLine %03d: EMPTY\n", i);
+    } else if (cache->compact_lines) {
+      printf("\t\tLine %03d: %016llx | %llu ms | %u bytes\n", i,
+             (long long unsigned) cache->compact_lines[i].key_fingerprint,
+             (long long unsigned) lineAccessTime(cache, i), lineSize(cache, i));
+    } else {
+      lineDigest(cache, i, digest);
+      printf("\t\tLine %03d: %016llx%016llx | %llu ms | %u bytes\n", i,
+             (long long unsigned) digest[0], (long long unsigned) digest[1],
+             (long long unsigned) lineAccessTime(cache, i), lineSize(cache, i));
+    }
+  }
+}
+
+int DCNumItems(DCCache cache) {
+  lockCache(cache);
+  int items_count = cache->num_used_lines;
+
+  if (cache->resize_source) {
+    items_count += cache->resize_source->num_used_lines;
+  }
+  unlockCache(cache);
+
+  return items_count;
+}
+
+
+/***STATIC HELPERS***/
+static size_t computeMaxFilePathSize(char *cache_directory_path) {
+  return FILENAME_MAX_LEN + strlen(cache_directory_path);
+}
+
+static void computeCachePath(char *cache_directory_path, char *file_name, char *dest) {
+  sprintf(dest, "%s/%s", cache_directory_path, file_name);
+}
+
+/* Release what loadTable has opened for a table it then fails to load, before anything is mapped
+ */
+static void abandonLoad(DCCache cache) {
+  if (cache->slots_fd >= 0) {
+    close(cache->slots_fd);
+  }
+  close(cache->fd);
+  free(cache->directory_path);
+  free(cache);
+}
+
+/* Open and map a cache file. DCLoad uses it for the cache and for the old table of a resize.
+ */
+static DCCache loadTable(char *cache_directory_path, char *file_path, DCLoadOptions_t *options) {
+  DCCache cache = calloc(1, sizeof(DCCache_t));
+  cache->fd = open(file_path, O_RDWR);
+  cache->slots_fd = -1;
+  cache->load_options = *options;
+
+  // We failed to open it; return NULL
+  if (cache->fd < 0) {
+    free(cache);
+    return NULL;
+  }
+  cache->directory_path = strdup(cache_directory_path); // cache_directory_path could be freed
+
+  //Read in the header, legacy caches only have the first LEGACY_HEADER_SIZE bytes of it
+  ssize_t amt_read;
+  size_t lines_start_offset;
+  amt_read = read(cache->fd, &(cache->header), sizeof(DCCacheHeader_t));
+  if (amt_read < LEGACY_HEADER_SIZE) {
+    fprintf(stderr, "ERROR: Unable to read cache header\n");
+    abandonLoad(cache);
+    return NULL;
+  }
+
+  if (amt_read == sizeof(DCCacheHeader_t) && cache->header.magic == DC_HEADER_MAGIC) {
+    lines_start_offset = sizeof(DCCacheHeader_t);
+    if (cache->header.version > DC_HEADER_VERSION || cache->header.hash_engine > DC_HASH_FAST128 ||
+        cache->header.table_layout > DC_LAYOUT_BUCKETED_TWO_CHOICE ||
+        (cache->header.fingerprint_bits != 0 && cache->header.fingerprint_bits != 8 &&
+         cache->header.fingerprint_bits != 16) ||
+        (cache->header.num_ways != 0 && !isSupportedNumWays(cache->header.num_ways)) ||
+        cache->header.line_format > DC_LINE_FORMAT_COLUMNAR ||
+        cache->header.replacement_policy > DC_POLICY_GDSF ||
+        cache->header.storage > DC_STORAGE_SLOTS ||
+        cache->header.inline_value_bytes > MAX_INLINE_VALUE_BYTES) {
+      fprintf(stderr, "ERROR: Cache was created by a newer version of disk_cache\n");
+      abandonLoad(cache);
+      return NULL;
+    }
+  } else {
+    // A legacy cache: the lines start right after max_bytes and keys are unseeded SHA-1
+    lines_start_offset = LEGACY_HEADER_SIZE;
+    memset(((uint8_t *) &(cache->header)) + LEGACY_HEADER_SIZE, 0,
+           sizeof(DCCacheHeader_t) - LEGACY_HEADER_SIZE);
+    cache->header.hash_engine = DC_HASH_SHA1;
+  }
+
+  cache->num_ways = cache->header.num_ways ? cache->header.num_ways : DEFAULT_NUM_WAYS;
+  if (cache->header.num_lines == 0 ||
+      cache->header.num_lines % linesPerBucket(cache->header.table_layout, cache->num_ways) != 0 ||
+      (cache->header.line_format == DC_LINE_FORMAT_COMPACT &&
+       cache->header.table_layout != DC_LAYOUT_BUCKETED) ||
+      (cache->header.storage == DC_STORAGE_SEGMENTS && cache->header.segment_size < MIN_SEGMENT_SIZE) ||
+      (cache->header.storage == DC_STORAGE_SLOTS &&
+       (cache->header.slot_size == 0 || cache->header.slot_size > MAX_SLOT_SIZE))) {
+    fprintf(stderr, "ERROR: Cache Header is Invalid\n");
+    abandonLoad(cache);
+    return NULL;
+  }
+
+  // Open the slot file before anything is mapped or allocated for the table, so failing to is
+  // simple to undo
+  if (cache->header.storage == DC_STORAGE_SLOTS) {
+    char slots_path[computeMaxFilePathSize(cache_directory_path)];
+    computeCachePath(cache_directory_path, SLOTS_FN, slots_path);
+    cache->slots_fd = open(slots_path, O_RDWR);
+    if (cache->slots_fd < 0) {
+      fprintf(stderr, "ERROR: Unable to open '%s': %s\n", slots_path, strerror(errno));
+      abandonLoad(cache);
+      return NULL;
+    }
+  }
+
+  //mmap the lines and the fingerprints, segment locations and inline values that follow them
+  bool compact = cache->header.line_format == DC_LINE_FORMAT_COMPACT;
+  bool segmented = cache->header.storage == DC_STORAGE_SEGMENTS;
+  size_t lines_size = cache->header.num_lines * (compact ? sizeof(DCCompactLine_t) : sizeof(DCCacheLine_t));
+  size_t fingerprints_size = cache->header.num_lines * (cache->header.fingerprint_bits / 8);
+  size_t locations_size = segmented ? cache->header.num_lines * sizeof(DCSegmentLocation_t) : 0;
+  size_t inline_values_size = (size_t) cache->header.num_lines * cache->header.inline_value_bytes;
+  size_t total_file_size = lines_start_offset + lines_size + fingerprints_size + locations_size +
+                           inline_values_size;
+  struct stat file_stats;
+  if (fstat(cache->fd, &file_stats) || file_stats.st_size < total_file_size) {
+    fprintf(stderr, "ERROR: Cache file is shorter than its header says\n");
+    abandonLoad(cache);
+    return NULL;
+  }
+  // Huge pages have to be asked for before the table is faulted in, so MAP_POPULATE can only be
+  // used without them
+  int map_flags = MAP_SHARED;
+  bool touch_to_populate = options->populate;
+#ifdef MAP_POPULATE
+  if (options->populate && !options->huge_pages) {
+    map_flags |= MAP_POPULATE;
+    touch_to_populate = false;
+  }
+#endif
+  cache->mmap_start = mmap(0, total_file_size, PROT_READ | PROT_WRITE, map_flags, cache->fd, 0);
+  if (cache->mmap_start == MAP_FAILED) {
+    fprintf(stderr, "Map Failed! fd=%d, lines_size=%d, error:%s\n", (int)cache->fd, (int)lines_size,
+            strerror(errno));
+    abandonLoad(cache);
+    return NULL; // If it's corrupt, we it might as well not exist
+  }
+  cache->mmap_size = total_file_size;
+#ifdef MADV_HUGEPAGE
+  if (options->huge_pages) {
+    madvise(cache->mmap_start, total_file_size, MADV_HUGEPAGE); // Only a hint, not all files can
+  }
+#endif
+  if (touch_to_populate) {
+    touchPages(cache->mmap_start, total_file_size);
+  }
+  if (options->lock && mlock(cache->mmap_start, total_file_size)) {
+    // Not fatal, the table is just paged as usual (RLIMIT_MEMLOCK is often small)
+    fprintf(stderr, "WARNING: Unable to lock the cache table in memory: %s\n", strerror(errno));
+  }
+  void *lines_start = cache->mmap_start + lines_start_offset;
+  if (compact) {
+    cache->compact_lines = lines_start;
+  } else if (cache->header.line_format == DC_LINE_FORMAT_COLUMNAR) {
+    uint32_t num_lines = cache->header.num_lines;
+    cache->columns.last_access_times = lines_start;
+    cache->columns.key_sha1s = (void *) (cache->columns.last_access_times + num_lines);
+    cache->columns.sizes_in_bytes = (void *) (cache->columns.key_sha1s + num_lines);
+    cache->columns.flags = cache->columns.sizes_in_bytes + num_lines;
+  } else {
+    cache->lines = lines_start;
+  }
+
+  if (cache->header.fingerprint_bits) {
+    cache->fingerprints = cache->mmap_start + lines_start_offset + lines_size;
+    cache->fingerprint_bits = cache->header.fingerprint_bits;
+  } else {
+    cache->fingerprints = calloc(cache->header.num_lines, sizeof(uint8_t));
+    cache->fingerprint_bits = 8;
+    cache->fingerprints_in_memory = true;
+  }
+  if (segmented) {
+    cache->locations = cache->mmap_start + lines_start_offset + lines_size + fingerprints_size;
+  }
+  if (inline_values_size) {
+    cache->inline_values = cache->mmap_start + total_file_size - inline_values_size;
+  }
+
+  // The policy state outside the lines starts over with every load, only the lines persist
+  if (cache->header.replacement_policy == DC_POLICY_ARC ||
+      cache->header.replacement_policy == DC_POLICY_S3FIFO) {
+    cache->num_ghosts = cache->header.num_lines;
+    cache->ghosts = calloc(cache->num_ghosts, sizeof(uint16_t));
+  }
+  cache->probation_target = cache->header.replacement_policy == DC_POLICY_S3FIFO ?
+                            S3FIFO_SMALL_FRACTION : 0;
+  cache->probation_fraction = 1; // New keys start in probation, until eviction has seen the lines
+  cache->random_state = currentTimeInMSFromEpoch() | 1;
+
+  // After a clean close the header has everything a scan of the lines would find. A table without
+  // fingerprints in its file still has to read the lines to build them in memory
+  if (lines_start_offset == sizeof(DCCacheHeader_t)) {
+    DCCacheHeader_t *mapped_header = cache->mmap_start;
+    if (cache->header.closed_cleanly) {
+      cache->current_size_in_bytes = cache->header.current_size_in_bytes;
+      cache->num_used_lines = cache->header.num_used_lines;
+      if (cache->fingerprints_in_memory) {
+        rebuildFingerprints(cache);
+      }
+    } else {
+      recomputeStateFromLines(cache);
+    }
+    if (mapped_header->closed_cleanly) {
+      mapped_header->closed_cleanly = 0; // Until we're closed the lines may change under the header
+    }
+    cache->header.closed_cleanly = 0;
+  } else {
+    recomputeStateFromLines(cache);
+  }
+  return cache;
+}
+
+/* Fault a mapping in by reading a byte of every page, front to back so the kernel reads ahead.
+ */
+static void touchPages(void *start, size_t size) {
+  long page_size = sysconf(_SC_PAGESIZE);
+  volatile uint8_t *bytes = start;
+  uint8_t sum = 0;
+
+  for (size_t offset=0; offset < size; offset += page_size) {
+    sum += bytes[offset];
+  }
+  (void) sum;
+}
+
+/* Record the state of the lines in the header, see DCCacheHeader_t.closed_cleanly. Legacy headers
+ * have no room for it.
+ */
+static void markClosedCleanly(DCCache cache) {
+  DCCacheHeader_t *mapped_header = cache->mmap_start;
+
+  if (cache->header.magic != DC_HEADER_MAGIC) {
+    return;
+  }
+  mapped_header->current_size_in_bytes = cache->current_size_in_bytes;
+  mapped_header->num_used_lines = cache->num_used_lines;
+  mapped_header->closed_cleanly = 1;
+}
+
+static void closeTable(DCCache cache) {
+  munmap(cache->mmap_start, cache->mmap_size);
+  free(cache->ghosts);
+  if (cache->fingerprints_in_memory) {
+    free(cache->fingerprints);
+  }
+  close(cache->fd);
+  if (cache->slots_fd >= 0) {
+    close(cache->slots_fd);
+  }
+  free(cache->directory_path);
+  free(cache);
+}
+
+static bool createDataFile(char *file_path, DCCacheHeader_t *header) {
+  FILE *outfile = fopen(file_path, "w");
+  DCCacheHeader_t empty_header = *header;
+  uint64_t line_size = header->line_format == DC_LINE_FORMAT_COMPACT ? sizeof(DCCompactLine_t) :
+                       sizeof(DCCacheLine_t);
+  uint64_t location_size = header->storage == DC_STORAGE_SEGMENTS ? sizeof(DCSegmentLocation_t) : 0;
+  uint64_t file_size = sizeof(DCCacheHeader_t) +
+                       header->num_lines * (line_size + header->fingerprint_bits / 8 + location_size +
+                                            header->inline_value_bytes);
+  bool created;
+
+  if (!outfile) {
+    return false;
+  }
+
+  // The table is empty, which is known without a scan
+  empty_header.current_size_in_bytes = 0;
+  empty_header.num_used_lines = 0;
+  empty_header.closed_cleanly = 1;
+
+  // Write the header, the lines, fingerprints, locations and inline values are all zeros, which is what empty ones are. So
+  // the rest of the file is a hole the file system doesn't have to write out
+  created = fwrite(&empty_header, sizeof(DCCacheHeader_t), 1, outfile) == 1 && fflush(outfile) == 0 &&
+            ftruncate(fileno(outfile), file_size) == 0;
+  fclose(outfile);
+  if (!created) {
+    fprintf(stderr, "ERROR: Unable to create '%s': %s\n", file_path, strerror(errno));
+    remove(file_path);
+  }
+  return created;
+}
+
+/* Create the file of the DC_STORAGE_SLOTS slots with all of its space allocated, so writing a value
+ * never has to extend it or allocate blocks
+ */
+static bool createSlotsFile(char *file_path, uint64_t file_size) {
+  int fd = open(file_path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  int error = fd < 0 ? errno : posix_fallocate(fd, 0, file_size);
+
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (error) {
+    fprintf(stderr, "ERROR: Unable to create '%s': %s\n", file_path, strerror(error));
+    remove(file_path);
+    return false;
+  }
+  return true;
+}
+
+// We want to create create subdirs from 00 to FF
+static bool createSubDirs(char *cache_directory_path) {
+  char subdir_path[strlen(cache_directory_path) + 16];
+  int mkdir_rv;
+  for (int i=0; i < 256; i++) {
+    sprintf(subdir_path, "%s/%02x", cache_directory_path, i);
+    mkdir_rv = mkdir(subdir_path, 0777);
+    if (mkdir_rv && errno != EEXIST) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool isSupportedNumWays(uint32_t num_ways) {
+  return num_ways == 2 || num_ways == 4 || num_ways == 8 || num_ways == 16;
+}
+
+/* The number of adjacent lines that make up a bucket in the given layout (1 when scattered)
+ */
+static uint32_t linesPerBucket(uint32_t table_layout, uint32_t num_ways) {
+  switch (table_layout) {
+    case DC_LAYOUT_BUCKETED:
+      return num_ways;
+    case DC_LAYOUT_BUCKETED_TWO_CHOICE:
+      return num_ways / 2;
+    default:
+      return 1;
+  }
+}
+
+static void computeLookupIndiciesForKey(uint64_t key_sha1[2], uint32_t indicies[NUM_LOOKUP_INDICIES], uint32_t num_lines, uint32_t table_layout, uint32_t num_ways) {
+  uint32_t *key_in_32_bit_chunks = (uint32_t*) key_sha1;
+  uint32_t bucket_lines = linesPerBucket(table_layout, num_ways);
+  uint32_t num_buckets = num_lines / bucket_lines;
+  uint32_t first_bucket, second_bucket;
+
+  switch (table_layout) {
+    case DC_LAYOUT_BUCKETED:
+      first_bucket = key_in_32_bit_chunks[0] % num_buckets;
+      for (int i=0; i < num_ways; i++) {
+        indicies[i] = first_bucket * bucket_lines + i;
+      }
+      break;
+
+    case DC_LAYOUT_BUCKETED_TWO_CHOICE:
+      // The second bucket comes from the other half of the digest and must differ from the first
+      first_bucket = key_in_32_bit_chunks[0] % num_buckets;
+      second_bucket = key_in_32_bit_chunks[2] % num_buckets;
+      if (second_bucket == first_bucket) {
+        second_bucket = (first_bucket + 1) % num_buckets;
+      }
+      for (int i=0; i < bucket_lines; i++) {
+        indicies[i] = first_bucket * bucket_lines + i;
+        indicies[bucket_lines + i] = second_bucket * bucket_lines + i;
+      }
+      break;
+
+    default:
+      // The first four are the legacy 32 bit chunks of the digest, further ones are double hashed
+      for (int i=0; i < num_ways; i++) {
+        indicies[i] = i < 4 ? key_in_32_bit_chunks[i] % num_lines :
+                      (uint32_t) ((key_sha1[0] + i * (key_sha1[1] | 1)) % num_lines);
+      }
+  }
+}
+
+/* Make sure the key's lookup indicies are the ones for this cache's table. They are computed once
+ * and reused by every later operation on the same key.
+ */
+static inline void prepareKey(DCCache cache, DCKey_t *key) {
+  if (key->num_lines != cache->header.num_lines) {
+    computeLookupIndiciesForKey(key->digest, key->indicies, cache->header.num_lines,
+                                cache->header.table_layout, cache->num_ways);
+    key->fingerprint = fingerprintForDigest(key->digest, cache->fingerprint_bits);
+    key->num_lines = cache->header.num_lines;
+  }
+}
+
+static void removeLine(DCCache cache, uint32_t idx) {
+  cache->current_size_in_bytes -= lineSize(cache, idx);
+  removeFileForLine(cache, idx);
+
+  clearLine(cache, idx);
+  setFingerprint(cache, idx, EMPTY_FINGERPRINT);
+}
+
+// Remove the file associated with this line, or queue it to be removed by the unlink threads. A
+// value in a segment only frees its range of the segment, an inline value or one in a slot has
+// nothing to remove
+static void removeFileForLine(DCCache cache, uint32_t idx) {
+  char path_to_remove[computeMaxFilePathSize(cache->directory_path)];
+  uint64_t file_id[2];
+  if (isLineInline(cache, idx) || isLineInSlot(cache, idx)) {
+    return;
+  }
+  if (cache->locations && cache->locations[idx].segment_id) {
+    releaseSegmentRange(cache, cache->locations[idx], lineSize(cache, idx));
+    cache->locations[idx] = (DCSegmentLocation_t) {0, 0};
+    return;
+  }
+  fileIdForLine(cache, idx, file_id);
+  if (cache->unlinker && queueUnlink(cache->unlinker, file_id)) {
+    return;
+  }
+  pathForSHA1(cache, file_id, path_to_remove);
+  remove(path_to_remove);
+}
+
+static void digestForKey(DCCache cache, const void *key, size_t key_len, uint64_t digest[2]) {
+  uint64_t seed[2] = {cache->header.hash_seed[0], cache->header.hash_seed[1]}; // Header is packed
+  if (cache->header.hash_engine == DC_HASH_FAST128) {
+    KHFast128(seed, key, key_len, digest);
+  } else {
+    KHSHA1(seed, key, key_len, digest);
+  }
+}
+
+/* Fill seed with random bits, falling back to the clock and pid if /dev/urandom is unavailable
+ */
+static void randomSeed(uint64_t seed[2]) {
+  int fd = open("/dev/urandom", O_RDONLY);
+  bool seeded = false;
+
+  if (fd >= 0) {
+    seeded = read(fd, seed, sizeof(uint64_t) * 2) == sizeof(uint64_t) * 2;
+    close(fd);
+  }
+  if (!seeded) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    seed[0] = ((uint64_t) tv.tv_sec << 20) ^ (uint64_t) tv.tv_usec;
+    seed[1] = ((uint64_t) getpid() << 32) ^ (uint64_t) (uintptr_t) seed;
+  }
+}
+
+static bool mkdirForSHA1IfNotExists(DCCache cache, uint64_t sha1[2]) {
+  char dir_path[computeMaxFilePathSize(cache->directory_path)];
+  int mkdir_rv;
+
+  dirForSHA1(cache, sha1, dir_path);
+  mkdir_rv = mkdir(dir_path, 0777);
+  if (mkdir_rv && errno != EEXIST) {
+    return false;
+  }
+  return true;
+}
+
+static void dirForSHA1(DCCache cache, uint64_t sha1[2], char *dest) {
+  uint8_t subdir = sha1[0] / 65536 / 65536 / 65536 / 256; // Use division to be byte order agnostic
+  sprintf(dest, "%s/%02x", cache->directory_path, subdir);
+}
+
+static void pathForSHA1(DCCache cache, uint64_t sha1[2], char *dest) {
+  pathForFileIdInDirectory(cache->directory_path, sha1, dest);
+}
+
+static void pathForFileIdInDirectory(char *cache_directory_path, uint64_t file_id[2], char *dest) {
+  uint8_t subdir = file_id[0] / 65536 / 65536 / 65536 / 256; // Use division to be byte order agnostic
+  sprintf(dest, "%s/%02x/%016llx%016llx.cache_data", cache_directory_path, subdir,
+      (long long unsigned) file_id[0], (long long unsigned) file_id[1]);
+}
+
+static uint64_t currentTimeInMSFromEpoch() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return ((uint64_t) (tv.tv_sec)) * 1000 +  ((uint64_t) (tv.tv_usec/1000));
+}
+
+/* The time as of the last timer tick. Reading it is a few loads from the vDSO page where
+ * gettimeofday has to read and scale the hardware clock; it may lag by a few ms.
+ */
+static uint64_t coarseTimeInMSFromEpoch() {
+#ifdef CLOCK_REALTIME_COARSE
+  struct timespec ts;
+  if (clock_gettime(CLOCK_REALTIME_COARSE, &ts) == 0) {
+    return ((uint64_t) (ts.tv_sec)) * 1000 + ((uint64_t) (ts.tv_nsec / 1000000));
+  }
+#endif
+  return currentTimeInMSFromEpoch();
+}
+
+/* When a new table is swapped in for a cache, keep the settings that were made on the cache
+ * rather than read from its file, and what the replacement policy has learned. Its ghosts are
+ * sized for the old table and start over.
+ */
+static void carryOverSettings(DCCache to, DCCache from) {
+  to->access_time_granularity_in_ms = from->access_time_granularity_in_ms;
+  to->evictor = from->evictor;
+  to->admission_filter = from->admission_filter;
+  to->unlinker = from->unlinker;
+  to->segments = from->segments;
+  to->pins = from->pins;
+  to->data_pool = from->data_pool;
+  to->probation_fraction = from->probation_fraction;
+  to->probation_target = from->probation_target;
+}
+
+/* Recompute everything that is derived from the lines: the cache size and the fingerprints. The
+ * fingerprints are only written where they differ so a consistent table isn't dirtied.
+ */
+static void recomputeStateFromLines(DCCache cache) {
+  rebuildFingerprints(cache);
+  cache->current_size_in_bytes = sumLineSizes(cache);
+  cache->num_used_lines = countUsedLines(cache);
+}
+
+static void rebuildFingerprints(DCCache cache) {
+  uint32_t num_lines = cache->header.num_lines; //Cache this here since it's in the comparison
+  for (int i=0; i < num_lines; i++) {
+    uint16_t fingerprint = EMPTY_FINGERPRINT;
+    if (isLineUsed(cache, i)) {
+      uint64_t digest[2] = {lineKeyFingerprint(cache, i), 0}; // Only d0 ^ d1 goes into it
+      fingerprint = fingerprintForDigest(digest, cache->fingerprint_bits);
+    }
+    if (fingerprintAt(cache, i) != fingerprint) {
+      setFingerprint(cache, i, fingerprint);
+    }
+  }
+}
+
+/* Evict the contents of the of the cache if the combined size of the current data and the proposed
+ * element to be inserted is greater than the cache size. Only just enough is evicted, a sampled
+ * line at a time, so an add never pays for more than the room it needs.
+ */
+static void maybeEvict(DCCache cache, uint64_t proposed_increase_bytes) {
+  // Never evict if eviction is turned off
+  if (cache->header.max_bytes == 0) {
+    return;
+  }
+
+  // There's enough space for both the current data and the proposed increase
+  if ((cache->current_size_in_bytes + proposed_increase_bytes) < cache->header.max_bytes) {
+    return;
+  }
+
+  // The hand only sweeps this table, so the lines of the old one have to be in it
+  resizeStep(cache, UINT32_MAX);
+
+  while ((cache->current_size_in_bytes + proposed_increase_bytes) >= cache->header.max_bytes &&
+         cache->num_used_lines) {
+    evictLine(cache, lineToEvictAtEvictionHand(cache));
+  }
+}
+
+/* Sampled eviction: the eviction hand sweeps the table like a CLOCK hand and of the next
+ * EVICTION_SAMPLE_LINES used lines it passes, the one with the lowest eviction rank is the one to
+ * evict (for LRU the oldest). Keys are spread over the table by their digest, so those lines are as
+ * good as a random sample, and the hand makes successive evictions sample different lines. The
+ * cache must have a used line.
+ */
+static uint32_t lineToEvictAtEvictionHand(DCCache cache) {
+  uint32_t sampled_lines[EVICTION_SAMPLE_LINES];
+  uint32_t num_sampled;
+  uint32_t evict = sampleAtEvictionHand(cache, &cache->eviction_hand, sampled_lines, &num_sampled);
+
+  for (uint32_t i=0; i < num_sampled; i++) {
+    if (i != evict) {
+      policyOnSpared(cache, sampled_lines[i]);
+    }
+  }
+  return sampled_lines[evict];
+}
+
+/* Sample the used lines from hand on, advancing it past them
+ * Returns: The index into sampled_lines of the one with the lowest eviction rank
+ */
+static uint32_t sampleAtEvictionHand(DCCache cache, uint32_t *hand, uint32_t sampled_lines[EVICTION_SAMPLE_LINES], uint32_t *num_sampled) {
+  uint32_t num_lines = cache->header.num_lines;
+  uint32_t evict = 0;
+  uint64_t lowest_rank = UINT64_MAX;
+
+  *num_sampled = 0;
+  for (uint32_t visited=0; visited < num_lines && *num_sampled < EVICTION_SAMPLE_LINES; visited++) {
+    uint32_t idx = *hand < num_lines ? *hand : 0;
+    *hand = idx + 1;
+    if (isLineUsed(cache, idx)) {
+      uint64_t rank = evictionRank(cache, idx);
+      if (rank < lowest_rank) {
+        lowest_rank = rank;
+        evict = *num_sampled;
+      }
+      sampled_lines[(*num_sampled)++] = idx;
+    }
+  }
+  return evict;
+}
+
+/* Remove a line to make room, as opposed to removing a key that was replaced or removed
+ */
+static void evictLine(DCCache cache, uint32_t idx) {
+  policyOnEvict(cache, idx);
+  removeLine(cache, idx);
+}
+
+/***REPLACEMENT POLICIES***/
+/* The lines can't be moved around to keep them in queues, so every policy is expressed as an
+ * eviction rank: the line with the lowest rank among those compared is evicted. A rank is a class
+ * above the access time, so lines of the same class go oldest first. ARC's T1 and T2 and S3-FIFO's
+ * small and main FIFO are flags, and which of them is evicted from is decided by comparing the
+ * share of the lines in probation (T1, small) with the share they should have. GDSF's rank is
+ * GreedyDual's priority with the access time as its clock, see gdsfValueInMS. The hooks are called
+ * when a line is inserted, hit, evicted and when it was compared and spared.
+ */
+
+static inline uint64_t evictionRank(DCCache cache, uint32_t idx) {
+  uint64_t time = lineAccessTime(cache, idx);
+  uint32_t flags = policyFlags(cache, idx);
+  uint64_t rank_class;
+  bool over_target = cache->probation_fraction > cache->probation_target;
+  uint32_t frequency;
+
+  // Whatever the policy, expired lines are the first to go
+  if (isLineExpired(cache, idx)) {
+    return 0;
+  }
+
+  switch (cache->header.replacement_policy) {
+    case DC_POLICY_LFU:
+      rank_class = lfuDecayedCount(cache, idx, coarseTimeInMSFromEpoch());
+      break;
+    case DC_POLICY_ARC:
+      // Evict from T1 while it has more than its share, otherwise from T2
+      rank_class = ((flags & ARC_FLAG_T2) != 0) == over_target;
+      break;
+    case DC_POLICY_S3FIFO:
+      // Lines that were used since they were inserted or spared are only evicted when no other is
+      frequency = flags >> S3FIFO_FREQUENCY_SHIFT;
+      if (frequency) {
+        rank_class = 2 + ((flags & S3FIFO_FLAG_MAIN) != 0);
+      } else if (flags & S3FIFO_FLAG_MAIN) {
+        rank_class = over_target ? 1 : 0;
+      } else {
+        rank_class = over_target ? 0 : 1;
+      }
+      break;
+    case DC_POLICY_GDSF:
+      return time + gdsfValueInMS(cache, idx);
+    default:
+      return time;
+  }
+  return (rank_class << RANK_CLASS_SHIFT) | (time & ((1ULL << RANK_CLASS_SHIFT) - 1));
+}
+
+/* GreedyDual-Size-Frequency keeps the entries with the highest frequency * cost / size, aged by a
+ * clock L that an entry's priority starts from when it is used. Here L is the access time, so the
+ * value of an entry is how much longer than an entry of no value it stays: GDSF_BYTE_MS per use
+ * and unit of cost, divided by its size. Small, often used, costly entries stay longest, and a
+ * large one can't push out many of them.
+ */
+static inline uint64_t gdsfValueInMS(DCCache cache, uint32_t idx) {
+  uint32_t flags = policyFlags(cache, idx);
+  uint64_t frequency = flags & GDSF_FREQUENCY_MASK;
+  uint64_t cost = 1ULL << (flags >> GDSF_COST_SHIFT);
+  uint64_t size = lineSize(cache, idx);
+  return frequency * cost * GDSF_BYTE_MS / (size ? size : 1);
+}
+
+/* An LFU counter as of now: one less for every LFU_DECAY_PERIOD_MS the line wasn't used
+ */
+static inline uint32_t lfuDecayedCount(DCCache cache, uint32_t idx, uint64_t now) {
+  uint32_t count = policyFlags(cache, idx) & LFU_COUNT_MASK;
+  uint64_t time = lineAccessTime(cache, idx);
+  uint64_t periods = now > time ? (now - time) / LFU_DECAY_PERIOD_MS : 0;
+  return periods < count ? count - (uint32_t) periods : 0;
+}
+
+static void policyOnInsert(DCCache cache, uint32_t idx, DCKey_t *key, uint32_t cost) {
+  int ghost_list;
+  uint32_t cost_class = 0;
+
+  switch (cache->header.replacement_policy) {
+    case DC_POLICY_GDSF:
+      while (cost_class < GDSF_MAX_COST_CLASS && (cost >> (cost_class + 1))) {
+        cost_class++;
+      }
+      setPolicyFlags(cache, idx, (cost_class << GDSF_COST_SHIFT) | 1);
+      break;
+    case DC_POLICY_LFU:
+      setPolicyFlags(cache, idx, LFU_INITIAL_COUNT);
+      break;
+    case DC_POLICY_ARC:
+      // A key evicted recently is used again: it goes straight to T2, and the list it was evicted
+      // from should have been bigger
+      ghost_list = takeGhost(cache, key->digest);
+      if (ghost_list >= 0) {
+        adaptProbationTarget(cache, ghost_list);
+        setPolicyFlags(cache, idx, ARC_FLAG_T2);
+      }
+      break;
+    case DC_POLICY_S3FIFO:
+      if (takeGhost(cache, key->digest) >= 0) {
+        setPolicyFlags(cache, idx, S3FIFO_FLAG_MAIN);
+      }
+      break;
+  }
+}
+
+static inline void policyOnHit(DCCache cache, uint32_t idx) {
+  uint32_t flags = policyFlags(cache, idx);
+  uint32_t count, frequency;
+  uint64_t now;
+
+  switch (cache->header.replacement_policy) {
+    case DC_POLICY_LFU:
+      // Logarithmic: the higher the count, the less likely an access increments it
+      now = coarseTimeInMSFromEpoch();
+      count = lfuDecayedCount(cache, idx, now);
+      cache->random_state ^= cache->random_state << 13;
+      cache->random_state ^= cache->random_state >> 7;
+      cache->random_state ^= cache->random_state << 17;
+      if (count < LFU_COUNT_MASK) {
+        uint64_t odds = count > LFU_INITIAL_COUNT ? (uint64_t) (count - LFU_INITIAL_COUNT) * LFU_LOG_FACTOR : 0;
+        count += cache->random_state % (odds + 1) == 0;
+      }
+      if (count != (flags & LFU_COUNT_MASK) ||
+          now >= lineAccessTime(cache, idx) + cache->access_time_granularity_in_ms) {
+        setPolicyFlags(cache, idx, (flags & ~LFU_COUNT_MASK) | count);
+        setLineAccessTime(cache, idx, now);
+      }
+      break;
+    case DC_POLICY_ARC:
+      if (!(flags & ARC_FLAG_T2)) {
+        setPolicyFlags(cache, idx, flags | ARC_FLAG_T2);
+        setLineAccessTime(cache, idx, currentTimeInMSFromEpoch());
+      } else {
+        touchLine(cache, idx);
+      }
+      break;
+    case DC_POLICY_GDSF:
+      if ((flags & GDSF_FREQUENCY_MASK) < GDSF_FREQUENCY_MASK) {
+        setPolicyFlags(cache, idx, flags + 1);
+      }
+      touchLine(cache, idx);
+      break;
+    case DC_POLICY_S3FIFO:
+      // FIFO order is insertion order, a hit only counts
+      frequency = flags >> S3FIFO_FREQUENCY_SHIFT;
+      if (frequency < S3FIFO_MAX_FREQUENCY) {
+        setPolicyFlags(cache, idx, flags + (1 << S3FIFO_FREQUENCY_SHIFT));
+      }
+      break;
+    default:
+      touchLine(cache, idx);
+  }
+}
+
+static void policyOnEvict(DCCache cache, uint32_t idx) {
+  uint32_t flags = policyFlags(cache, idx);
+  uint64_t digest[2];
+
+  observeForPolicy(cache, flags);
+  switch (cache->header.replacement_policy) {
+    case DC_POLICY_ARC:
+      lineDigest(cache, idx, digest);
+      putGhost(cache, digest, (flags & ARC_FLAG_T2) ? 1 : 0);
+      break;
+    case DC_POLICY_S3FIFO:
+      if (!(flags & S3FIFO_FLAG_MAIN)) {
+        lineDigest(cache, idx, digest);
+        putGhost(cache, digest, 0);
+      }
+      break;
+  }
+}
+
+/* A line that eviction compared with the evicted one. For S3-FIFO that is when the FIFO reaches it:
+ * if it was used since, a small line moves to the main FIFO and a main line goes around again
+ */
+static void policyOnSpared(DCCache cache, uint32_t idx) {
+  uint32_t flags = policyFlags(cache, idx);
+  uint32_t frequency = flags >> S3FIFO_FREQUENCY_SHIFT;
+
+  observeForPolicy(cache, flags);
+  if (cache->header.replacement_policy != DC_POLICY_S3FIFO || !frequency) {
+    return;
+  }
+  if (flags & S3FIFO_FLAG_MAIN) {
+    setPolicyFlags(cache, idx, ((frequency - 1) << S3FIFO_FREQUENCY_SHIFT) | S3FIFO_FLAG_MAIN);
+  } else {
+    setPolicyFlags(cache, idx, S3FIFO_FLAG_MAIN);
+  }
+  setLineAccessTime(cache, idx, currentTimeInMSFromEpoch());
+}
+
+/* Count a line eviction looked at towards the estimate of the share of lines in probation
+ */
+static inline void observeForPolicy(DCCache cache, uint32_t flags) {
+  bool in_probation;
+  switch (cache->header.replacement_policy) {
+    case DC_POLICY_ARC:
+      in_probation = !(flags & ARC_FLAG_T2);
+      break;
+    case DC_POLICY_S3FIFO:
+      in_probation = !(flags & S3FIFO_FLAG_MAIN);
+      break;
+    default:
+      return;
+  }
+  cache->probation_fraction += (in_probation - cache->probation_fraction) / PROBATION_ESTIMATE_WEIGHT;
+}
+
+/* ARC's adaptation: a key evicted from T1 (B1) that comes back means T1 should be bigger, one
+ * evicted from T2 (B2) that it should be smaller, by more the smaller that ghost list is
+ */
+static void adaptProbationTarget(DCCache cache, int ghost_list) {
+  double b1 = cache->num_ghosts_by_list[0] + 1;
+  double b2 = cache->num_ghosts_by_list[1] + 1;
+  double used_lines = cache->num_used_lines + 1;
+
+  if (ghost_list == 0) {
+    cache->probation_target += (b2 > b1 ? b2 / b1 : 1) / used_lines;
+    if (cache->probation_target > 1) {
+      cache->probation_target = 1;
+    }
+  } else {
+    cache->probation_target -= (b1 > b2 ? b1 / b2 : 1) / used_lines;
+    if (cache->probation_target < 0) {
+      cache->probation_target = 0;
+    }
+  }
+}
+
+/* Remember an evicted key. A ghost is 14 bits of the digest, a bit so it is never 0 and the list it
+ * was evicted from; the slot it goes into is picked by the digest, so a newer ghost replaces an
+ * older one instead of needing a queue
+ */
+static void putGhost(DCCache cache, uint64_t digest[2], int list) {
+  uint16_t *slot;
+  if (!cache->ghosts) {
+    return;
+  }
+  slot = cache->ghosts + digest[1] % cache->num_ghosts;
+  if (*slot) {
+    cache->num_ghosts_by_list[*slot & 1]--;
+  }
+  *slot = (uint16_t) (((digest[1] >> 48) & 0xfffc) | 2 | list);
+  cache->num_ghosts_by_list[list]++;
+}
+
+/* Forget a recently evicted key
+ * Returns: The list it was evicted from, -1 if it wasn't remembered
+ */
+static int takeGhost(DCCache cache, uint64_t digest[2]) {
+  uint16_t *slot;
+  int list;
+  if (!cache->ghosts) {
+    return -1;
+  }
+  slot = cache->ghosts + digest[1] % cache->num_ghosts;
+  if ((*slot & ~1) != (uint16_t) (((digest[1] >> 48) & 0xfffc) | 2)) {
+    return -1;
+  }
+  list = *slot & 1;
+  cache->num_ghosts_by_list[list]--;
+  *slot = 0;
+  return list;
+}
+
+/***ADMISSION FILTER***/
+/* TinyLFU: a new key is only let in if it was used more often recently than the key it would evict,
+ * so keys that are used once don't push out the keys that are used repeatedly, and don't cost a
+ * data file write either. How often keys were used is estimated with a count-min sketch whose
+ * counters are halved every so often, so it forgets old accesses.
+ */
+
+/* Whether a key that isn't in the cache may be added as far as its size goes. If the cache is too
+ * full for it, it has to beat the key the eviction hand would evict next.
+ */
+static bool admitKey(DCCache cache, DCKey_t *key, uint64_t data_len) {
+  uint32_t sampled_lines[EVICTION_SAMPLE_LINES];
+  uint32_t num_sampled, hand, victim;
+
+  if (cache->header.max_bytes == 0 ||
+      cache->current_size_in_bytes + data_len < cache->header.max_bytes) {
+    return true;
+  }
+  hand = cache->eviction_hand;
+  victim = sampled_lines[sampleAtEvictionHand(cache, &hand, sampled_lines, &num_sampled)];
+  return !num_sampled || admitKeyOverLine(cache, key, victim);
+}
+
+/* Whether a key that isn't in the cache may evict the key in a line. Ties go to the key in the
+ * cache, so a key must have been used before to be let in.
+ */
+static bool admitKeyOverLine(DCCache cache, DCKey_t *key, uint32_t victim) {
+  return sketchEstimate(cache->admission_filter, key->digest[0] ^ key->digest[1]) >
+         sketchEstimate(cache->admission_filter, lineKeyFingerprint(cache, victim));
+}
+
+/* A sketch with at least as many columns as the cache has lines
+ */
+static struct DCSketch_s *makeSketch(uint32_t num_lines) {
+  struct DCSketch_s *sketch = calloc(1, sizeof(struct DCSketch_s));
+  if (!sketch) {
+    return NULL;
+  }
+  sketch->width_bits = SKETCH_MIN_WIDTH_BITS;
+  while ((1ULL << sketch->width_bits) < num_lines) {
+    sketch->width_bits++;
+  }
+  sketch->sample_size = (uint64_t) SKETCH_SAMPLE_FACTOR << sketch->width_bits;
+  sketch->counters = calloc((size_t) SKETCH_DEPTH << sketch->width_bits, sizeof(uint8_t));
+  if (!sketch->counters) {
+    fprintf(stderr, "ERROR: Unable to allocate the admission filter\n");
+    free(sketch);
+    return NULL;
+  }
+  return sketch;
+}
+
+static inline uint32_t sketchColumn(struct DCSketch_s *sketch, uint64_t key_fingerprint, int row) {
+  static const uint64_t multipliers[SKETCH_DEPTH] = {
+    0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL, 0x165667b19e3779f9ULL, 0xd6e8feb86659fd93ULL
+  };
+  return (uint32_t) ((key_fingerprint * multipliers[row]) >> (64 - sketch->width_bits));
+}
+
+static void sketchIncrement(struct DCSketch_s *sketch, uint64_t key_fingerprint) {
+  size_t width = (size_t) 1 << sketch->width_bits;
+
+  for (int row=0; row < SKETCH_DEPTH; row++) {
+    uint8_t *counter = sketch->counters + row * width + sketchColumn(sketch, key_fingerprint, row);
+    if (*counter < SKETCH_MAX_COUNT) {
+      (*counter)++;
+    }
+  }
+
+  // Aging: halving every counter keeps the relative frequencies but lets new keys catch up
+  if (++sketch->num_increments >= sketch->sample_size) {
+    for (size_t i=0; i < SKETCH_DEPTH * width; i++) {
+      sketch->counters[i] >>= 1;
+    }
+    sketch->num_increments /= 2;
+  }
+}
+
+static uint32_t sketchEstimate(struct DCSketch_s *sketch, uint64_t key_fingerprint) {
+  size_t width = (size_t) 1 << sketch->width_bits;
+  uint32_t estimate = SKETCH_MAX_COUNT;
+
+  for (int row=0; row < SKETCH_DEPTH; row++) {
+    uint8_t counter = sketch->counters[row * width + sketchColumn(sketch, key_fingerprint, row)];
+    estimate = counter < estimate ? counter : estimate;
+  }
+  return estimate;
+}
+
+/***BACKGROUND EVICTION***/
+/* While an evictor runs, the public functions that read or change the lines hold its lock, so that
+ * it only ever evicts between them.
+ */
+static inline void lockCache(DCCache cache) {
+  if (cache->evictor) {
+    pthread_mutex_lock(&cache->evictor->lock);
+  }
+}
+
+static inline void unlockCache(DCCache cache) {
+  if (cache->evictor) {
+    pthread_mutex_unlock(&cache->evictor->lock);
+  }
+}
+
+/* Whether the cache is between the watermarks on the way down. Called with the lock held.
+ */
+static bool evictorShouldRun(DCCache cache) {
+  struct DCEvictor_s *evictor = cache->evictor;
+  uint64_t max_bytes = cache->header.max_bytes;
+
+  if (max_bytes == 0) {
+    evictor->evicting = false;
+  } else if (cache->current_size_in_bytes >= max_bytes * evictor->options.high_watermark) {
+    evictor->evicting = true;
+  } else if (cache->current_size_in_bytes <= max_bytes * evictor->options.low_watermark) {
+    evictor->evicting = false;
+  }
+  return evictor->evicting;
+}
+
+/* Evict the way an add does, a sampled line at a time, but EVICTOR_BATCH_LINES lines per hold of
+ * the lock so that the foreground only ever waits for a batch. The cache pointer stays the same
+ * for the life of the evictor, only its contents are swapped by a resize or a conversion.
+ */
+static void *evictorMain(void *arg) {
+  DCCache cache = arg;
+  struct DCEvictor_s *evictor = cache->evictor;
+
+  pthread_mutex_lock(&evictor->lock);
+  while (!evictor->stop) {
+    uint32_t max_evictions_per_second = evictor->options.max_evictions_per_second;
+    uint32_t batch_lines = EVICTOR_BATCH_LINES;
+    uint32_t num_evicted = 0;
+
+    // A rate limited evictor evicts about ten times a second rather than in bursts
+    if (max_evictions_per_second && max_evictions_per_second / 10 < batch_lines) {
+      batch_lines = max_evictions_per_second / 10 ? max_evictions_per_second / 10 : 1;
+    }
+
+    if (!evictorShouldRun(cache)) {
+      evictorWait(evictor, EVICTOR_IDLE_WAIT_MS);
+      continue;
+    }
+
+    // The hand only sweeps the new table, so an in progress resize goes first
+    if (cache->resize_source) {
+      resizeStep(cache, EVICTOR_BATCH_LINES);
+    } else {
+      uint64_t low_watermark_bytes = cache->header.max_bytes * evictor->options.low_watermark;
+      while (num_evicted < batch_lines && cache->current_size_in_bytes > low_watermark_bytes &&
+             cache->num_used_lines) {
+        evictLine(cache, lineToEvictAtEvictionHand(cache));
+        num_evicted ++;
+      }
+    }
+
+    if (max_evictions_per_second && num_evicted) {
+      evictorWait(evictor, (uint64_t) num_evicted * 1000 / max_evictions_per_second);
+    } else {
+      pthread_mutex_unlock(&evictor->lock);
+      sched_yield();
+      pthread_mutex_lock(&evictor->lock);
+    }
+  }
+  pthread_mutex_unlock(&evictor->lock);
+  return NULL;
+}
+
+/* Release the lock for at most wait_in_ms, or until the evictor is signaled
+ */
+static void evictorWait(struct DCEvictor_s *evictor, uint64_t wait_in_ms) {
+  struct timespec until;
+
+  clock_gettime(CLOCK_REALTIME, &until);
+  until.tv_sec += wait_in_ms / 1000;
+  until.tv_nsec += (wait_in_ms % 1000) * 1000000;
+  if (until.tv_nsec >= 1000000000) {
+    until.tv_sec ++;
+    until.tv_nsec -= 1000000000;
+  }
+  pthread_cond_timedwait(&evictor->wake, &evictor->lock, &until);
+}
+
+
+
+/***DEFERRED UNLINKING***/
+/* Unlinking a data file is a file system metadata update that can take as long as the rest of an
+ * add, and eviction unlinks a file per line. With deferred unlinking the lines are cleared as
+ * before but the files are queued for threads that unlink them in batches. The queue is a mapped
+ * file, so the files of a process that dies before they were unlinked are unlinked by the next
+ * DCLoad instead of leaking.
+ */
+
+/* Queue a file to be unlinked
+ * Returns: false if the queue is full, the caller should unlink the file itself
+ */
+static bool queueUnlink(struct DCUnlinker_s *unlinker, uint64_t file_id[2]) {
+  uint64_t *slot;
+
+  pthread_mutex_lock(&unlinker->lock);
+  if (unlinker->tail - unlinker->head == UNLINK_QUEUE_CAPACITY) {
+    pthread_mutex_unlock(&unlinker->lock);
+    return false;
+  }
+  slot = unlinker->slots[unlinker->tail % UNLINK_QUEUE_CAPACITY];
+  slot[0] = file_id[0];
+  slot[1] = file_id[1];
+  unlinker->tail++;
+  unlinker->queued_by_bucket[unlinkBucket(file_id)]++;
+  pthread_cond_signal(&unlinker->work);
+  pthread_mutex_unlock(&unlinker->lock);
+  return true;
+}
+
+/* Make sure a file about to be written isn't unlinked afterwards: cancel its unlink if it is still
+ * queued, wait for it if a thread is unlinking it already
+ */
+static void awaitUnlink(struct DCUnlinker_s *unlinker, uint64_t file_id[2]) {
+  uint32_t bucket = unlinkBucket(file_id);
+  bool unlinking;
+
+  pthread_mutex_lock(&unlinker->lock);
+  if (unlinker->queued_by_bucket[bucket]) {
+    for (uint64_t i=unlinker->next; i < unlinker->tail; i++) {
+      uint64_t *slot = unlinker->slots[i % UNLINK_QUEUE_CAPACITY];
+      if (sameFileId(slot, file_id)) {
+        slot[0] = slot[1] = 0;
+        unlinker->queued_by_bucket[bucket]--;
+      }
+    }
+    do {
+      unlinking = false;
+      for (uint64_t i=unlinker->head; i < unlinker->next && !unlinking; i++) {
+        unlinking = sameFileId(unlinker->slots[i % UNLINK_QUEUE_CAPACITY], file_id);
+      }
+      if (unlinking) {
+        pthread_cond_wait(&unlinker->done, &unlinker->lock);
+      }
+    } while (unlinking);
+  }
+  pthread_mutex_unlock(&unlinker->lock);
+}
+
+static void *unlinkerMain(void *arg) {
+  struct DCUnlinker_s *unlinker = arg;
+  uint64_t batch[UNLINK_BATCH][2];
+  char path_to_remove[computeMaxFilePathSize(unlinker->directory_path)];
+
+  pthread_mutex_lock(&unlinker->lock);
+  while (true) {
+    while (unlinker->next == unlinker->tail && !unlinker->stop) {
+      pthread_cond_wait(&unlinker->work, &unlinker->lock);
+    }
+    if (unlinker->next == unlinker->tail) {
+      break;
+    }
+
+    // Take a batch, unlink it without the lock so adds and other threads carry on meanwhile
+    uint64_t start = unlinker->next;
+    uint32_t batch_size = unlinker->tail - start < UNLINK_BATCH ? unlinker->tail - start : UNLINK_BATCH;
+    unlinker->next += batch_size;
+    for (uint32_t i=0; i < batch_size; i++) {
+      batch[i][0] = unlinker->slots[(start + i) % UNLINK_QUEUE_CAPACITY][0];
+      batch[i][1] = unlinker->slots[(start + i) % UNLINK_QUEUE_CAPACITY][1];
+    }
+    pthread_mutex_unlock(&unlinker->lock);
+
+    for (uint32_t i=0; i < batch_size; i++) {
+      if (batch[i][0] || batch[i][1]) {
+        pathForFileIdInDirectory(unlinker->directory_path, batch[i], path_to_remove);
+        remove(path_to_remove);
+      }
+    }
+
+    pthread_mutex_lock(&unlinker->lock);
+    for (uint32_t i=0; i < batch_size; i++) {
+      uint64_t *slot = unlinker->slots[(start + i) % UNLINK_QUEUE_CAPACITY];
+      if (slot[0] || slot[1]) {
+        unlinker->queued_by_bucket[unlinkBucket(slot)]--;
+        slot[0] = slot[1] = 0;
+      }
+    }
+    // Batches finish out of order, the head only moves past the slots that are done
+    while (unlinker->head < unlinker->next) {
+      uint64_t *slot = unlinker->slots[unlinker->head % UNLINK_QUEUE_CAPACITY];
+      if (slot[0] || slot[1]) {
+        break;
+      }
+      unlinker->head++;
+    }
+    pthread_cond_broadcast(&unlinker->done);
+  }
+  pthread_mutex_unlock(&unlinker->lock);
+  return NULL;
+}
+
+static inline uint32_t unlinkBucket(uint64_t file_id[2]) {
+  return (uint32_t) ((file_id[0] ^ file_id[1]) % UNLINK_BUCKETS);
+}
+
+static bool sameFileId(uint64_t a[2], uint64_t b[2]) {
+  return a[0] == b[0] && a[1] == b[1];
+}
+
+/* Unlink the files that were still queued when the last process that used the cache died, and
+ * remove the queue. Their lines were cleared when they were queued.
+ */
+static void unlinkFilesQueuedBeforeCrash(char *cache_directory_path) {
+  char journal_path[computeMaxFilePathSize(cache_directory_path)];
+  char path_to_remove[computeMaxFilePathSize(cache_directory_path)];
+  uint64_t file_id[2];
+  FILE *journal;
+
+  computeCachePath(cache_directory_path, UNLINKS_FN, journal_path);
+  journal = fopen(journal_path, "r");
+  if (!journal) {
+    return;
+  }
+  while (fread(file_id, sizeof(file_id), 1, journal) == 1) {
+    if (file_id[0] || file_id[1]) {
+      pathForFileIdInDirectory(cache_directory_path, file_id, path_to_remove);
+      remove(path_to_remove);
+    }
+  }
+  fclose(journal);
+  remove(journal_path);
+}
+
+/***SEGMENT STORAGE***/
+/* With DC_STORAGE_SEGMENTS small values are appended to large segment files rather than getting a
+ * file each, and a line's location says where. Removing a value only lowers the live bytes of its
+ * segment, and punches its range out of the file if that frees at least MIN_PUNCH_BYTES. A segment
+ * with no values left is removed, and DCEvictToSize moves the values out of mostly empty segments
+ * so they can be. The live bytes aren't stored, DCLoad counts them from the locations.
+ */
+
+/* Called by DCLoad, after resumeResize so the lines of both tables are counted. Appending continues
+ * in the newest segment, after the last of its values a line points to; whatever is after it was
+ * removed or written by a process that died before it updated the line. Segments no line points to
+ * were emptied just before a crash and are removed.
+ */
+static bool openSegments(DCCache cache) {
+  char path[computeMaxFilePathSize(cache->directory_path)];
+  struct DCSegments_s *segments = calloc(1, sizeof(struct DCSegments_s));
+  DIR *dir = opendir(cache->directory_path);
+  struct dirent *entry;
+  uint32_t segment_id, newest_id = 0;
+
+  if (!dir) {
+    fprintf(stderr, "ERROR: Unable to list '%s': %s\n", cache->directory_path, strerror(errno));
+    free(segments);
+    return false;
+  }
+  while ((entry = readdir(dir))) {
+    if (parseSegmentFileName(entry->d_name, &segment_id) && segment_id > newest_id) {
+      newest_id = segment_id;
+    }
+  }
+  segments->segment_size = cache->header.segment_size;
+  segments->max_value_size = segments->segment_size / SEGMENT_VALUE_FRACTION;
+  segments->active_id = newest_id;
+  if (!growSegments(segments, newest_id + 1)) {
+    closedir(dir);
+    closeSegments(segments);
+    return false;
+  }
+  countSegmentBytes(segments, cache);
+  if (cache->resize_source) {
+    countSegmentBytes(segments, cache->resize_source);
+    cache->resize_source->segments = segments;
+  }
+
+  rewinddir(dir);
+  while ((entry = readdir(dir))) {
+    if (parseSegmentFileName(entry->d_name, &segment_id) && segment_id != newest_id &&
+        !segments->live_bytes[segment_id]) {
+      pathForSegment(cache, segment_id, path);
+      remove(path);
+    }
+  }
+  closedir(dir);
+  cache->segments = segments;
+  return true;
+}
+
+/* Add the values of a table's lines to the live bytes of their segments, and move the write offset
+ * of the active segment past them. Locations of segments that don't exist anymore are skipped,
+ * reading them fails and removes their lines.
+ */
+static void countSegmentBytes(struct DCSegments_s *segments, DCCache table) {
+  for (uint32_t i=0; i < table->header.num_lines; i++) {
+    DCSegmentLocation_t location = table->locations[i];
+    if (!location.segment_id || location.segment_id >= segments->num_segments ||
+        !isLineUsed(table, i)) {
+      continue;
+    }
+    uint64_t end = (uint64_t) location.offset + lineSize(table, i);
+    segments->live_bytes[location.segment_id] += lineSize(table, i);
+    if (location.segment_id == segments->active_id && end > segments->write_offset) {
+      segments->write_offset = end;
+    }
+  }
+}
+
+static void closeSegments(struct DCSegments_s *segments) {
+  for (uint32_t i=0; i < segments->num_segments; i++) {
+    if (segments->fds[i] >= 0) {
+      close(segments->fds[i]);
+    }
+  }
+  free(segments->live_bytes);
+  free(segments->fds);
+  free(segments);
+}
+
+static bool growSegments(struct DCSegments_s *segments, uint32_t num_segments) {
+  uint64_t *live_bytes = realloc(segments->live_bytes, num_segments * sizeof(uint64_t));
+  if (live_bytes) {
+    segments->live_bytes = live_bytes;
+  }
+  int *fds = realloc(segments->fds, num_segments * sizeof(int));
+  if (fds) {
+    segments->fds = fds;
+  }
+  if (!live_bytes || !fds) {
+    return false;
+  }
+  for (uint32_t i=segments->num_segments; i < num_segments; i++) {
+    segments->live_bytes[i] = 0;
+    segments->fds[i] = -1;
+  }
+  segments->num_segments = num_segments;
+  return true;
+}
+
+static void pathForSegment(DCCache cache, uint32_t segment_id, char *dest) {
+  sprintf(dest, "%s/%s%08x", cache->directory_path, SEGMENT_FN_PREFIX, segment_id);
+}
+
+static bool parseSegmentFileName(char *file_name, uint32_t *segment_id) {
+  size_t prefix_len = strlen(SEGMENT_FN_PREFIX);
+  char *end;
+
+  if (strncmp(file_name, SEGMENT_FN_PREFIX, prefix_len) || !file_name[prefix_len]) {
+    return false;
+  }
+  unsigned long id = strtoul(file_name + prefix_len, &end, 16);
+  *segment_id = (uint32_t) id;
+  return !*end && id > 0 && id < UINT32_MAX;
+}
+
+/* The segment's file, opened on first use. Returns -1 if it can't be opened
+ */
+static int segmentFd(DCCache cache, uint32_t segment_id) {
+  char path[computeMaxFilePathSize(cache->directory_path)];
+  struct DCSegments_s *segments = cache->segments;
+
+  if (segment_id >= segments->num_segments) {
+    return -1;
+  }
+  if (segments->fds[segment_id] < 0) {
+    if (segments->num_open >= MAX_OPEN_SEGMENTS) {
+      for (uint32_t i=0; i < segments->num_segments; i++) {
+        if (segments->fds[i] >= 0 && i != segments->active_id) {
+          close(segments->fds[i]);
+          segments->fds[i] = -1;
+          segments->num_open--;
+        }
+      }
+    }
+    pathForSegment(cache, segment_id, path);
+    segments->fds[segment_id] = open(path, O_RDWR);
+    segments->num_open += segments->fds[segment_id] >= 0;
+  }
+  return segments->fds[segment_id];
+}
+
+/* Start a new segment to append to, with all of its space allocated up front so appends don't
+ * extend the file. The previous one is removed if none of its values are left.
+ */
+static bool startSegment(DCCache cache) {
+  char path[computeMaxFilePathSize(cache->directory_path)];
+  struct DCSegments_s *segments = cache->segments;
+  uint32_t segment_id = segments->num_segments, previous_id = segments->active_id;
+  int fd;
+
+  if (!growSegments(segments, segment_id + 1)) {
+    return false;
+  }
+  pathForSegment(cache, segment_id, path);
+  fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0 || posix_fallocate(fd, 0, segments->segment_size)) {
+    fprintf(stderr, "ERROR: Unable to create segment '%s'\n", path);
+    if (fd >= 0) {
+      close(fd);
+      remove(path);
+    }
+    return false;
+  }
+  segments->fds[segment_id] = fd;
+  segments->num_open++;
+  segments->active_id = segment_id;
+  segments->write_offset = 0;
+  if (previous_id && !segments->live_bytes[previous_id]) {
+    dropSegment(cache, previous_id);
+  }
+  return true;
+}
+
+/* Append a value to the active segment, starting a new one if it doesn't fit, and point the line at it
+ */
+static bool appendToSegment(DCCache cache, uint32_t idx, uint8_t *data, uint64_t data_len) {
+  struct DCSegments_s *segments = cache->segments;
+  int fd = segments->active_id ? segmentFd(cache, segments->active_id) : -1;
+
+  if (fd < 0 || segments->write_offset + data_len > segments->segment_size) {
+    if (!startSegment(cache)) {
+      return false;
+    }
+    fd = segments->fds[segments->active_id];
+  }
+  if (pwrite(fd, data, data_len, segments->write_offset) != (ssize_t) data_len) {
+    fprintf(stderr, "ERROR: Unable to write to segment %u: %s\n", segments->active_id,
+            strerror(errno));
+    return false;
+  }
+  cache->locations[idx] = (DCSegmentLocation_t) {segments->active_id, segments->write_offset};
+  segments->live_bytes[segments->active_id] += data_len;
+  segments->write_offset += data_len;
+  return true;
+}
+
+/* A value left its segment. Remove the segment if that was its last value, otherwise punch the
+ * whole pages of a large value's range out of the file so the file system can reuse them.
+ */
+static void releaseSegmentRange(DCCache cache, DCSegmentLocation_t location, uint32_t size_in_bytes) {
+  struct DCSegments_s *segments = cache->segments;
+  uint32_t segment_id = location.segment_id;
+
+  if (segment_id >= segments->num_segments) {
+    return;
+  }
+  segments->live_bytes[segment_id] -= size_in_bytes < segments->live_bytes[segment_id] ?
+                                      size_in_bytes : segments->live_bytes[segment_id];
+  if (!segments->live_bytes[segment_id] && segment_id != segments->active_id) {
+    dropSegment(cache, segment_id);
+    return;
+  }
+#ifdef FALLOC_FL_PUNCH_HOLE
+  uint64_t page_size = sysconf(_SC_PAGESIZE);
+  uint64_t start = (location.offset + page_size - 1) / page_size * page_size;
+  uint64_t end = ((uint64_t) location.offset + size_in_bytes) / page_size * page_size;
+  int fd;
+  if (end >= start + MIN_PUNCH_BYTES && !isSegmentPinned(cache, segment_id) &&
+      (fd = segmentFd(cache, segment_id)) >= 0) {
+    fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, end - start);
+  }
+#endif
+}
+
+static void dropSegment(DCCache cache, uint32_t segment_id) {
+  char path[computeMaxFilePathSize(cache->directory_path)];
+  struct DCSegments_s *segments = cache->segments;
+
+  if (segments->fds[segment_id] >= 0) {
+    close(segments->fds[segment_id]);
+    segments->fds[segment_id] = -1;
+    segments->num_open--;
+  }
+  pathForSegment(cache, segment_id, path);
+  remove(path);
+}
+
+/* Move the values of the segments that are less than 1 / SEGMENT_COMPACT_FRACTION full to the
+ * active segment, which removes them. A value that can't be moved is removed with its line.
+ */
+static void compactSegments(DCCache cache) {
+  struct DCSegments_s *segments = cache->segments;
+  uint32_t num_segments = segments->num_segments; // Segments started while compacting are new
+  bool *compact = calloc(num_segments, sizeof(bool));
+  bool any_to_compact = false;
+
+  for (uint32_t i=1; i < num_segments; i++) {
+    compact[i] = i != segments->active_id && segments->live_bytes[i] &&
+                 segments->live_bytes[i] < segments->segment_size / SEGMENT_COMPACT_FRACTION;
+    any_to_compact |= compact[i];
+  }
+  if (!any_to_compact) {
+    free(compact);
+    return;
+  }
+
+  // The old table of a resize points into the segments too
+  resizeStep(cache, UINT32_MAX);
+  for (uint32_t i=0; i < cache->header.num_lines; i++) {
+    DCSegmentLocation_t location = cache->locations[i];
+    if (!isLineUsed(cache, i) || location.segment_id >= num_segments || !compact[location.segment_id]) {
+      continue;
+    }
+    DCData value = readValue(cache, i);
+    if (value && appendToSegment(cache, i, value->data, value->data_len)) {
+      releaseSegmentRange(cache, location, lineSize(cache, i));
+    } else {
+      removeLine(cache, i);
+    }
+    if (value) {
+      DCDataFree(value);
+    }
+  }
+  free(compact);
+}
+
+
+/***MAPPED VALUES***/
+/* DCLookupMapped maps a value in its own file or in a segment and pins it until the view is
+ * released. Removing the value only unlinks its file, which the mapping keeps, so what the pins
+ * guard against are the writes that reuse the same file: rewriting the key's file in place and
+ * punching the range out of a segment.
+ */
+
+
+/* Map the value of a line, or copy it if it is inline or in a slot. NULL if it can't be read
+ */
+static DCMappedData mapValue(DCCache cache, uint32_t idx, DCKey_t *key) {
+  char file_path[computeMaxFilePathSize(cache->directory_path)];
+  DCMappedData mapped = calloc(1, sizeof(DCMappedData_t));
+  struct stat file_stats;
+  int fd;
+
+  mapped->cache = cache;
+  if (isLineInline(cache, idx) || isLineInSlot(cache, idx)) {
+    mapped->map_start = malloc(lineSize(cache, idx) ? lineSize(cache, idx) : 1);
+    if (readValueInto(cache, idx, mapped->map_start, lineSize(cache, idx), &mapped->data_len)) {
+      mapped->data = mapped->map_start;
+    } else {
+      free(mapped->map_start);
+    }
+  } else if (cache->locations && cache->locations[idx].segment_id) {
+    DCSegmentLocation_t location = cache->locations[idx];
+    fd = segmentFd(cache, location.segment_id);
+    if (fd >= 0 && mapRange(fd, location.offset, lineSize(cache, idx), mapped)) {
+      mapped->pin_kind = PIN_SEGMENT;
+      mapped->pin_id[0] = location.segment_id;
+      mapped->pin_id[1] = location.offset;
+    }
+  } else {
+    fileIdForKey(cache, key, mapped->pin_id);
+    pathForSHA1(cache, mapped->pin_id, file_path);
+    fd = open(file_path, O_RDONLY);
+    if (fd >= 0 && !fstat(fd, &file_stats) && mapRange(fd, 0, file_stats.st_size, mapped)) {
+      mapped->pin_kind = PIN_FILE;
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  if (!mapped->data) {
+    fprintf(stderr, "Unable to map the value of line %u\n", idx);
+    free(mapped);
+    return NULL;
+  }
+  if (mapped->pin_kind) {
+    pinValue(cache, mapped->pin_kind, mapped->pin_id);
+  }
+  return mapped;
+}
+
+/* Map len bytes of the file at offset into mapped, whose pin_kind is left for the caller to set. An
+ * empty value has nothing to map and is copied
+ */
+static bool mapRange(int fd, uint64_t offset, uint64_t len, DCMappedData mapped) {
+  uint64_t page_size = sysconf(_SC_PAGESIZE);
+  uint64_t map_offset = offset / page_size * page_size;
+
+  if (!len) {
+    mapped->map_start = malloc(1);
+    mapped->data = mapped->map_start;
+    mapped->data_len = 0;
+    return false;
+  }
+  mapped->map_size = offset - map_offset + len;
+  mapped->map_start = mmap(NULL, mapped->map_size, PROT_READ, MAP_SHARED, fd, map_offset);
+  if (mapped->map_start == MAP_FAILED) {
+    mapped->map_start = NULL;
+    return false;
+  }
+  mapped->data = (uint8_t *) mapped->map_start + (offset - map_offset);
+  mapped->data_len = len;
+  return true;
+}
+
+static void pinValue(DCCache cache, uint32_t kind, uint64_t id[2]) {
+  struct DCPins_s *pins = cache->pins;
+
+  for (uint32_t i=0; i < pins->num_pins; i++) {
+    if (pins->pins[i].kind == kind && sameFileId(pins->pins[i].id, id)) {
+      pins->pins[i].count++;
+      return;
+    }
+  }
+  if (pins->num_pins == pins->capacity) {
+    pins->capacity = pins->capacity ? pins->capacity * 2 : 16;
+    pins->pins = realloc(pins->pins, pins->capacity * sizeof(*pins->pins));
+  }
+  pins->pins[pins->num_pins].kind = kind;
+  pins->pins[pins->num_pins].count = 1;
+  pins->pins[pins->num_pins].id[0] = id[0];
+  pins->pins[pins->num_pins].id[1] = id[1];
+  pins->num_pins++;
+}
+
+static void unpinValue(DCCache cache, uint32_t kind, uint64_t id[2]) {
+  struct DCPins_s *pins = cache->pins;
+
+  for (uint32_t i=0; i < pins->num_pins; i++) {
+    if (pins->pins[i].kind == kind && sameFileId(pins->pins[i].id, id)) {
+      if (!--pins->pins[i].count) {
+        pins->pins[i] = pins->pins[--pins->num_pins];
+      }
+      return;
+    }
+  }
+}
+
+static bool isFilePinned(DCCache cache, uint64_t file_id[2]) {
+  struct DCPins_s *pins = cache->pins;
+
+  for (uint32_t i=0; i < pins->num_pins; i++) {
+    if (pins->pins[i].kind == PIN_FILE && sameFileId(pins->pins[i].id, file_id)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Whether a value of the segment is mapped. Its ranges are then not punched out, the space is only
+ * reclaimed once the segment is compacted or dropped
+ */
+static bool isSegmentPinned(DCCache cache, uint32_t segment_id) {
+  struct DCPins_s *pins = cache->pins;
+
+  for (uint32_t i=0; i < pins->num_pins; i++) {
+    if (pins->pins[i].kind == PIN_SEGMENT && pins->pins[i].id[0] == segment_id) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+/***DATA POOL***/
+
+
+/* A DCData for a value of data_len bytes: one of the pool's if the value fits its buffers and it
+ * has one free or may allocate another, otherwise one allocated for the value
+ */
+static DCData allocData(DCCache cache, uint64_t data_len) {
+  struct DCDataPool_s *pool = cache->data_pool;
+  DCData data = NULL;
+
+  if (pool && data_len <= pool->buffer_size) {
+    pthread_mutex_lock(&pool->lock);
+    if (pool->num_free) {
+      data = pool->free_data[--pool->num_free];
+    } else if (pool->num_outstanding < pool->max_data) {
+      data = calloc(1, sizeof(DCData_t));
+      data->data = malloc(pool->buffer_size ? pool->buffer_size : 1);
+      data->pool = pool;
+    }
+    if (data) {
+      pool->num_outstanding++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+  }
+  if (!data) {
+    data = calloc(1, sizeof(DCData_t));
+    data->data = malloc(data_len ? data_len : 1);
+  }
+  data->data_len = data_len;
+  return data;
+}
+
+static void returnPooledData(DCData data) {
+  struct DCDataPool_s *pool = data->pool;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->num_outstanding--;
+  if (!pool->dropped) {
+    pool->free_data[pool->num_free++] = data;
+    pthread_mutex_unlock(&pool->lock);
+    return;
+  }
+  bool last = !pool->num_outstanding;
+  pthread_mutex_unlock(&pool->lock);
+  free(data->data);
+  free(data);
+  if (last) {
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->free_data);
+    free(pool);
+  }
+}
+
+/* Free the pool's free DCData, and the pool itself unless some are still outstanding, in which case
+ * the last of them frees it
+ */
+static void dropDataPool(struct DCDataPool_s *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->dropped = true;
+  for (uint32_t i=0; i < pool->num_free; i++) {
+    free(pool->free_data[i]->data);
+    free(pool->free_data[i]);
+  }
+  pool->num_free = 0;
+  bool last = !pool->num_outstanding;
+  pthread_mutex_unlock(&pool->lock);
+  if (last) {
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->free_data);
+    free(pool);
+  }
+}
+
+
+/***DCAdd Helpers***/
+
+
+/* Try to determine the best line to save the data to. The best one is based at look at all the
+ * indicies in the associative set and picking either:
+ * 1. The first empty one
+ * 2. The one with the lowest eviction rank, for LRU the oldest last_access_time_in_ms_from_epoch
+ */
+static uint32_t findBestLineToWriteKeyTo(DCCache cache, DCKey_t *key) {
+  switch (cache->num_ways) {
+    case 2:
+      return findBestLineToWriteKeyToN(cache, key, 2);
+    case 8:
+      return findBestLineToWriteKeyToN(cache, key, 8);
+    case 16:
+      return findBestLineToWriteKeyToN(cache, key, 16);
+    default:
+      return findBestLineToWriteKeyToN(cache, key, 4);
+  }
+}
+
+/* findBestLineToWriteKeyTo for a way count known at compile time, so the loop is unrolled
+ */
+static inline __attribute__((always_inline)) uint32_t findBestLineToWriteKeyToN(DCCache cache, DCKey_t *key, const uint32_t ways) {
+  uint32_t best_line = key->indicies[0];
+  uint64_t best_rank = UINT64_MAX;
+
+  for(int i=0; i < ways; i++) {
+    uint32_t idx = key->indicies[i];
+
+    //If this line is empty, we can break
+    if (!isLineUsed(cache, idx)) {
+      best_line = idx;
+      break;
+    }
+
+    //This is the line the replacement policy would evict first of those we've seen so far
+    uint64_t rank = evictionRank(cache, idx);
+    if (rank < best_rank) {
+      best_line = idx;
+      best_rank = rank;
+    }
+  }
+  return best_line;
+}
+
+/* The line key should be written to: the best candidate, or when every candidate is in use and
+ * relocation is enabled, a candidate that occupants were moved out of. The line may still be in use,
+ * in which case its occupant has to go.
+ */
+static uint32_t findLineToClaimForKey(DCCache cache, DCKey_t *key) {
+  uint32_t line = findBestLineToWriteKeyTo(cache, key);
+  if (isLineUsed(cache, line) && cache->header.cuckoo_max_kicks && !cache->compact_lines) {
+    // Every candidate is in use; moving occupants elsewhere beats evicting one of them
+    uint32_t freed_line = freeLineByDisplacement(cache, key);
+    line = freed_line != NO_LINE ? freed_line : line;
+  }
+  return line;
+}
+
+/* Called when all of key's candidate lines are in use. Does a breadth first search through the
+ * candidate lines of the occupants for an empty line, considering at most cuckoo_max_kicks occupants.
+ * If one is found, each occupant on the path moves one step along it (only the lines move, data
+ * files are named by the digest so they stay put) and the now empty candidate line of key is
+ * returned. Returns NO_LINE without changing anything if there is no such path. Compact lines
+ * don't have the digest the occupants' other candidates are computed from.
+ */
+static uint32_t freeLineByDisplacement(DCCache cache, DCKey_t *key) {
+  DisplacementNode_t nodes[NUM_LOOKUP_INDICIES + MAX_CUCKOO_KICKS];
+  uint32_t num_ways = cache->num_ways;
+  uint32_t num_nodes = 0, max_nodes = num_ways + cache->header.cuckoo_max_kicks;
+
+  for (int i=0; i < num_ways; i++) {
+    nodes[num_nodes++] = (DisplacementNode_t) {.line_idx=key->indicies[i], .parent=-1};
+  }
+
+  for (uint32_t n=0; n < num_nodes; n++) {
+    DCKey_t occupant_key = {.num_lines=0};
+    lineDigest(cache, nodes[n].line_idx, occupant_key.digest);
+    prepareKey(cache, &occupant_key);
+
+    for (int i=0; i < num_ways; i++) {
+      uint32_t alternate_idx = occupant_key.indicies[i];
+      bool visited = false;
+
+      if (!isLineUsed(cache, alternate_idx)) {
+        // Found room: shift every occupant on the path one step towards it, last one first
+        int32_t node = n;
+        uint32_t to_idx = alternate_idx;
+        while (node >= 0) {
+          moveLine(cache, nodes[node].line_idx, to_idx);
+          to_idx = nodes[node].line_idx;
+          node = nodes[node].parent;
+        }
+        return to_idx;
+      }
+
+      for (uint32_t v=0; v < num_nodes && !visited; v++) {
+        visited = nodes[v].line_idx == alternate_idx;
+      }
+      if (!visited && num_nodes < max_nodes) {
+        nodes[num_nodes++] = (DisplacementNode_t) {.line_idx=alternate_idx, .parent=n};
+      }
+    }
+  }
+
+  return NO_LINE;
+}
+
+/* Move a line and its fingerprint to an empty line, leaving the original empty
+ */
+static void moveLine(DCCache cache, uint32_t from_idx, uint32_t to_idx) {
+  copyLine(cache, from_idx, to_idx);
+  setFingerprint(cache, to_idx, fingerprintAt(cache, from_idx));
+  clearLine(cache, from_idx);
+  setFingerprint(cache, from_idx, EMPTY_FINGERPRINT);
+}
+
+/* Take the provided cache/sha1 to compute a path for the data and save it to a file there
+ */
+static bool saveDataFileForKey(DCCache cache, uint64_t sha1[2],  uint8_t *data, uint64_t data_len) {
+  char file_path[computeMaxFilePathSize(cache->directory_path)];
+  pathForSHA1(cache, sha1, file_path);
+
+  // A queued unlink of the key's previous file would remove this one
+  if (cache->unlinker) {
+    awaitUnlink(cache->unlinker, sha1);
+  }
+  // A mapped previous file would be truncated under its reader, the new value goes in a new file
+  if (isFilePinned(cache, sha1)) {
+    remove(file_path);
+  }
+
+  FILE *outfile = fopen(file_path, "w");
+
+  if (!outfile) {
+    // Handle the case of the directory not existing, if the cache is in /tmp individaul dirs
+    // may be gced over time
+    mkdirForSHA1IfNotExists(cache, sha1);
+    outfile = fopen(file_path, "w");
+
+    // That didn't fix it; we're out of ideas
+    if (!outfile) {
+      return false;
+    }
+  }
+  fwrite(data, sizeof(uint8_t), data_len, outfile);
+  fclose(outfile);
+  return true;
+}
+
+
+/***DCLookup Helpers***/
+
+
+/* Return the line that exactly matches the provided key's digest. If none is found we return
+ * NO_LINE. Only candidates whose fingerprint matches are read, so most misses never touch a line.
+ */
+static uint32_t findLineThatMatchesKey(DCCache cache, DCKey_t *key) {
+  uint32_t candidates = candidatesMatchingFingerprint(cache, key);
+
+  while (candidates) {
+    uint32_t idx = key->indicies[__builtin_ctz(candidates)];
+    if (lineMatchesDigest(cache, idx, key->digest)) {
+      return idx;
+    }
+    candidates &= candidates - 1;
+  }
+
+  return NO_LINE;
+}
+
+/* Find the line of a key that is looked up, and record the use of it. Returns NO_LINE on a miss,
+ * which an expired key is unless is_stale is given
+ */
+static uint32_t findLineForLookup(DCCache cache, DCKey_t *key, bool *is_stale) {
+  uint32_t line;
+
+  advanceResize(cache);
+  prepareKey(cache, key);
+  if (cache->admission_filter) {
+    sketchIncrement(cache->admission_filter, key->digest[0] ^ key->digest[1]);
+  }
+  line = findLineThatMatchesKey(cache, key);
+
+  // During a resize the key may not have been migrated yet; a hit moves it to the new table
+  if (line == NO_LINE && cache->resize_source) {
+    line = migrateKey(cache, key);
+  }
+
+  // None was found we don't have this data
+  if (line == NO_LINE) {
+    return NO_LINE;
+  }
+
+  // An expired key is a miss without opening its file, or is returned without counting as a use
+  if (isLineExpired(cache, line)) {
+    if (!is_stale) {
+      return NO_LINE;
+    }
+    *is_stale = true;
+  } else {
+    if (is_stale) {
+      *is_stale = false;
+    }
+    //Update the line's last accessed time, or whatever else the replacement policy records
+    policyOnHit(cache, line);
+  }
+  return line;
+}
+
+/* Read the value of a line into a new DCData, one of the pool's if it fits. NULL if it can't be read
+ */
+static DCData readValue(DCCache cache, uint32_t idx) {
+  DCData returnme = allocData(cache, lineSize(cache, idx));
+  uint64_t cap = returnme->pool ? returnme->pool->buffer_size : returnme->data_len;
+
+  if (!readValueInto(cache, idx, returnme->data, cap, &returnme->data_len)) {
+    DCDataFree(returnme);
+    return NULL;
+  }
+  // A data file that is larger than its line says, read it again at its size
+  if (returnme->data_len > cap) {
+    uint64_t data_len = returnme->data_len;
+    DCDataFree(returnme);
+    returnme = allocData(cache, data_len);
+    cap = returnme->pool ? returnme->pool->buffer_size : returnme->data_len;
+    if (!readValueInto(cache, idx, returnme->data, cap, &returnme->data_len) ||
+        returnme->data_len > cap) {
+      DCDataFree(returnme);
+      return NULL;
+    }
+  }
+  return returnme;
+}
+
+/* Read the value of a line into buf: its file, its range of a segment, its slot or its inline value.
+ * len is set to the size of the value, which is only read if it is at most cap bytes. Returns false
+ * if the value can't be read
+ */
+static bool readValueInto(DCCache cache, uint32_t idx, uint8_t *buf, uint64_t cap, uint64_t *len) {
+  uint64_t file_id[2];
+  *len = lineSize(cache, idx);
+
+  if (isLineInline(cache, idx)) {
+    if (*len <= cap) {
+      memcpy(buf, inlineValueSlot(cache, idx), *len);
+    }
+    return true;
+  }
+  if (isLineInSlot(cache, idx)) {
+    if (*len <= cap && !preadFully(cache->slots_fd, buf, *len, slotOffset(cache, idx))) {
+      fprintf(stderr, "Unable to read the slot of line %u\n", idx);
+      return false;
+    }
+    return true;
+  }
+  if (cache->locations && cache->locations[idx].segment_id) {
+    DCSegmentLocation_t location = cache->locations[idx];
+    int fd = segmentFd(cache, location.segment_id);
+    if (fd < 0) {
+      fprintf(stderr, "Unable to open segment %u\n", location.segment_id);
+      return false;
+    }
+    if (*len <= cap && !preadFully(fd, buf, *len, location.offset)) {
+      fprintf(stderr, "Unable to read %u bytes of segment %u\n", (uint32_t) *len, location.segment_id);
+      return false;
+    }
+    return true;
+  }
+  fileIdForLine(cache, idx, file_id);
+  return readDataFileInto(cache, file_id, buf, cap, len);
+}
+
+/* Read the data file of a value into buf if it fits, len is set to the size of the file. False if
+ * it isn't readable
+ */
+static bool readDataFileInto(DCCache cache, uint64_t file_id[2], uint8_t *buf, uint64_t cap, uint64_t *len) {
+  struct stat file_stats;
+  char file_path[computeMaxFilePathSize(cache->directory_path)];
+  pathForSHA1(cache, file_id, file_path);
+
+  int fd = open(file_path, O_RDONLY);
+
+  // For some reason we couldn't open the file
+  if (fd < 0) {
+    fprintf(stderr, "Unable to open cache file '%s'\n", file_path);
+    return false;
+  }
+  // We need to stat the file to figure out it's size
+  if (fstat(fd, &file_stats)) {
+    fprintf(stderr, "Unable to stat cache file '%s'\n", file_path);
+    close(fd);
+    return false;
+  }
+  *len = (uint64_t) file_stats.st_size;
+  bool read_ok = *len > cap || preadFully(fd, buf, *len, 0);
+  close(fd);
+  if (!read_ok) {
+    fprintf(stderr, "Unable to read cache file '%s'\n", file_path);
+  }
+  return read_ok;
+}
+
+/* pread that retries short reads, which large values can take
+ */
+static bool preadFully(int fd, uint8_t *buf, uint64_t len, uint64_t offset) {
+  while (len) {
+    ssize_t bytes_read = pread(fd, buf, len, offset);
+    if (bytes_read < 0 && errno == EINTR) {
+      continue;
+    }
+    if (bytes_read <= 0) {
+      return false;
+    }
+    buf += bytes_read;
+    offset += bytes_read;
+    len -= bytes_read;
+  }
+  return true;
+}
+
+
+/***DCRESIZE HELPERS***/
+
+
+/* Called by DCLoad. If a resize was in progress when the cache was closed, map the old table again
+ * so the migration can continue, and clean up after one that was interrupted before its swap.
+ */
+static void resumeResize(DCCache cache) {
+  char path[computeMaxFilePathSize(cache->directory_path)];
+  struct stat source_stats, table_stats;
+
+  computeCachePath(cache->directory_path, RESIZE_NEW_FN, path);
+  remove(path);
+
+  computeCachePath(cache->directory_path, RESIZE_SOURCE_FN, path);
+  if (stat(path, &source_stats)) {
+    return;
+  }
+  // Still the same file as the cache: the new table was never swapped in
+  if (fstat(cache->fd, &table_stats) == 0 && table_stats.st_dev == source_stats.st_dev &&
+      table_stats.st_ino == source_stats.st_ino) {
+    remove(path);
+    return;
+  }
+
+  cache->resize_source = loadTable(cache->directory_path, path, &cache->load_options);
+  if (!cache->resize_source) {
+    fprintf(stderr, "ERROR: Unable to load '%s', its entries are lost\n", path);
+    remove(path);
+    return;
+  }
+  cache->current_size_in_bytes += cache->resize_source->current_size_in_bytes;
+  cache->resize_cursor = 0; // Lines that were already migrated are empty, so this is cheap
+}
+
+static void finishResize(DCCache cache) {
+  char path[computeMaxFilePathSize(cache->directory_path)];
+  computeCachePath(cache->directory_path, RESIZE_SOURCE_FN, path);
+
+  closeTable(cache->resize_source);
+  cache->resize_source = NULL;
+  cache->resize_cursor = 0;
+  remove(path);
+}
+
+/* Move a used line of the resize source into the new table. If the new table has no room for it
+ * and every candidate is newer, the migrated line is the one evicted. Returns the line it ended up
+ * in, or NO_LINE if it was evicted. Caches with compact lines aren't resized.
+ */
+static uint32_t migrateLine(DCCache cache, uint32_t source_idx) {
+  DCCache source = cache->resize_source;
+  uint64_t access_time = lineAccessTime(source, source_idx);
+  DCKey_t key = {.num_lines=0};
+  lineDigest(source, source_idx, key.digest);
+  prepareKey(cache, &key);
 
-  // Zero the line (is bzero faster?)
-  line->last_access_time_in_ms_from_epoch = UNUSED_LAST_ACCESS_TIME;
-  line->key_sha1[0] = 0;
-  line->key_sha1[1] = 0;
-  line->size_in_bytes = 0;
-  line->flags = 0;
+  uint32_t to = findLineToClaimForKey(cache, &key);
+  if (isLineUsed(cache, to)) {
+    if (evictionRank(cache, to) > evictionRank(source, source_idx)) {
+      dropSourceLine(cache, source_idx, true);
+      return NO_LINE;
+    }
+    removeLine(cache, to);
+  }
+
+  writeLine(cache, to, key.digest, access_time, lineSize(source, source_idx));
+  setLineFlags(cache, to, lineFlags(source, source_idx));
+  setFingerprint(cache, to, key.fingerprint);
+  if (cache->locations) {
+    cache->locations[to] = source->locations[source_idx];
+  }
+  if (isLineInline(cache, to)) {
+    memcpy(inlineValueSlot(cache, to), inlineValueSlot(source, source_idx), lineSize(cache, to));
+  }
+  dropSourceLine(cache, source_idx, false);
+  return to;
 }
 
-// Remove the file associated with this line
-static void removeFileForLine(DCCache cache, DCCacheLine_t *line) {
-  char path_to_remove[computeMaxFilePathSize(cache->directory_path)];
-  pathForSHA1(cache, line->key_sha1, path_to_remove);
-  remove(path_to_remove);
+/* If key is still in the resize source, migrate it now. Returns its line in the new table, or
+ * NO_LINE
+ */
+static uint32_t migrateKey(DCCache cache, DCKey_t *key) {
+  DCCache source = cache->resize_source;
+  DCKey_t source_key = {.digest={key->digest[0], key->digest[1]}, .num_lines=0};
+  prepareKey(source, &source_key);
+
+  uint32_t line = findLineThatMatchesKey(source, &source_key);
+  return line != NO_LINE ? migrateLine(cache, line) : NO_LINE;
 }
 
-static void SHA1ForKey(char *key, uint64_t sha1[2]) {
-  SHA1Context ctx;
-  SHA1Reset(&ctx);
-  SHA1Input(&ctx, (const unsigned char*) key, strlen(key));
-  SHA1Result(&ctx);
-  memcpy(sha1, ctx.Message_Digest, sizeof(uint64_t) * 2);
+static bool removeKeyFromResizeSource(DCCache cache, DCKey_t *key) {
+  DCCache source = cache->resize_source;
+  DCKey_t source_key = {.digest={key->digest[0], key->digest[1]}, .num_lines=0};
+  prepareKey(source, &source_key);
+
+  uint32_t line = findLineThatMatchesKey(source, &source_key);
+  if (line != NO_LINE) {
+    dropSourceLine(cache, line, true);
+  }
+  return line != NO_LINE;
 }
 
-static bool mkdirForSHA1IfNotExists(DCCache cache, uint64_t sha1[2]) {
-  char dir_path[computeMaxFilePathSize(cache->directory_path)];
-  int mkdir_rv;
+/* Empty a line of the resize source. Its bytes leave the cache unless the line was migrated, in
+ * which case its data file now belongs to the new table and must stay.
+ */
+static void dropSourceLine(DCCache cache, uint32_t source_idx, bool remove_file) {
+  DCCache source = cache->resize_source;
 
-  dirForSHA1(cache, sha1, dir_path);
-  mkdir_rv = mkdir(dir_path, 0777);
-  if (mkdir_rv && errno != EEXIST) {
-    return false;
+  if (remove_file) {
+    cache->current_size_in_bytes -= lineSize(source, source_idx);
+    removeFileForLine(source, source_idx);
   }
-  return true;
+  clearLine(source, source_idx);
+  setFingerprint(source, source_idx, EMPTY_FINGERPRINT);
 }
 
-static void dirForSHA1(DCCache cache, uint64_t sha1[2], char *dest) {
-  uint8_t subdir = sha1[0] / 65536 / 65536 / 65536 / 256; // Use division to be byte order agnostic
-  sprintf(dest, "%s/%02x", cache->directory_path, subdir);
+/* Every operation does a little of an in progress resize, so it finishes without a pause
+ */
+static inline void advanceResize(DCCache cache) {
+  if (cache->resize_source) {
+    resizeStep(cache, RESIZE_LINES_PER_OPERATION);
+  }
 }
 
-static void pathForSHA1(DCCache cache, uint64_t sha1[2], char *dest) {
-  uint8_t subdir = sha1[0] / 65536 / 65536 / 65536 / 256; // Use division to be byte order agnostic
-  sprintf(dest, "%s/%02x/%016llx%016llx.cache_data", cache->directory_path, subdir,
-      (long long unsigned) sha1[0], (long long unsigned) sha1[1]);
+
+/***LINE ACCESSORS***/
+/* Lines are only read and written through these, so the rest of the code works the same for every
+ * line format. Access times are always in ms from the epoch and sizes in bytes.
+ */
+
+
+static inline bool isLineUsed(DCCache cache, uint32_t idx) {
+  return lineAccessTime(cache, idx) != UNUSED_LAST_ACCESS_TIME;
 }
 
-static uint64_t currentTimeInMSFromEpoch() {
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  return ((uint64_t) (tv.tv_sec)) * 1000 +  ((uint64_t) (tv.tv_usec/1000));
+static inline uint64_t lineAccessTime(DCCache cache, uint32_t idx) {
+  uint32_t time;
+  switch (cache->header.line_format) {
+    case DC_LINE_FORMAT_COMPACT:
+      time = cache->compact_lines[idx].last_access_time;
+      if (time == UNUSED_LAST_ACCESS_TIME) {
+        return UNUSED_LAST_ACCESS_TIME;
+      }
+      return cache->header.time_epoch_in_ms + (uint64_t) (time - 1) * COMPACT_TIME_UNIT_MS;
+    case DC_LINE_FORMAT_COLUMNAR:
+      return cache->columns.last_access_times[idx];
+    default:
+      return cache->lines[idx].last_access_time_in_ms_from_epoch;
+  }
 }
 
-static void recomputeCacheSizeFromLines(DCCache cache) {
-  uint64_t total_size_in_bytes = 0;
-  uint32_t num_lines = cache->header.num_lines; //Cache this here since it's in the comparison
-  for (int i=0; i < num_lines; i++) {
-    total_size_in_bytes += cache->lines[i].size_in_bytes;
+static inline void setLineAccessTime(DCCache cache, uint32_t idx, uint64_t time_in_ms) {
+  uint64_t expiry = lineExpiry(cache, idx);
+
+  // The expiry is stored relative to the time, so it is moved along. Moving the time back by under
+  // a second to a whole number of seconds before the expiry keeps the expiry exact
+  if (expiry) {
+    uint64_t ttl_in_seconds = expiry > time_in_ms ? (expiry - time_in_ms + 999) / 1000 : 0;
+    time_in_ms = expiry > time_in_ms ? expiry - ttl_in_seconds * 1000 : time_in_ms;
+    setLineFlags(cache, idx, policyFlags(cache, idx) | (uint32_t) (ttl_in_seconds + 1) << EXPIRY_SHIFT);
+  }
+  switch (cache->header.line_format) {
+    case DC_LINE_FORMAT_COMPACT:
+      cache->compact_lines[idx].last_access_time = compactTime(cache, time_in_ms);
+      break;
+    case DC_LINE_FORMAT_COLUMNAR:
+      cache->columns.last_access_times[idx] = time_in_ms;
+      break;
+    default:
+      cache->lines[idx].last_access_time_in_ms_from_epoch = time_in_ms;
   }
-  cache->current_size_in_bytes = total_size_in_bytes;
 }
 
-/* Evict the contents of the of the cache if the combined size of the current data and the proposed
- * element to be inserted is greater than the cache size.
+/* Record a hit on a line. With an access time granularity the line is only written once its time
+ * is that stale, so hits on a line that was used recently only read its page and don't dirty it.
  */
-static void maybeEvict(DCCache cache, uint64_t proposed_increase_bytes) {
-  // Never evict if eviction is turned off
-  if (cache->header.max_bytes == 0) {
-    return;
-  }
+static inline void touchLine(DCCache cache, uint32_t idx) {
+  uint32_t granularity = cache->access_time_granularity_in_ms;
+  uint64_t now;
 
-  // There's enough space for both the current data and the proposed increase
-  if ((cache->current_size_in_bytes + proposed_increase_bytes) < cache->header.max_bytes) {
+  if (!granularity) {
+    setLineAccessTime(cache, idx, currentTimeInMSFromEpoch());
     return;
   }
+  now = coarseTimeInMSFromEpoch();
+  if (now >= lineAccessTime(cache, idx) + granularity) {
+    setLineAccessTime(cache, idx, now);
+  }
+}
 
-  // Ok, we have to evict. After the insertion we want the size to be:
-  //   max_bytes * EVICT_TO_THIS_RATIO
-  // So we need to decrease that number by proposed_increase_bytes
-  uint64_t post_increase_desired_size = cache->header.max_bytes * EVICT_TO_THIS_RATIO;
-  uint64_t current_desired_size = post_increase_desired_size - proposed_increase_bytes;
-  DCEvictToSize(cache, current_desired_size);
+/* A time as stored in a compact line: never 0 (unused), clamped to the range the line can hold
+ */
+static inline uint32_t compactTime(DCCache cache, uint64_t time_in_ms) {
+  uint64_t epoch = cache->header.time_epoch_in_ms;
+  uint64_t units = time_in_ms > epoch ? (time_in_ms - epoch) / COMPACT_TIME_UNIT_MS : 0;
+  return units < UINT32_MAX ? (uint32_t) units + 1 : UINT32_MAX;
 }
 
+static inline uint32_t lineSize(DCCache cache, uint32_t idx) {
+  switch (cache->header.line_format) {
+    case DC_LINE_FORMAT_COMPACT:
+      return cache->compact_lines[idx].size_in_bytes;
+    case DC_LINE_FORMAT_COLUMNAR:
+      return cache->columns.sizes_in_bytes[idx];
+    default:
+      return cache->lines[idx].size_in_bytes;
+  }
+}
 
-/***DCAdd Helpers***/
+/* The 64 bits of the line's key that every format has, the fingerprints are derived from them
+ */
+static inline uint64_t lineKeyFingerprint(DCCache cache, uint32_t idx) {
+  uint64_t digest[2];
+  if (cache->header.line_format == DC_LINE_FORMAT_COMPACT) {
+    return cache->compact_lines[idx].key_fingerprint;
+  }
+  lineDigest(cache, idx, digest);
+  return digest[0] ^ digest[1];
+}
 
+/* The whole digest of the line's key. Compact lines don't have it
+ */
+static inline void lineDigest(DCCache cache, uint32_t idx, uint64_t digest[2]) {
+  assert(cache->header.line_format != DC_LINE_FORMAT_COMPACT);
+  if (cache->header.line_format == DC_LINE_FORMAT_COLUMNAR) {
+    digest[0] = cache->columns.key_sha1s[idx][0];
+    digest[1] = cache->columns.key_sha1s[idx][1];
+  } else {
+    digest[0] = cache->lines[idx].key_sha1[0];
+    digest[1] = cache->lines[idx].key_sha1[1];
+  }
+}
 
-/* Try to determine the best line to save the data to. The best one is based at look at all the
- * indicies in the associative set and picking either:
- * 1. The first empty one
- * 2. The one with the oldest last_access_time_in_ms_from_epoch
+/* Whether the line holds the key with this digest. Compact lines are only compared against keys
+ * whose bucket they are in, so the bits of the digest that chose the bucket already match
  */
-static DCCacheLine_t *findBestLineToWriteKeyTo(DCCache cache, uint64_t key_sha1[2]) {
-  uint32_t lookup_idxs[NUM_LOOKUP_INDICIES];
-  computeLookupIndiciesForKey(key_sha1, lookup_idxs, cache->header.num_lines);
-  DCCacheLine_t *best_line = cache->lines + lookup_idxs[0];
+static inline bool lineMatchesDigest(DCCache cache, uint32_t idx, uint64_t digest[2]) {
+  uint64_t line_digest[2];
+  if (cache->header.line_format == DC_LINE_FORMAT_COMPACT) {
+    return cache->compact_lines[idx].key_fingerprint == (digest[0] ^ digest[1]);
+  }
+  lineDigest(cache, idx, line_digest);
+  return line_digest[0] == digest[0] && line_digest[1] == digest[1];
+}
 
-  for(int i=0; i < NUM_LOOKUP_INDICIES; i++) {
-    uint32_t idx = lookup_idxs[i];
-    DCCacheLine_t *line = cache->lines + idx;
+static inline void writeLine(DCCache cache, uint32_t idx, uint64_t digest[2], uint64_t time_in_ms, uint32_t size_in_bytes) {
+  DCCompactLine_t *compact_line;
+  DCCacheLine_t *line;
 
-    //If this line is empty, we can break
-    if (line->last_access_time_in_ms_from_epoch == UNUSED_LAST_ACCESS_TIME) {
-      best_line = line;
+  cache->num_used_lines -= isLineUsed(cache, idx);
+  switch (cache->header.line_format) {
+    case DC_LINE_FORMAT_COMPACT:
+      compact_line = cache->compact_lines + idx;
+      compact_line->key_fingerprint = digest[0] ^ digest[1];
+      compact_line->last_access_time = compactTime(cache, time_in_ms);
+      compact_line->size_in_bytes = size_in_bytes;
       break;
-    }
+    case DC_LINE_FORMAT_COLUMNAR:
+      cache->columns.last_access_times[idx] = time_in_ms;
+      cache->columns.key_sha1s[idx][0] = digest[0];
+      cache->columns.key_sha1s[idx][1] = digest[1];
+      cache->columns.sizes_in_bytes[idx] = size_in_bytes;
+      cache->columns.flags[idx] = 0;
+      break;
+    default:
+      line = cache->lines + idx;
+      line->last_access_time_in_ms_from_epoch = time_in_ms;
+      line->key_sha1[0] = digest[0];
+      line->key_sha1[1] = digest[1];
+      line->size_in_bytes = size_in_bytes;
+      line->flags = 0; // We currently don't have any flags
+  }
+  cache->num_used_lines += isLineUsed(cache, idx);
+}
 
-    //This is the oldest line we've seen so far
-    if (line->last_access_time_in_ms_from_epoch < best_line->last_access_time_in_ms_from_epoch) {
-      best_line = line;
-    }
+static inline void clearLine(DCCache cache, uint32_t idx) {
+  uint64_t no_digest[2] = {0, 0};
+  switch (cache->header.line_format) {
+    case DC_LINE_FORMAT_COMPACT:
+      cache->num_used_lines -= isLineUsed(cache, idx);
+      bzero(cache->compact_lines + idx, sizeof(DCCompactLine_t));
+      break;
+    case DC_LINE_FORMAT_COLUMNAR:
+      writeLine(cache, idx, no_digest, UNUSED_LAST_ACCESS_TIME, 0);
+      break;
+    default:
+      cache->num_used_lines -= isLineUsed(cache, idx);
+      bzero(cache->lines + idx, sizeof(DCCacheLine_t));
+  }
+  if (cache->locations) {
+    cache->locations[idx] = (DCSegmentLocation_t) {0, 0};
   }
-  return best_line;
 }
 
-/* Take the provided cache/sha1 to compute a path for the data and save it to a file there
+static inline void copyLine(DCCache cache, uint32_t from_idx, uint32_t to_idx) {
+  cache->num_used_lines -= isLineUsed(cache, to_idx);
+  switch (cache->header.line_format) {
+    case DC_LINE_FORMAT_COMPACT:
+      cache->compact_lines[to_idx] = cache->compact_lines[from_idx];
+      break;
+    case DC_LINE_FORMAT_COLUMNAR:
+      cache->columns.last_access_times[to_idx] = cache->columns.last_access_times[from_idx];
+      cache->columns.key_sha1s[to_idx][0] = cache->columns.key_sha1s[from_idx][0];
+      cache->columns.key_sha1s[to_idx][1] = cache->columns.key_sha1s[from_idx][1];
+      cache->columns.sizes_in_bytes[to_idx] = cache->columns.sizes_in_bytes[from_idx];
+      cache->columns.flags[to_idx] = cache->columns.flags[from_idx];
+      break;
+    default:
+      cache->lines[to_idx] = cache->lines[from_idx];
+  }
+  if (cache->locations) {
+    cache->locations[to_idx] = cache->locations[from_idx];
+  }
+  if (isLineInline(cache, from_idx)) {
+    memcpy(inlineValueSlot(cache, to_idx), inlineValueSlot(cache, from_idx), lineSize(cache, from_idx));
+  }
+  cache->num_used_lines += isLineUsed(cache, to_idx);
+}
+
+/* The replacement policy's state of a line, see DCReplacementPolicy_t. Compact lines have none
  */
-static bool saveDataFileForKey(DCCache cache, uint64_t sha1[2],  uint8_t *data, uint64_t data_len) {
-  char file_path[computeMaxFilePathSize(cache->directory_path)];
-  pathForSHA1(cache, sha1, file_path);
+static inline uint32_t lineFlags(DCCache cache, uint32_t idx) {
+  switch (cache->header.line_format) {
+    case DC_LINE_FORMAT_COMPACT:
+      return 0;
+    case DC_LINE_FORMAT_COLUMNAR:
+      return cache->columns.flags[idx];
+    default:
+      return cache->lines[idx].flags;
+  }
+}
 
-  FILE *outfile = fopen(file_path, "w");
+static inline void setLineFlags(DCCache cache, uint32_t idx, uint32_t flags) {
+  switch (cache->header.line_format) {
+    case DC_LINE_FORMAT_COMPACT:
+      break;
+    case DC_LINE_FORMAT_COLUMNAR:
+      cache->columns.flags[idx] = flags;
+      break;
+    default:
+      cache->lines[idx].flags = flags;
+  }
+}
 
-  if (!outfile) {
-    // Handle the case of the directory not existing, if the cache is in /tmp individaul dirs
-    // may be gced over time
-    mkdirForSHA1IfNotExists(cache, sha1);
-    outfile = fopen(file_path, "w");
+static inline uint32_t policyFlags(DCCache cache, uint32_t idx) {
+  return lineFlags(cache, idx) & POLICY_FLAGS_MASK;
+}
 
-    // That didn't fix it; we're out of ideas
-    if (!outfile) {
-      return false;
-    }
+static inline void setPolicyFlags(DCCache cache, uint32_t idx, uint32_t flags) {
+  setLineFlags(cache, idx, (lineFlags(cache, idx) & ~POLICY_FLAGS_MASK) | flags);
+}
+
+/* When the line expires in ms from the epoch, 0 if it never does
+ */
+static inline uint64_t lineExpiry(DCCache cache, uint32_t idx) {
+  uint32_t encoded = lineFlags(cache, idx) >> EXPIRY_SHIFT;
+  if (!encoded) {
+    return 0;
   }
-  fwrite(data, sizeof(uint8_t), data_len, outfile);
-  fclose(outfile);
-  return true;
+  return lineAccessTime(cache, idx) + (uint64_t) (encoded - 1) * 1000;
 }
 
-static inline bool isLineUsed(DCCacheLine_t *line) {
-  return line->last_access_time_in_ms_from_epoch != UNUSED_LAST_ACCESS_TIME;
+/* Expire the line at expiry_in_ms, which must be a whole number of seconds after the line's time.
+ * Later expiries are capped at MAX_TTL_IN_SECONDS
+ */
+static inline void setLineExpiry(DCCache cache, uint32_t idx, uint64_t expiry_in_ms) {
+  uint64_t time = lineAccessTime(cache, idx);
+  uint64_t ttl_in_seconds = expiry_in_ms > time ? (expiry_in_ms - time) / 1000 : 0;
+  ttl_in_seconds = ttl_in_seconds < MAX_TTL_IN_SECONDS ? ttl_in_seconds : MAX_TTL_IN_SECONDS;
+  setLineFlags(cache, idx, policyFlags(cache, idx) | (uint32_t) (ttl_in_seconds + 1) << EXPIRY_SHIFT);
 }
 
+/* Checked against the coarse clock, lines only expire to the second
+ */
+static inline bool isLineExpired(DCCache cache, uint32_t idx) {
+  uint64_t expiry = lineExpiry(cache, idx);
+  return expiry && coarseTimeInMSFromEpoch() >= expiry;
+}
 
-/***DCLookup Helpers***/
+/* The 128 bits the data file of a line is named after: the digest for full and columnar lines, the
+ * key fingerprint and the bucket for compact ones. The high byte of the first word picks the subdir.
+ */
+static inline void fileIdForLine(DCCache cache, uint32_t idx, uint64_t file_id[2]) {
+  if (cache->header.line_format == DC_LINE_FORMAT_COMPACT) {
+    file_id[0] = cache->compact_lines[idx].key_fingerprint;
+    file_id[1] = idx / cache->num_ways;
+  } else {
+    lineDigest(cache, idx, file_id);
+  }
+}
+
+static inline void fileIdForKey(DCCache cache, DCKey_t *key, uint64_t file_id[2]) {
+  if (cache->header.line_format == DC_LINE_FORMAT_COMPACT) {
+    file_id[0] = key->digest[0] ^ key->digest[1];
+    file_id[1] = key->indicies[0] / cache->num_ways;
+  } else {
+    file_id[0] = key->digest[0];
+    file_id[1] = key->digest[1];
+  }
+}
+
+
+/* Whether the line's value is in its inline slot. Which values are inline only depends on their
+ * size, so it takes no flag
+ */
+static inline bool isLineInline(DCCache cache, uint32_t idx) {
+  return cache->inline_values && lineSize(cache, idx) <= cache->header.inline_value_bytes;
+}
+
+static inline uint8_t *inlineValueSlot(DCCache cache, uint32_t idx) {
+  return cache->inline_values + (size_t) idx * cache->header.inline_value_bytes;
+}
+
+/* Whether the line's value is in its slot of the slots file, which like inline values only depends
+ * on its size
+ */
+static inline bool isLineInSlot(DCCache cache, uint32_t idx) {
+  return cache->slots_fd >= 0 && lineSize(cache, idx) <= cache->header.slot_size;
+}
+
+static inline off_t slotOffset(DCCache cache, uint32_t idx) {
+  return (off_t) idx * cache->header.slot_size;
+}
 
 
-/* Return the line that exactly matches the provided key_sha1. If none is found we return NULL.
+/***LINE SCANS***/
+/* Passes over every line of the table. Columnar tables only read the column they need, with the
+ * SIMD kernels below; the other formats go line by line.
  */
-static DCCacheLine_t *findLineThatMatchesKey(DCCache cache, uint64_t key_sha1[2]) {
-  uint32_t indicies[NUM_LOOKUP_INDICIES];
 
-  computeLookupIndiciesForKey(key_sha1, indicies, cache->header.num_lines);
-  for (int i=0; i < NUM_LOOKUP_INDICIES; i++) {
-    DCCacheLine_t *line = cache->lines + indicies[i];
-    if(line->key_sha1[0] == key_sha1[0] && line->key_sha1[1] == key_sha1[1]) {
-      return line;
+
+static uint32_t countUsedLines(DCCache cache) {
+  uint32_t num_used_lines = 0;
+  if (cache->header.line_format == DC_LINE_FORMAT_COLUMNAR) {
+    return countNonZero64(cache->columns.last_access_times, cache->header.num_lines);
+  }
+  for (uint32_t i=0; i < cache->header.num_lines; i++) {
+    num_used_lines += isLineUsed(cache, i);
+  }
+  return num_used_lines;
+}
+
+static uint64_t sumLineSizes(DCCache cache) {
+  uint64_t total_size_in_bytes = 0;
+  if (cache->header.line_format == DC_LINE_FORMAT_COLUMNAR) {
+    return sum32(cache->columns.sizes_in_bytes, cache->header.num_lines);
+  }
+  for (uint32_t i=0; i < cache->header.num_lines; i++) {
+    total_size_in_bytes += lineSize(cache, i);
+  }
+  return total_size_in_bytes;
+}
+
+/* Write the index of every used line last accessed before threshold_in_ms to dest, in order, and
+ * return how many there are. dest must have room for every used line.
+ */
+static uint32_t selectLinesAccessedBefore(DCCache cache, uint64_t threshold_in_ms, uint32_t *dest) {
+  uint32_t num_selected = 0;
+  if (cache->header.line_format == DC_LINE_FORMAT_COLUMNAR) {
+    return selectNonZeroBelow64(cache->columns.last_access_times, cache->header.num_lines,
+                                threshold_in_ms, dest);
+  }
+  for (uint32_t i=0; i < cache->header.num_lines; i++) {
+    uint64_t time = lineAccessTime(cache, i);
+    if (time != UNUSED_LAST_ACCESS_TIME && time < threshold_in_ms) {
+      dest[num_selected++] = i;
     }
   }
+  return num_selected;
+}
 
-  return NULL;
+
+/***COLUMN KERNELS***/
+
+
+/* How many of values[0..n) aren't 0
+ */
+static uint32_t countNonZero64(const uint64_t *values, uint32_t n) {
+  uint32_t i = 0, num_zero = 0;
+#ifdef DC_X86
+  if (__builtin_cpu_supports("avx2")) {
+    return countNonZero64AVX2(values, n);
+  }
+#endif
+#if defined(__SSE2__)
+  __m128i zero_lanes = _mm_setzero_si128();
+  for (; i + 2 <= n; i += 2) {
+    __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *) (values + i)), _mm_setzero_si128());
+    // SSE2 has no 64 bit compare: a lane is zero if both of its halves are
+    eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+    zero_lanes = _mm_sub_epi64(zero_lanes, eq);
+  }
+  uint64_t lanes[2];
+  _mm_storeu_si128((__m128i *) lanes, zero_lanes);
+  num_zero = (uint32_t) (lanes[0] + lanes[1]);
+#elif defined(__aarch64__)
+  uint64x2_t zero_lanes = vdupq_n_u64(0);
+  for (; i + 2 <= n; i += 2) {
+    zero_lanes = vsubq_u64(zero_lanes, vceqzq_u64(vld1q_u64(values + i)));
+  }
+  num_zero = (uint32_t) vaddvq_u64(zero_lanes);
+#endif
+  for (; i < n; i++) {
+    num_zero += values[i] == 0;
+  }
+  return n - num_zero;
 }
 
-/* Read the data for the file that the key points to and return a DCData if it's readable or NULL if it's not
+/* The sum of values[0..n)
  */
-static DCData readDataFileForKey(DCCache cache, uint64_t key_sha1[2]) {
-  DCData returnme;
-  struct stat file_stats;
-  char file_path[computeMaxFilePathSize(cache->directory_path)];
-  pathForSHA1(cache, key_sha1, file_path);
+static uint64_t sum32(const uint32_t *values, uint32_t n) {
+  uint32_t i = 0;
+  uint64_t sum = 0;
+#ifdef DC_X86
+  if (__builtin_cpu_supports("avx2")) {
+    return sum32AVX2(values, n);
+  }
+#endif
+#if defined(__SSE2__)
+  __m128i sums = _mm_setzero_si128();
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (values + i));
+    sums = _mm_add_epi64(sums, _mm_unpacklo_epi32(v, _mm_setzero_si128()));
+    sums = _mm_add_epi64(sums, _mm_unpackhi_epi32(v, _mm_setzero_si128()));
+  }
+  uint64_t lanes[2];
+  _mm_storeu_si128((__m128i *) lanes, sums);
+  sum = lanes[0] + lanes[1];
+#elif defined(__aarch64__)
+  uint64x2_t sums = vdupq_n_u64(0);
+  for (; i + 4 <= n; i += 4) {
+    sums = vpadalq_u32(sums, vld1q_u32(values + i));
+  }
+  sum = vaddvq_u64(sums);
+#endif
+  for (; i < n; i++) {
+    sum += values[i];
+  }
+  return sum;
+}
 
-  // We need to stat the file to figure out it's size
-  if (stat(file_path, &file_stats)) {
-    fprintf(stderr, "Unable to stat cache file '%s'\n", file_path);
-    return NULL;
+/* Write the index of every value in values[0..n) that is neither 0 nor >= threshold to dest, in
+ * order, and return how many there are. Subtracting one turns 0 into the largest value, so both
+ * conditions become a single unsigned value - 1 < threshold - 1.
+ */
+static uint32_t selectNonZeroBelow64(const uint64_t *values, uint32_t n, uint64_t threshold, uint32_t *dest) {
+  uint32_t i = 0, num_selected = 0;
+  if (threshold == 0) {
+    return 0;
+  }
+  uint64_t limit = threshold - 1;
+#ifdef DC_X86
+  if (__builtin_cpu_supports("avx2")) {
+    return selectNonZeroBelow64AVX2(values, n, limit, dest);
+  }
+#endif
+#if defined(__SSE2__)
+  // Compare the 32 bit halves as unsigned (by flipping their sign bits) and combine them:
+  // v < limit if high(v) < high(limit), or the highs are equal and low(v) < low(limit)
+  const __m128i sign = _mm_set1_epi32((int) 0x80000000);
+  const __m128i one = _mm_set_epi32(0, 1, 0, 1);
+  const __m128i limit_v = _mm_set_epi32((int) (limit >> 32), (int) limit, (int) (limit >> 32), (int) limit);
+  const __m128i limit_flipped = _mm_xor_si128(limit_v, sign);
+  for (; i + 2 <= n; i += 2) {
+    __m128i v = _mm_sub_epi64(_mm_loadu_si128((const __m128i *) (values + i)), one);
+    __m128i lt = _mm_cmpgt_epi32(limit_flipped, _mm_xor_si128(v, sign));
+    __m128i eq = _mm_cmpeq_epi32(v, limit_v);
+    __m128i lt_high = _mm_shuffle_epi32(lt, _MM_SHUFFLE(3, 3, 1, 1));
+    __m128i eq_high = _mm_shuffle_epi32(eq, _MM_SHUFFLE(3, 3, 1, 1));
+    __m128i lt_low = _mm_shuffle_epi32(lt, _MM_SHUFFLE(2, 2, 0, 0));
+    __m128i below = _mm_or_si128(lt_high, _mm_and_si128(eq_high, lt_low));
+    uint32_t mask = (uint32_t) _mm_movemask_pd(_mm_castsi128_pd(below));
+    while (mask) {
+      dest[num_selected++] = i + __builtin_ctz(mask);
+      mask &= mask - 1;
+    }
   }
+#elif defined(__aarch64__)
+  const uint64x2_t limit_v = vdupq_n_u64(limit);
+  for (; i + 2 <= n; i += 2) {
+    uint64x2_t below = vcltq_u64(vsubq_u64(vld1q_u64(values + i), vdupq_n_u64(1)), limit_v);
+    if (vgetq_lane_u64(below, 0)) {
+      dest[num_selected++] = i;
+    }
+    if (vgetq_lane_u64(below, 1)) {
+      dest[num_selected++] = i + 1;
+    }
+  }
+#endif
+  for (; i < n; i++) {
+    if (values[i] - 1 < limit) {
+      dest[num_selected++] = i;
+    }
+  }
+  return num_selected;
+}
 
-  FILE *infile = fopen(file_path, "r");
 
-  // For some reason we couldn't open the file
-  if (!infile) {
-    fprintf(stderr, "Unable to open cache file '%s'\n", file_path);
-    return NULL;
+#ifdef DC_X86
+
+/* The AVX2 versions of the kernels above, compiled for AVX2 whatever the build targets and only
+ * called when the CPU has it
+ */
+__attribute__((target("avx2")))
+static uint32_t countNonZero64AVX2(const uint64_t *values, uint32_t n) {
+  uint32_t i = 0, num_zero;
+  __m256i zero_lanes = _mm256_setzero_si256();
+  for (; i + 4 <= n; i += 4) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (values + i));
+    // A lane that is zero compares to all ones, i.e. -1
+    zero_lanes = _mm256_sub_epi64(zero_lanes, _mm256_cmpeq_epi64(v, _mm256_setzero_si256()));
+  }
+  uint64_t lanes[4];
+  _mm256_storeu_si256((__m256i *) lanes, zero_lanes);
+  num_zero = (uint32_t) (lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+  for (; i < n; i++) {
+    num_zero += values[i] == 0;
+  }
+  return n - num_zero;
+}
+
+__attribute__((target("avx2")))
+static uint64_t sum32AVX2(const uint32_t *values, uint32_t n) {
+  uint32_t i = 0;
+  uint64_t sum;
+  __m256i sums = _mm256_setzero_si256();
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (values + i));
+    sums = _mm256_add_epi64(sums, _mm256_cvtepu32_epi64(v));
+  }
+  uint64_t lanes[4];
+  _mm256_storeu_si256((__m256i *) lanes, sums);
+  sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  for (; i < n; i++) {
+    sum += values[i];
   }
+  return sum;
+}
 
-  returnme = calloc(1, sizeof(DCData_t));
-  returnme->data_len = (uint64_t) (file_stats.st_size);
-  returnme->data = malloc(returnme->data_len * sizeof(uint8_t));
+/* Takes threshold - 1 as the limit, see selectNonZeroBelow64
+ */
+__attribute__((target("avx2")))
+static uint32_t selectNonZeroBelow64AVX2(const uint64_t *values, uint32_t n, uint64_t limit, uint32_t *dest) {
+  uint32_t i = 0, num_selected = 0;
+  // AVX2 only compares signed, flipping the sign bits makes that an unsigned compare
+  const __m256i sign = _mm256_set1_epi64x((long long) (1ULL << 63));
+  const __m256i one = _mm256_set1_epi64x(1);
+  const __m256i limit_v = _mm256_xor_si256(_mm256_set1_epi64x((long long) limit), sign);
+  for (; i + 4 <= n; i += 4) {
+    __m256i v = _mm256_sub_epi64(_mm256_loadu_si256((const __m256i *) (values + i)), one);
+    __m256i below = _mm256_cmpgt_epi64(limit_v, _mm256_xor_si256(v, sign));
+    uint32_t mask = (uint32_t) _mm256_movemask_pd(_mm256_castsi256_pd(below));
+    while (mask) {
+      dest[num_selected++] = i + __builtin_ctz(mask);
+      mask &= mask - 1;
+    }
+  }
+  for (; i < n; i++) {
+    if (values[i] - 1 < limit) {
+      dest[num_selected++] = i;
+    }
+  }
+  return num_selected;
+}
 
-  if (!returnme->data) {
-    fprintf(stderr, "Cannot allocate %lu bytes of memory to return data for '%s'\n",
-            (unsigned long)returnme->data_len, file_path);
-    return NULL;
+#endif
+
+
+/***FINGERPRINT HELPERS***/
+
+
+static inline uint16_t fingerprintForDigest(uint64_t digest[2], uint32_t fingerprint_bits) {
+  uint16_t fingerprint = (uint16_t) ((digest[0] ^ digest[1]) >> (64 - fingerprint_bits));
+  return fingerprint == EMPTY_FINGERPRINT ? 1 : fingerprint;
+}
+
+static inline uint16_t fingerprintAt(DCCache cache, uint32_t idx) {
+  if (cache->fingerprint_bits == 16) {
+    return ((uint16_t *) cache->fingerprints)[idx];
+  }
+  return ((uint8_t *) cache->fingerprints)[idx];
+}
+
+static inline void setFingerprint(DCCache cache, uint32_t idx, uint16_t fingerprint) {
+  if (cache->fingerprint_bits == 16) {
+    ((uint16_t *) cache->fingerprints)[idx] = fingerprint;
+  } else {
+    ((uint8_t *) cache->fingerprints)[idx] = (uint8_t) fingerprint;
+  }
+}
+
+/* Compare n (at most 16) consecutive 8 bit fingerprints against fingerprint in one vector compare.
+ * Returns a mask where bit i is set if fingerprints[i] matches.
+ */
+static inline uint32_t matchFingerprints8(const uint8_t *fingerprints, uint32_t n, uint8_t fingerprint) {
+  uint32_t mask = 0;
+#if defined(__SSE2__)
+  __m128i v;
+  if (n == 16) {
+    v = _mm_loadu_si128((const __m128i *) fingerprints);
+  } else if (n == 8) {
+    v = _mm_loadl_epi64((const __m128i *) fingerprints);
+  } else {
+    uint32_t word = 0;
+    memcpy(&word, fingerprints, n);
+    v = _mm_cvtsi32_si128((int) word);
+  }
+  mask = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8((char) fingerprint)));
+#elif defined(__aarch64__)
+  static const uint8_t bit_weights[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+  uint8_t buf[16] = {0};
+  memcpy(buf, fingerprints, n);
+  uint8x16_t eq = vandq_u8(vceqq_u8(vld1q_u8(buf), vdupq_n_u8(fingerprint)), vld1q_u8(bit_weights));
+  mask = vaddv_u8(vget_low_u8(eq)) | ((uint32_t) vaddv_u8(vget_high_u8(eq)) << 8);
+#else
+  for (uint32_t i=0; i < n; i++) {
+    mask |= (uint32_t) (fingerprints[i] == fingerprint) << i;
   }
+#endif
+  return mask & ((1u << n) - 1);
+}
 
-  fread(returnme->data, sizeof(uint8_t), returnme->data_len, infile);
-  fclose(infile);
+/* The 16 bit version of matchFingerprints8
+ */
+static inline uint32_t matchFingerprints16(const uint16_t *fingerprints, uint32_t n, uint16_t fingerprint) {
+  uint32_t mask = 0;
+#if defined(__SSE2__)
+  __m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+  __m128i needle = _mm_set1_epi16((short) fingerprint);
+  if (n >= 8) {
+    lo = _mm_loadu_si128((const __m128i *) fingerprints);
+    if (n == 16) {
+      hi = _mm_loadu_si128((const __m128i *) (fingerprints + 8));
+    }
+  } else {
+    uint64_t word = 0;
+    memcpy(&word, fingerprints, n * sizeof(uint16_t));
+    lo = _mm_loadl_epi64((const __m128i *) &word);
+  }
+  // Saturating pack turns each 16 bit compare result into one byte for movemask
+  __m128i packed = _mm_packs_epi16(_mm_cmpeq_epi16(lo, needle), _mm_cmpeq_epi16(hi, needle));
+  mask = (uint32_t) _mm_movemask_epi8(packed);
+#elif defined(__aarch64__)
+  static const uint8_t bit_weights[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+  uint16_t buf[16] = {0};
+  memcpy(buf, fingerprints, n * sizeof(uint16_t));
+  uint16x8_t needle = vdupq_n_u16(fingerprint);
+  uint8x16_t eq = vcombine_u8(vmovn_u16(vceqq_u16(vld1q_u16(buf), needle)),
+                              vmovn_u16(vceqq_u16(vld1q_u16(buf + 8), needle)));
+  eq = vandq_u8(eq, vld1q_u8(bit_weights));
+  mask = vaddv_u8(vget_low_u8(eq)) | ((uint32_t) vaddv_u8(vget_high_u8(eq)) << 8);
+#else
+  for (uint32_t i=0; i < n; i++) {
+    mask |= (uint32_t) (fingerprints[i] == fingerprint) << i;
+  }
+#endif
+  return mask & ((1u << n) - 1);
+}
 
-  return returnme;
+static inline uint32_t matchFingerprintRun(DCCache cache, uint32_t start_idx, uint32_t n, uint16_t fingerprint) {
+  if (cache->fingerprint_bits == 16) {
+    return matchFingerprints16(((uint16_t *) cache->fingerprints) + start_idx, n, fingerprint);
+  }
+  return matchFingerprints8(((uint8_t *) cache->fingerprints) + start_idx, n, (uint8_t) fingerprint);
+}
+
+/* Returns a mask where bit i is set if the fingerprint of the line at key->indicies[i] matches the
+ * key's. Bucketed layouts keep a bucket's fingerprints adjacent so they are compared in one go.
+ */
+static inline uint32_t candidatesMatchingFingerprint(DCCache cache, DCKey_t *key) {
+  switch (cache->num_ways) {
+    case 2:
+      return candidatesMatchingFingerprintN(cache, key, 2);
+    case 8:
+      return candidatesMatchingFingerprintN(cache, key, 8);
+    case 16:
+      return candidatesMatchingFingerprintN(cache, key, 16);
+    default:
+      return candidatesMatchingFingerprintN(cache, key, 4);
+  }
+}
+
+/* candidatesMatchingFingerprint for a way count known at compile time, which picks the width of
+ * the vector compare and unrolls the scattered loop
+ */
+static inline __attribute__((always_inline)) uint32_t candidatesMatchingFingerprintN(DCCache cache, DCKey_t *key, const uint32_t ways) {
+  uint32_t half = ways / 2;
+  uint32_t mask = 0;
+
+  switch (cache->header.table_layout) {
+    case DC_LAYOUT_BUCKETED:
+      return matchFingerprintRun(cache, key->indicies[0], ways, key->fingerprint);
+
+    case DC_LAYOUT_BUCKETED_TWO_CHOICE:
+      return matchFingerprintRun(cache, key->indicies[0], half, key->fingerprint) |
+             (matchFingerprintRun(cache, key->indicies[half], half, key->fingerprint) << half);
+
+    default:
+      for (int i=0; i < ways; i++) {
+        mask |= (uint32_t) (fingerprintAt(cache, key->indicies[i]) == key->fingerprint) << i;
+      }
+      return mask;
+  }
 }
 
 
 /***EVICTION HELPERS***/
-/* Return used lines sorted by last_access_time_in_ms_from_epoch from oldest to newest.
+/* Return the used lines that evicting bytes_to_free may have to go through, sorted by eviction
+ * rank, for LRU from oldest to newest.
  * NOTE: The return value is an array of sortables an they must be freed
  * Arguments:
  * -cache: A DCCache instance
- * -num_used_lines: A destination where the number of used lines will be stored
- * Returns: An array of LineSortable_t's for all lines in the cache
+ * -bytes_to_free: How many bytes of values the sortables must add up to at least, if the cache has
+ *                 that many
+ * -num_sortables: A destination where the number of sortables will be stored
+ * Returns: An array of LineSortable_t's for the oldest lines in the cache
  */
-LineSortable_t *lineSortablesFromOldestToNewest(DCCache cache, int *num_used_lines) {
-  int num_cache_lines = cache->header.num_lines;
-  *num_used_lines = DCNumItems(cache);
+LineSortable_t *lineSortablesFromOldestToNewest(DCCache cache, uint64_t bytes_to_free, int *num_sortables) {
+  uint32_t num_candidates;
+  uint64_t threshold_in_ms = evictionCutoff(cache, bytes_to_free, &num_candidates);
 
-  //Basic idea: We only want to bother with cache lines that are used
-  LineSortable_t *sortables = calloc(*num_used_lines, sizeof(LineSortable_t));
+  //Basic idea: We only want to bother with cache lines that are used, and old enough to be evicted
+  LineSortable_t *sortables = calloc(num_candidates, sizeof(LineSortable_t));
+  uint32_t *candidate_lines = calloc(num_candidates, sizeof(uint32_t));
 
   // Construct the sortables: Only put in used lines
-  int sortables_added = 0;
-  for (int i=0; i < num_cache_lines; i++) {
-    if (isLineUsed(cache->lines +i)) {
-      sortables[sortables_added].line_idx = i;
-      sortables[sortables_added].line = cache->lines + i;
-      sortables[sortables_added].last_access_time_in_ms_from_epoch =
-          cache->lines[i].last_access_time_in_ms_from_epoch;
-      sortables_added ++;
-
-      // This should never fail, but let's double check to avoid overflow
-      assert(sortables_added <= *num_used_lines);
-    }
+  *num_sortables = selectLinesAccessedBefore(cache, threshold_in_ms, candidate_lines);
+  for (int i=0; i < *num_sortables; i++) {
+    sortables[i].line_idx = candidate_lines[i];
+    sortables[i].eviction_rank = evictionRank(cache, candidate_lines[i]);
   }
+  free(candidate_lines);
 
-  //This should never fail either
-  assert(sortables_added == *num_used_lines);
+  //This should never fail
+  assert(*num_sortables == num_candidates);
 
   // Sort the sortables (what a novel idea)
-  qsort(sortables, *num_used_lines, sizeof(LineSortable_t), sortableCompareFunc);
+  qsort(sortables, *num_sortables, sizeof(LineSortable_t), sortableCompareFunc);
 
   return sortables;
 }
 
+/* The access time below which the used lines hold at least bytes_to_free bytes, found from a
+ * histogram of the access times weighted by the sizes, and how many lines that is. Only LRU ranks
+ * lines by their access time alone, so for the other policies, and for LRU caches with expiring
+ * lines that go first whatever their time, every used line is a candidate.
+ */
+static uint64_t evictionCutoff(DCCache cache, uint64_t bytes_to_free, uint32_t *num_candidates) {
+  uint64_t bucket_bytes[EVICTION_HISTOGRAM_BUCKETS] = {0};
+  uint32_t bucket_lines[EVICTION_HISTOGRAM_BUCKETS] = {0};
+  uint64_t min_time = UINT64_MAX, max_time = 0, bucket_width, freed_bytes = 0;
+  uint32_t num_lines = cache->header.num_lines;
+
+  if (cache->header.replacement_policy != DC_POLICY_LRU) {
+    *num_candidates = countUsedLines(cache);
+    return UINT64_MAX;
+  }
+  for (uint32_t i=0; i < num_lines; i++) {
+    uint64_t time = lineAccessTime(cache, i);
+    if (time == UNUSED_LAST_ACCESS_TIME) {
+      continue;
+    }
+    if (lineFlags(cache, i) >> EXPIRY_SHIFT) {
+      *num_candidates = countUsedLines(cache);
+      return UINT64_MAX;
+    }
+    min_time = time < min_time ? time : min_time;
+    max_time = time > max_time ? time : max_time;
+  }
+  if (min_time > max_time) {
+    *num_candidates = 0;
+    return UINT64_MAX;
+  }
+
+  // Buckets are bucket_width ms wide, starting at min_time, so no time lands past the last one
+  bucket_width = (max_time - min_time) / EVICTION_HISTOGRAM_BUCKETS + 1;
+  for (uint32_t i=0; i < num_lines; i++) {
+    uint64_t time = lineAccessTime(cache, i);
+    if (time != UNUSED_LAST_ACCESS_TIME) {
+      uint32_t bucket = (uint32_t) ((time - min_time) / bucket_width);
+      bucket_bytes[bucket] += lineSize(cache, i);
+      bucket_lines[bucket]++;
+    }
+  }
+
+  *num_candidates = 0;
+  for (uint32_t bucket=0; bucket < EVICTION_HISTOGRAM_BUCKETS; bucket++) {
+    freed_bytes += bucket_bytes[bucket];
+    *num_candidates += bucket_lines[bucket];
+    if (freed_bytes >= bytes_to_free) {
+      return min_time + (bucket + 1) * bucket_width;
+    }
+  }
+  return UINT64_MAX;
+}
+
 static int sortableCompareFunc(const void *a, const void *b) {
   LineSortable_t *left = (LineSortable_t *) a;
   LineSortable_t *right = (LineSortable_t *) b;
-  return left->last_access_time_in_ms_from_epoch - right->last_access_time_in_ms_from_epoch;
+  // Not a subtraction, the difference of two ranks needn't fit in an int
+  if (left->eviction_rank != right->eviction_rank) {
+    return left->eviction_rank < right->eviction_rank ? -1 : 1;
+  }
+  return 0;
 }
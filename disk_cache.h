@@ -7,6 +7,7 @@
 #define DISKCACHE_H_
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 
@@ -19,15 +20,111 @@
 
 /* The data file format for the DC Data file
  * 1. The DCCacheHeader: A single DCCacheHeader_t
- * 2. A number of DCCacheLine_t structs whose count is specified by the num_lines field of the
- *    DCCacheHeader_t
+ * 2. A number of DCCacheLine_t structs (DCCompactLine_t structs if the line_format field is
+ *    DC_LINE_FORMAT_COMPACT) whose count is specified by the num_lines field of the DCCacheHeader_t.
+ *    If the line_format is DC_LINE_FORMAT_COLUMNAR the same fields are stored as columns instead,
+ *    see DCColumns_t
+ * 3. If the fingerprint_bits field of the header isn't 0, one fingerprint of that many bits per line
+ * 4. If the storage field is DC_STORAGE_SEGMENTS, one DCSegmentLocation_t per line
+ * 5. If the inline_value_bytes field isn't 0, a slot of that many bytes per line, which holds the
+ *    value of the line if its size_in_bytes is at most inline_value_bytes
+ * Caches created before the header was extended only have the num_lines and max_bytes fields of
+ * the header (12 bytes) on disk; DCLoad detects them by the absent magic and still loads them.
  */
 
-/* The representation of the cache header.
+/* The engine used to reduce keys to the 128 bit digest stored in each line
+ */
+typedef enum {
+  DC_HASH_SHA1 = 0, // SHA-1, truncated to 128 bits. The only engine of legacy caches
+  DC_HASH_FAST128 = 1 // A seeded, non-cryptographic 128 bit hash. Much faster than SHA-1
+} DCHashEngine_t;
+
+/* How the candidate lines of a key are laid out in the table
+ */
+typedef enum {
+  // Every candidate line is at an independent pseudorandom position. The only layout of legacy caches
+  DC_LAYOUT_SCATTERED = 0,
+  // The table is split into buckets of num_ways adjacent lines and a key's candidates are the lines
+  // of a single bucket, so a lookup touches one contiguous, 64 byte aligned region of memory
+  DC_LAYOUT_BUCKETED = 1,
+  // Buckets of half as many lines (one 64 byte cache line each with 4 ways), a key may be stored in
+  // either of two buckets. Costs up to two memory accesses per lookup but evicts fewer live entries
+  DC_LAYOUT_BUCKETED_TWO_CHOICE = 2
+} DCTableLayout_t;
+
+/* The format of the lines in the table
+ */
+typedef enum {
+  DC_LINE_FORMAT_FULL = 0, // DCCacheLine_t. The only format of legacy caches
+  // DCCompactLine_t, half the size. Requires DC_LAYOUT_BUCKETED, and the cache can't be resized
+  DC_LINE_FORMAT_COMPACT = 1,
+  // The fields of DCCacheLine_t in separate columns, so scans over all lines (eviction, counting
+  // items, summing sizes) only read the columns they need, with SIMD
+  DC_LINE_FORMAT_COLUMNAR = 2
+} DCLineFormat_t;
+
+/* How the line to evict is chosen, both among the candidate lines of a new key and when the cache
+ * is over max_bytes. Policies other than LRU keep their state in the flags of the lines
+ */
+typedef enum {
+  DC_POLICY_LRU = 0, // Least recently used. The only policy of legacy caches and of compact lines
+  // Least frequently used: a logarithmic access counter that decays while the line isn't used
+  DC_POLICY_LFU = 1,
+  // Adaptive Replacement Cache: keys used once (T1) are evicted before keys used again (T2), and
+  // the share of T1 adapts to which of the two recently evicted keys come back from
+  DC_POLICY_ARC = 2,
+  // S3-FIFO: new keys go to a small FIFO and only move to the main FIFO if they are used while in
+  // it, so one-off keys such as a scan of many keys don't flush the keys that are used repeatedly
+  DC_POLICY_S3FIFO = 3,
+  // GreedyDual-Size-Frequency: keeps the keys with the most uses * cost / size, aged by their last
+  // access, so one large value evicts few small ones that are used often. The cost is a hint given
+  // with DCAddWithOptions
+  DC_POLICY_GDSF = 4
+} DCReplacementPolicy_t;
+
+/* Where the values are stored
+ */
+typedef enum {
+  DC_STORAGE_FILES = 0, // A data file per key, in the 00 to ff subdirectories. The only storage of legacy caches
+  // Values of at most 1/16 of segment_size are appended to large preallocated segment files instead
+  // of a file each, larger ones still get their own file. Saves creating, opening and unlinking a
+  // file per small value
+  DC_STORAGE_SEGMENTS = 1,
+  // Every line has a slot of slot_size bytes in a single preallocated file, cache_data.slots, at
+  // line index * slot_size. Values that don't fit still get their own file. For values of one size,
+  // a value is then never created or unlinked, only written over. Can't be resized
+  DC_STORAGE_SLOTS = 2
+} DCStorage_t;
+
+/* The representation of the cache header. It is padded to a fixed 128 bytes so that adding fields
+ * never moves the lines, and so that the buckets of the bucketed layouts start on 64 byte boundaries.
  */
 typedef struct __attribute__ ((__packed__)) {
   uint32_t num_lines;
   uint64_t max_bytes; // 0 = no limit
+
+  // Extended header, not present in legacy caches
+  uint64_t magic;
+  uint32_t version;
+  uint32_t hash_engine; // A DCHashEngine_t
+  uint64_t hash_seed[2]; // Mixed into every key digest, {0, 0} = unseeded
+  uint32_t table_layout; // A DCTableLayout_t
+  uint32_t fingerprint_bits; // 8 or 16 if the file holds a fingerprint array, 0 if it doesn't
+  uint32_t cuckoo_max_kicks; // How many lines an add may consider relocating, 0 = never relocate
+  uint32_t num_ways; // How many lines a key may be stored in: 2, 4, 8 or 16. 0 = 4
+  uint32_t line_format; // A DCLineFormat_t
+  uint64_t time_epoch_in_ms; // When the cache was made; compact lines store times relative to it
+  // The state of the lines as of the last DCCloseAndFree, so they don't have to be scanned on load.
+  // Only valid if closed_cleanly is 1; DCLoad sets it to 0 until the cache is closed again
+  uint64_t current_size_in_bytes;
+  uint32_t num_used_lines;
+  uint32_t closed_cleanly;
+  uint32_t replacement_policy; // A DCReplacementPolicy_t
+  uint32_t storage; // A DCStorage_t
+  uint32_t segment_size; // In bytes, with DC_STORAGE_SEGMENTS
+  uint32_t inline_value_bytes; // Values of at most this size are stored in the metadata file, 0 = none
+  uint32_t slot_size; // In bytes, with DC_STORAGE_SLOTS
+  uint8_t reserved[20];
 } DCCacheHeader_t;
 
 /* Representation of a single cache line. Each cache line is 32 bytes (256 bit).
@@ -39,28 +136,204 @@ typedef struct __attribute__ ((__packed__)) {
 
   uint64_t key_sha1[2]; // 16 bytes
   uint32_t size_in_bytes; // 4 byte
-  uint32_t flags; // 4 bytes
+  uint32_t flags; // 4 bytes. Replacement policy state in the low byte, the expiry above it
 } DCCacheLine_t;
 
+/* The line of caches with the DC_LINE_FORMAT_COMPACT line format, 16 bytes (256 per 4KB page).
+ * Only bucketed caches use it: the bucket a line is in holds the bits of the key's digest that
+ * chose the bucket, the key_fingerprint holds 64 more.
+ */
+typedef struct __attribute__ ((__packed__)) {
+  uint64_t key_fingerprint; // key_sha1[0] ^ key_sha1[1] of the full line format
+  // Whole seconds since the header's time_epoch_in_ms, plus one. If 0, the entry is unoccupied
+  uint32_t last_access_time;
+  uint32_t size_in_bytes;
+} DCCompactLine_t;
+
+/* The lines of caches with the DC_LINE_FORMAT_COLUMNAR line format: one array per field of
+ * DCCacheLine_t, stored one after the other in this order.
+ */
+typedef struct {
+  uint64_t *last_access_times; // In ms from the epoch, 0 = unoccupied
+  uint64_t (*key_sha1s)[2];
+  uint32_t *sizes_in_bytes;
+  uint32_t *flags;
+} DCColumns_t;
+
+/* Where in the segments the value of a line is, for caches with DC_STORAGE_SEGMENTS. Its length is
+ * the line's size_in_bytes.
+ */
+typedef struct __attribute__ ((__packed__)) {
+  uint32_t segment_id; // 0 = the value has its own data file (or the line is unoccupied)
+  uint32_t offset; // In bytes from the start of the segment
+} DCSegmentLocation_t;
+
+/* The most candidate lines a key may be stored in, see DCMakeOptions_t.num_ways
+ */
+#define DC_MAX_LOOKUP_INDICIES 16
+
+/* A key that has already been hashed for a particular cache, see DCKeyMake. Its fields should be
+ * treated as opaque; it only exists so keys can live on the stack without an allocation.
+ */
+typedef struct {
+  uint64_t digest[2];
+  uint32_t num_lines; // The table size indicies were computed for, 0 if not computed yet
+  uint32_t indicies[DC_MAX_LOOKUP_INDICIES];
+  uint16_t fingerprint;
+} DCKey_t;
+
 /* A struct used to return a data result
  */
 typedef struct {
   uint8_t *data;
   uint64_t data_len;
+  struct DCDataPool_s *pool; // The pool DCDataFree returns it to, NULL if it was allocated for the value
 } DCData_t;
 
+/* A read-only view of a value, returned by DCLookupMapped. Only data and data_len are meant to be
+ * read, the other fields are for DCMappedDataRelease.
+ */
+typedef struct {
+  const uint8_t *data;
+  uint64_t data_len;
+  struct DCCache_s *cache;
+  void *map_start; // The mapping that data is in, or the copy that it is if pin_kind is 0
+  size_t map_size;
+  uint32_t pin_kind; // What kind of value is mapped: its own file or a range of a segment, 0 = copied
+  uint64_t pin_id[2]; // The file id, or the segment id and offset
+} DCMappedData_t;
+
+/* Options for loading a cache with DCLoadWithOptions. Initialize with DCLoadOptionsInit and then
+ * override individual fields. They only change how the table is mapped, not what is in it.
+ */
+typedef struct {
+  // Read the whole table in when it is loaded, in one sequential pass, instead of a page fault at a
+  // time as lookups first touch it
+  bool populate;
+  // Ask for transparent huge pages for the table, so lookups on a large table miss the TLB less.
+  // Only a hint: whether the kernel uses them for a file depends on the kernel and file system
+  bool huge_pages;
+  // mlock the table so it is never paged out. If that fails (see RLIMIT_MEMLOCK) the cache still
+  // loads and a warning is printed
+  bool lock;
+} DCLoadOptions_t;
+
+/* Options for adding a single key with DCAddWithOptions. Initialize with DCAddOptionsInit and then
+ * override individual fields.
+ */
+typedef struct {
+  // Expire the key this many seconds from now, see DCAddWithTTL. 0 = never
+  uint32_t ttl_in_seconds;
+  // How expensive the value is to recompute, relative to other values. Only used by DC_POLICY_GDSF,
+  // which rounds it down to a power of 2 of at most 2^15. Default 1
+  uint32_t cost;
+} DCAddOptions_t;
+
+/* Options for the background evictor, see DCStartEvictor. Initialize with DCEvictorOptionsInit and
+ * then override individual fields.
+ */
 typedef struct {
+  // Start evicting once the cache holds this fraction of max_bytes...
+  double high_watermark;
+  // ...and keep evicting, in the order of the replacement policy, until it holds no more than this fraction
+  double low_watermark;
+  // The most lines evicted per second, so eviction doesn't compete with the foreground for the
+  // disk. 0 = no limit
+  uint32_t max_evictions_per_second;
+} DCEvictorOptions_t;
+
+typedef struct DCCache_s {
   DCCacheHeader_t header;
-  DCCacheLine_t *lines;
+  DCCacheLine_t *lines; // NULL if the lines are compact
+  DCCompactLine_t *compact_lines; // NULL unless the lines are compact
+  DCColumns_t columns; // All NULL unless the lines are columnar
   char *directory_path;
   int fd;
   uint64_t current_size_in_bytes;
+  uint32_t num_used_lines; // Of this table, not counting the resize_source
+  uint32_t eviction_hand; // The next line an add that has to evict samples
   void *mmap_start;
+  size_t mmap_size;
+  // One small hash of the key per line (0 = empty), checked before the line itself is read. Either
+  // part of the mapping or, for caches whose file has none, built in memory by DCLoad
+  void *fingerprints;
+  uint32_t fingerprint_bits;
+  bool fingerprints_in_memory;
+  uint32_t num_ways; // From the header, with the legacy default of 4 filled in
+  // While a DCResize is in progress, the previous table and the next of its lines to migrate. Its
+  // bytes are counted in current_size_in_bytes of this cache, not its own
+  struct DCCache_s *resize_source;
+  uint32_t resize_cursor;
+  uint32_t access_time_granularity_in_ms; // See DCSetAccessTimeGranularity, 0 = exact
+  DCLoadOptions_t load_options; // Also used for the tables DCResize and DCConvertLineFormat load
+  struct DCEvictor_s *evictor; // NULL unless a background evictor was started with DCStartEvictor
+  struct DCUnlinker_s *unlinker; // NULL unless started with DCStartDeferredUnlink
+  struct DCSketch_s *admission_filter; // NULL unless enabled with DCSetAdmissionFilter
+  struct DCDataPool_s *data_pool; // NULL unless set with DCSetDataPool
+  // With DC_STORAGE_SEGMENTS, the location of every line's value, part of the mapping, and the
+  // segments themselves, shared with the resize_source. Both NULL otherwise
+  DCSegmentLocation_t *locations;
+  struct DCSegments_s *segments;
+  uint8_t *inline_values; // The inline value slots, part of the mapping. NULL if there are none
+  int slots_fd; // The file of the DC_STORAGE_SLOTS slots, -1 with other storage
+  // The values mapped by DCLookupMapped that haven't been released yet, which are not written over.
+  // Shared with the resize_source
+  struct DCPins_s *pins;
+  // The state of the replacement policy that isn't in the lines, see DCReplacementPolicy_t. ARC
+  // and S3-FIFO remember the keys they recently evicted as 16 bit fingerprints, 0 = empty
+  uint16_t *ghosts;
+  uint32_t num_ghosts;
+  uint32_t num_ghosts_by_list[2]; // Of keys evicted from T1 and T2 (ARC)
+  // The share of the used lines that is in T1 (ARC) or in the small FIFO (S3-FIFO), estimated from
+  // the lines eviction looks at, and the share either should have
+  double probation_fraction;
+  double probation_target;
+  uint64_t random_state; // For the probabilistic increments of the LFU counters
 } DCCache_t;
 
+/* Options for creating a cache with DCMakeWithOptions. Initialize with DCMakeOptionsInit and then
+ * override individual fields.
+ */
+typedef struct {
+  DCHashEngine_t hash_engine;
+  bool seed_hash; // Mix a random per-cache seed into every key digest
+  DCTableLayout_t table_layout; // For bucketed layouts num_lines is rounded up to whole buckets
+  // 8 or 16 to keep a fingerprint array in the cache file, as DCMake does. With 0 DCLoad builds an
+  // 8 bit array in memory instead, which costs a pass over the table on every load
+  uint32_t fingerprint_bits;
+  // When all of a key's candidate lines are in use, look for a chain of at most this many occupants
+  // that can each move to another of their own candidate lines, and move them instead of evicting.
+  // Only the lines move, not the data. 0 disables it. Has no effect with DC_LAYOUT_BUCKETED, where
+  // the occupants of a bucket have no candidates outside of it
+  uint32_t cuckoo_max_kicks;
+  // How many lines a key may be stored in: 2, 4, 8 or 16. More ways mean fewer entries evicted
+  // because their lines happen to be taken while the table has room, at the cost of probing more
+  // lines per lookup. With the bucketed layouts num_lines is rounded up to whole buckets of this size
+  uint32_t num_ways;
+  // DC_LINE_FORMAT_COMPACT halves the memory the table takes, at the cost of coarser (1 second)
+  // access times. It requires DC_LAYOUT_BUCKETED and disables resizing and cuckoo_max_kicks.
+  // DC_LINE_FORMAT_COLUMNAR takes the same space as the default but speeds up eviction
+  DCLineFormat_t line_format;
+  // Which lines are evicted first. Compact lines have no flags and only support DC_POLICY_LRU
+  DCReplacementPolicy_t replacement_policy;
+  // DC_STORAGE_SEGMENTS stores small values in segments of segment_size bytes (64 KB to 4 GB). Space
+  // of removed values is punched out of the segments, and DCEvictToSize moves the values out of
+  // mostly empty ones so those can be dropped. Can't be converted to compact lines.
+  // DC_STORAGE_SLOTS allocates num_lines * slot_size bytes of disk up front, so it is meant for
+  // values that are all about slot_size. It disables resizing and cuckoo_max_kicks
+  DCStorage_t storage;
+  uint32_t segment_size;
+  uint32_t slot_size;
+  // Store values of at most this many bytes (up to 1024) in the metadata file itself, in a slot of
+  // this size per line, so looking them up reads no file at all. The table grows by num_lines times
+  // this. 0 = off
+  uint32_t inline_value_bytes;
+} DCMakeOptions_t;
+
 
 //Abstract Types
 typedef DCData_t *DCData;
+typedef DCMappedData_t *DCMappedData;
 typedef DCCache_t *DCCache;
 
 
@@ -79,6 +352,25 @@ typedef DCCache_t *DCCache;
  */
 DCCache DCMake(char *cache_directory_path, uint32_t num_lines, uint64_t max_bytes);
 
+/* Fill in the recommended options for a new cache: the DC_HASH_FAST128 engine with a random seed,
+ * so that keys chosen by an adversary can't be made to collide in a set, and the bucketed table
+ * layout. DCMake itself keeps using the unseeded SHA-1 engine and the scattered layout so data file
+ * paths stay sha1(key) as they always have been.
+ * Arguments:
+ * -options: The options to initialize
+ */
+void DCMakeOptionsInit(DCMakeOptions_t *options);
+
+/* Create a DCCache, like DCMake, but with the provided options. Arguments
+ * -cache_directory_path: A (preferably empty) directory where the cache data will be stored
+ * -num_lines: The maximum number of elements to store in the cache, dictates memory usage
+ * -max_bytes: The maximum number of bytes to store in the cache. SPECIFY 0 FOR NO LIMIT
+ * -options: Options initialized with DCMakeOptionsInit, NULL to get the same cache DCMake makes
+ * Returns: The created DCCache or null if we were unable to create it
+ */
+DCCache DCMakeWithOptions(char *cache_directory_path, uint32_t num_lines, uint64_t max_bytes,
+                          DCMakeOptions_t *options);
+
 /* Load a pre-existing disk cache. If the disk cache doesn't exist or is corrupt, this function
  * will return NULL.
  * Arguments:
@@ -88,6 +380,29 @@ DCCache DCMake(char *cache_directory_path, uint32_t num_lines, uint64_t max_byte
  */
 DCCache DCLoad(char *cache_directory_path);
 
+/* Fill in the default load options, which map the table the way DCLoad does: nothing prefaulted,
+ * no huge pages, not locked.
+ * Arguments:
+ * -options: The options to initialize
+ */
+void DCLoadOptionsInit(DCLoadOptions_t *options);
+
+/* Load a pre-existing disk cache, like DCLoad, but with the provided options.
+ * Arguments:
+ * -cache_directory_path: A directory where the cache data is stored
+ * -options: Options initialized with DCLoadOptionsInit, NULL for the defaults
+ * Returns: An instance of a DCCache, to be disposed of with DCCloseAndFree, or NULL
+ */
+DCCache DCLoadWithOptions(char *cache_directory_path, DCLoadOptions_t *options);
+
+/* The number of bytes of the table that are currently in memory, at most its size. Lookups of keys
+ * whose lines aren't resident have to wait for the disk.
+ * Arguments:
+ * -cache: A DCCache instance
+ * Returns: The resident bytes of the cache file's mapping (header, lines and fingerprints)
+ */
+uint64_t DCResidentBytes(DCCache cache);
+
 /* Free all state associated with a cache and close all open files that it is using.
  * Arguments:
  * -cache: A DCCache instance
@@ -101,10 +416,24 @@ void DCCloseAndFree(DCCache cache);
  * -key: A null terminated string for a key to add
  * -data: A byte array of the data to store in the cache
  * -data_len: The length of data, in bytes
- * Returns: true on success and false on failure
+ * Returns: true if the value was added, false on failure or if the admission filter
+ *          (see DCSetAdmissionFilter) turned it away
  */
 bool DCAdd(DCCache cache, char *key, uint8_t *data, uint64_t data_len);
 
+/* Identical to DCAdd, but the key is an arbitrary byte array rather than a null terminated string.
+ * DCAddBin(cache, key, strlen(key), ...) stores the same entry as DCAdd(cache, key, ...).
+ * Arguments:
+ * -cache: A DCCache instance
+ * -key: The key bytes, which may contain '\0'
+ * -key_len: The length of key, in bytes
+ * -data: A byte array of the data to store in the cache
+ * -data_len: The length of data, in bytes
+ * Returns: true if the value was added, false on failure or if the admission filter
+ *          (see DCSetAdmissionFilter) turned it away
+ */
+bool DCAddBin(DCCache cache, const void *key, size_t key_len, uint8_t *data, uint64_t data_len);
+
 /* Lookup a key in the provided DCCache.
  * Arguments:
  * -cache: An instance of a DCCache
@@ -114,6 +443,83 @@ bool DCAdd(DCCache cache, char *key, uint8_t *data, uint64_t data_len);
  */
 DCData DCLookup(DCCache cache, char *key);
 
+/* Identical to DCLookup, but the key is an arbitrary byte array of key_len bytes.
+ */
+DCData DCLookupBin(DCCache cache, const void *key, size_t key_len);
+
+/* Identical to DCLookup, but the value is read into the caller's buffer, so a hit allocates nothing.
+ * A buffer that is too small is left alone and len tells how large it has to be; the lookup still
+ * counts as a use of the key.
+ * Arguments:
+ * -cache: An instance of a DCCache
+ * -key: A null terminated string for a key to look up
+ * -buf: Where to read the value to
+ * -cap: The size of buf, in bytes
+ * -len: Set to the length of the value, in bytes, if the key is found. Only if it is at most cap was
+ *  the value read into buf
+ * Returns: Whether the key was found
+ */
+bool DCLookupInto(DCCache cache, char *key, uint8_t *buf, uint64_t cap, uint64_t *len);
+
+/* Identical to DCLookup, but the value is mapped instead of read into memory, so a large value is
+ * neither allocated nor copied. A value in its own file or in a segment stays readable until the
+ * view is released, even if the key is removed, evicted or added again in the meantime: the view
+ * keeps the file it maps, and the cache doesn't punch out or overwrite a mapped range. Inline values
+ * and values in slots are overwritten in place, so those are copied instead. Mapping costs more than
+ * reading a value of less than a few hundred KB.
+ * Arguments:
+ * -cache: An instance of a DCCache
+ * -key: A null terminated string for a key to look up
+ * Returns: If the key is found, a DCMappedData that must be released with DCMappedDataRelease
+ * before the cache is closed. If the key is not found, NULL is returned instead.
+ */
+DCMappedData DCLookupMapped(DCCache cache, char *key);
+
+/* Unmap a value returned by DCLookupMapped. Its data can't be read anymore afterwards.
+ * Arguments
+ * -mapped: A DCMappedData returned by DCLookupMapped
+ */
+void DCMappedDataRelease(DCMappedData mapped);
+
+/* Initialize options with the defaults, with which DCAddWithOptions is the same as DCAdd.
+ */
+void DCAddOptionsInit(DCAddOptions_t *options);
+
+/* Identical to DCAdd, with options for this key.
+ * Arguments:
+ * -cache: A DCCache instance
+ * -key: A null terminated string for a key to add
+ * -data: A byte array of the data to store in the cache
+ * -data_len: The length of data, in bytes
+ * -options: Options initialized with DCAddOptionsInit, or NULL for the defaults
+ * Returns: As DCAdd; false for a TTL on a cache with compact lines
+ */
+bool DCAddWithOptions(DCCache cache, char *key, uint8_t *data, uint64_t data_len, DCAddOptions_t *options);
+
+/* Identical to DCAdd, but the key expires ttl_in_seconds from now. DCLookup treats an expired key as
+ * a miss, without reading its data file, and eviction removes expired keys before any other. The
+ * expiry is kept in the key's line, which compact lines have no room for. TTLs over 194 days are
+ * capped at that.
+ * Arguments:
+ * -cache: A DCCache instance
+ * -key: A null terminated string for a key to add
+ * -data: A byte array of the data to store in the cache
+ * -data_len: The length of data, in bytes
+ * -ttl_in_seconds: How long the key is valid for, 0 for as long as it is in the cache
+ * Returns: As DCAdd; false for a TTL on a cache with compact lines
+ */
+bool DCAddWithTTL(DCCache cache, char *key, uint8_t *data, uint64_t data_len, uint32_t ttl_in_seconds);
+
+/* Identical to DCLookup, but an expired key that is still in the cache is returned too, for the
+ * caller to serve while it revalidates it. Returning an expired key doesn't count as a use of it.
+ * Arguments:
+ * -cache: An instance of a DCCache
+ * -key: A null terminated string for a key to look up
+ * -is_stale: Set to whether the returned key expired. Not set if NULL is returned
+ * Returns: As DCLookup
+ */
+DCData DCLookupStale(DCCache cache, char *key, bool *is_stale);
+
 /* If the key exists in the cache, remove it
  * Arguments:
  * -cache: A DCCache instance
@@ -121,15 +527,176 @@ DCData DCLookup(DCCache cache, char *key);
  */
 void DCRemove(DCCache cache, char *key);
 
+/* Identical to DCRemove, but the key is an arbitrary byte array of key_len bytes.
+ */
+void DCRemoveBin(DCCache cache, const void *key, size_t key_len);
+
+/* Hash a key once so it can be used by any number of DCLookupKey, DCAddKey and DCRemoveKey calls,
+ * for example a lookup that misses followed by the add of the fetched value. The digest and the
+ * candidate lines are computed here, so calling this doesn't touch the table and needs no lock.
+ * A DCKey_t is only valid for the cache it was made for.
+ * Arguments:
+ * -cache: The DCCache the key will be used with
+ * -key: The key bytes
+ * -key_len: The length of key, in bytes
+ * -dest: The DCKey_t to fill in
+ */
+void DCKeyMake(DCCache cache, const void *key, size_t key_len, DCKey_t *dest);
+
+/* Make a DCKey_t from a digest the caller already has (ex: a content hash), skipping the hash engine
+ * entirely. The digest should be uniformly distributed since it picks the key's candidate lines.
+ * Arguments:
+ * -cache: The DCCache the key will be used with
+ * -digest: A 128 bit digest that identifies the key
+ * -dest: The DCKey_t to fill in
+ */
+void DCKeyFromDigest(DCCache cache, const uint8_t digest[16], DCKey_t *dest);
+
+/* DCAdd, DCLookup and DCRemove (and their TTL, options, stale, mapped and into variants) for a key
+ * made with DCKeyMake or DCKeyFromDigest.
+ */
+bool DCAddKey(DCCache cache, DCKey_t *key, uint8_t *data, uint64_t data_len);
+bool DCAddKeyWithTTL(DCCache cache, DCKey_t *key, uint8_t *data, uint64_t data_len, uint32_t ttl_in_seconds);
+bool DCAddKeyWithOptions(DCCache cache, DCKey_t *key, uint8_t *data, uint64_t data_len, DCAddOptions_t *options);
+DCData DCLookupKey(DCCache cache, DCKey_t *key);
+DCData DCLookupKeyStale(DCCache cache, DCKey_t *key, bool *is_stale);
+DCMappedData DCLookupKeyMapped(DCCache cache, DCKey_t *key);
+bool DCLookupKeyInto(DCCache cache, DCKey_t *key, uint8_t *buf, uint64_t cap, uint64_t *len);
+void DCRemoveKey(DCCache cache, DCKey_t *key);
+
 /* Evict to the specified number of bytes. This normally isn't needed but could be done to clear
- * a lot of space in the cache before adding a lot of elements. Oldest elements are always evicted
- * first.
+ * a lot of space in the cache before adding a lot of elements. Elements are evicted in the order of
+ * the replacement policy, for DC_POLICY_LRU oldest first. Unlike the eviction done by DCAdd, which
+ * only samples a few lines, this sorts every line of the cache. With DC_STORAGE_SEGMENTS it then
+ * moves the values of segments that are less than a quarter full to the newest one, and drops them.
  * Arguments:
  * -cache: The cache
  * -allowedBytes: The maximum number of bytes that will still be in the cache after the operation
  */
 void DCEvictToSize(DCCache cache, uint64_t allowed_bytes);
 
+/* Change the number of lines of the cache without dropping its contents. A new table is created
+ * next to the current one and atomically swapped in; the lines of the old table are then migrated
+ * into it a few at a time by every DCAdd, DCLookup and DCRemove (data files stay where they are,
+ * only lines move). Until the migration is complete lookups check both tables. If the cache is
+ * closed before that, DCLoad picks the migration up where it left off. Call DCResizeStep to finish
+ * the migration sooner. Shrinking the table evicts the oldest of the lines that no longer fit.
+ * Arguments:
+ * -cache: A DCCache instance
+ * -new_num_lines: The number of lines of the new table, rounded up to whole buckets
+ * Returns: true if the new table was swapped in, false if the cache is unchanged
+ */
+bool DCResize(DCCache cache, uint32_t new_num_lines);
+
+/* Migrate up to max_lines lines of the old table of an in progress DCResize.
+ * Arguments:
+ * -cache: A DCCache instance
+ * -max_lines: The most lines of the old table to visit, UINT32_MAX to finish the migration
+ * Returns: true if no migration is in progress anymore
+ */
+bool DCResizeStep(DCCache cache, uint32_t max_lines);
+
+/* Convert a cache to another line format, see DCMakeOptions_t.line_format. Converting to compact
+ * lines rebuilds the table with the bucketed layout, which renames every data file. Compact lines
+ * can't be converted back since they don't have the whole digest. The cache stays usable if the
+ * conversion is interrupted, it just isn't converted (and data files may be left behind).
+ * Arguments:
+ * -cache: A DCCache instance
+ * -line_format: The DCLineFormat_t to convert to
+ * Returns: true if the lines have the requested format afterwards
+ */
+bool DCConvertLineFormat(DCCache cache, DCLineFormat_t line_format);
+
+/* Fill in the default evictor options: evict from 90% of max_bytes down to 75%, without a limit on
+ * the rate.
+ * Arguments:
+ * -options: The options to initialize
+ */
+void DCEvictorOptionsInit(DCEvictorOptions_t *options);
+
+/* Start a background thread that evicts whenever the cache goes over the high watermark, until it
+ * is down to the low watermark. DCAdd then only evicts itself if the cache reaches max_bytes
+ * regardless, which is a hard cap. Calling it again while the evictor runs changes its options.
+ * While an evictor runs, every function that reads or changes the cache takes a lock, so the
+ * evictor only evicts in between them; the cache itself still must only be used by one thread.
+ * Arguments:
+ * -cache: A DCCache instance
+ * -options: Options initialized with DCEvictorOptionsInit
+ * Returns: true if the evictor runs with the options
+ */
+bool DCStartEvictor(DCCache cache, DCEvictorOptions_t *options);
+
+/* Stop the background evictor, if one runs. Waits for a batch of evictions in progress to finish.
+ * DCCloseAndFree does this itself.
+ * Arguments:
+ * -cache: A DCCache instance
+ */
+void DCStopEvictor(DCCache cache);
+
+/* Unlink the data files of evicted, removed and replaced keys on background threads. Their lines are
+ * still cleared right away, but the files are queued and num_threads threads unlink them in batches,
+ * so eviction doesn't wait for the file system. The queue is kept in a file next to the table: if the
+ * process dies with files still queued, the next DCLoad unlinks them. Adding a key whose previous
+ * file is queued cancels or waits for that unlink.
+ * Arguments:
+ * -cache: A DCCache instance
+ * -num_threads: How many threads unlink files, 1 to 16
+ * Returns: true if deferred unlinking runs
+ */
+bool DCStartDeferredUnlink(DCCache cache, uint32_t num_threads);
+
+/* Wait until every queued data file was unlinked. Does nothing without deferred unlinking.
+ * Arguments:
+ * -cache: A DCCache instance
+ */
+void DCDrainUnlinks(DCCache cache);
+
+/* Unlink the queued data files and stop the unlink threads. Later removals unlink their files
+ * directly again. DCCloseAndFree does this itself.
+ * Arguments:
+ * -cache: A DCCache instance
+ */
+void DCStopDeferredUnlink(DCCache cache);
+
+/* Trade access time precision for fewer writes to the table. By default every DCLookup hit writes
+ * the current time into the key's line, which dirties its page, so even a read only workload has
+ * the OS constantly writing the table back to disk. With a granularity, a hit only writes the time
+ * if the stored one is at least granularity_in_ms old, and the time comes from a cheaper, coarse
+ * clock. Eviction then can't tell apart keys last used within granularity_in_ms of each other.
+ * The setting isn't stored in the cache file.
+ * Arguments:
+ * -cache: A DCCache instance
+ * -granularity_in_ms: How stale an access time may get, 0 to record every access exactly
+ */
+void DCSetAccessTimeGranularity(DCCache cache, uint32_t granularity_in_ms);
+
+/* Only add keys that are likely to be used again (TinyLFU). The filter counts how often keys were
+ * recently looked up or added, in a small in-memory sketch sized from the number of lines. A DCAdd
+ * of a key that isn't in the cache and would evict another key is turned away, without writing
+ * anything, unless the new key was used more often than the one it would evict. A key that gets a
+ * free line, if need be by moving others (cuckoo_max_kicks), doesn't evict anything. So a key
+ * is typically only added on its second try, and keys that are used once don't churn the disk.
+ * The setting isn't stored in the cache file and the counts start over with every load.
+ * Arguments:
+ * -cache: A DCCache instance
+ * -enabled: Whether DCAdd should be filtered
+ * Returns: false if the filter couldn't be allocated
+ */
+bool DCSetAdmissionFilter(DCCache cache, bool enabled);
+
+/* Give the cache a pool of num_buffers DCData with buffers of buffer_size bytes, which DCLookup and
+ * DCLookupStale return values of at most buffer_size bytes in, and DCDataFree puts back instead of
+ * freeing. Once the buffers are allocated, a hit then neither allocates nor frees. Values that are
+ * larger, or looked up while all the buffers are out, are allocated as without a pool. A DCData
+ * from the pool may be freed from any thread, also after the cache was closed.
+ * Arguments:
+ * -cache: A DCCache instance
+ * -num_buffers: The most DCData the pool holds, 0 to remove the pool
+ * -buffer_size: The size of their buffers, in bytes
+ * Returns: false if the pool couldn't be allocated
+ */
+bool DCSetDataPool(DCCache cache, uint32_t num_buffers, uint64_t buffer_size);
+
 /* Free all memory associated with a DCData abstract type
  * Arguments
  * -data: A DCData abstract type
@@ -147,7 +714,6 @@ void DCDataFree(DCData data);
 void DCPrint(DCCache cache);
 
 /* How many items are currently stored in the cache.
- * NOTE: This is a slow operation and should not be called in production
  */
 int DCNumItems(DCCache cache);
 
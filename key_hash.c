@@ -0,0 +1,536 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define KH_X86 1
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define KH_NEON 1
+#endif
+
+#include "key_hash.h"
+
+/***CONSTANTS***/
+#define SHA1_BLOCK_LEN 64
+#define KH_STRIPE_LEN 32 // Fast128 consumes its input 32 bytes (4 64 bit lanes) at a time
+#define KH_PRIME_1 0x9E3779B185EBCA87ULL
+#define KH_PRIME_2 0xC2B2AE3D27D4EB4FULL
+#define KH_PRIME_3 0x165667B19E3779F9ULL
+#define KH_PRIME_4 0x85EBCA77C2B2AE63ULL
+#define KH_PRIME_5 0x27D4EB2F165667C5ULL
+
+/***INTERNAL STRUCTS***/
+typedef void (*SHA1CompressFunc)(uint32_t state[5], const uint8_t *blocks, size_t num_blocks);
+typedef void (*AccumulateFunc)(uint64_t acc[4], const uint8_t *stripes, size_t num_stripes,
+                               const uint64_t secret[4]);
+
+typedef struct {
+  uint32_t state[5];
+  uint8_t buf[SHA1_BLOCK_LEN];
+  size_t buf_len;
+  uint64_t total_len;
+  SHA1CompressFunc compress;
+} SHA1State_t;
+
+/***PREPROCESSOR FUNCTION DECLARATIONS***/
+static SHA1CompressFunc selectSHA1Compress();
+static void sha1CompressPortable(uint32_t state[5], const uint8_t *blocks, size_t num_blocks);
+static void sha1Update(SHA1State_t *s, const uint8_t *data, size_t len);
+static void sha1Final(SHA1State_t *s);
+static AccumulateFunc selectAccumulate();
+static void accumulateScalar(uint64_t acc[4], const uint8_t *stripes, size_t num_stripes,
+                             const uint64_t secret[4]);
+static inline uint64_t readLE64(const uint8_t *p);
+static inline void writeLE64(uint8_t *p, uint64_t v);
+static inline uint64_t avalanche64(uint64_t h);
+static inline uint64_t fold64(uint64_t a, uint64_t b);
+
+#ifdef KH_X86
+static bool cpuHasSHANI();
+static void sha1CompressSHANI(uint32_t state[5], const uint8_t *blocks, size_t num_blocks);
+static void accumulateSSE2(uint64_t acc[4], const uint8_t *stripes, size_t num_stripes,
+                           const uint64_t secret[4]);
+static void accumulateAVX2(uint64_t acc[4], const uint8_t *stripes, size_t num_stripes,
+                           const uint64_t secret[4]);
+#endif
+
+#if defined(KH_NEON) && defined(__ARM_FEATURE_CRYPTO)
+static void sha1CompressARMv8(uint32_t state[5], const uint8_t *blocks, size_t num_blocks);
+#endif
+
+#ifdef KH_NEON
+static void accumulateNEON(uint64_t acc[4], const uint8_t *stripes, size_t num_stripes,
+                           const uint64_t secret[4]);
+#endif
+
+// Picked on first use, every candidate produces identical output so a racing first use is harmless
+static SHA1CompressFunc sha1Compress = NULL;
+static AccumulateFunc accumulate = NULL;
+
+
+/***IMPLEMENTATION OF PUBLIC FUNCTIONS***/
+
+
+void KHSHA1(const uint64_t seed[2], const void *key, size_t key_len, uint64_t digest[2]) {
+  SHA1State_t s = {
+    .state = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0},
+    .buf_len = 0,
+    .total_len = 0
+  };
+
+  if (!sha1Compress) {
+    sha1Compress = selectSHA1Compress();
+  }
+  s.compress = sha1Compress;
+
+  if (seed[0] || seed[1]) {
+    uint8_t seed_bytes[16];
+    writeLE64(seed_bytes, seed[0]);
+    writeLE64(seed_bytes + 8, seed[1]);
+    sha1Update(&s, seed_bytes, sizeof(seed_bytes));
+  }
+  sha1Update(&s, key, key_len);
+  sha1Final(&s);
+
+  // Matches the legacy digest: the first four 32 bit words of the SHA-1 state in host order
+  memcpy(digest, s.state, sizeof(uint64_t) * 2);
+}
+
+void KHFast128(const uint64_t seed[2], const void *key, size_t key_len, uint64_t digest[2]) {
+  const uint8_t *bytes = key;
+  size_t num_full_stripes = key_len / KH_STRIPE_LEN;
+  size_t tail_len = key_len % KH_STRIPE_LEN;
+  uint8_t tail[KH_STRIPE_LEN];
+  uint64_t secret[4], acc[4], a, b;
+
+  if (!accumulate) {
+    accumulate = selectAccumulate();
+  }
+
+  // The secret is what makes the multiplies below unpredictable to someone who doesn't know the seed
+  secret[0] = avalanche64(seed[0] ^ KH_PRIME_1);
+  secret[1] = avalanche64(seed[1] ^ KH_PRIME_2);
+  secret[2] = avalanche64(seed[0] + KH_PRIME_3);
+  secret[3] = avalanche64(seed[1] + KH_PRIME_4);
+
+  acc[0] = seed[0] ^ KH_PRIME_3;
+  acc[1] = seed[1] ^ KH_PRIME_4;
+  acc[2] = seed[0] + KH_PRIME_5;
+  acc[3] = seed[1] + KH_PRIME_1;
+
+  accumulate(acc, bytes, num_full_stripes, secret);
+
+  // The tail (possibly empty) is zero padded into one last stripe, the length is mixed in below so
+  // padding can't make two keys collide
+  memset(tail, 0, sizeof(tail));
+  memcpy(tail, bytes + num_full_stripes * KH_STRIPE_LEN, tail_len);
+  accumulate(acc, tail, 1, secret);
+
+  a = fold64(acc[0] ^ secret[2], acc[1] ^ secret[3]);
+  b = fold64(acc[2] ^ secret[0], acc[3] ^ secret[1]);
+  digest[0] = avalanche64(a + b + ((uint64_t) key_len) * KH_PRIME_1);
+  digest[1] = avalanche64(fold64(a ^ KH_PRIME_4, b ^ KH_PRIME_5 ^ key_len) + digest[0]);
+}
+
+
+/***STATIC HELPERS***/
+
+
+static inline uint64_t readLE64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  v = __builtin_bswap64(v);
+#endif
+  return v;
+}
+
+static inline void writeLE64(uint8_t *p, uint64_t v) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  v = __builtin_bswap64(v);
+#endif
+  memcpy(p, &v, sizeof(v));
+}
+
+static inline uint64_t avalanche64(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/* Multiply a and b into 128 bits and xor the halves together
+ */
+static inline uint64_t fold64(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+  __extension__ unsigned __int128 product = (unsigned __int128) a * b;
+  return ((uint64_t) product) ^ ((uint64_t) (product >> 64));
+#else
+  uint64_t lo_lo = (a & 0xffffffff) * (b & 0xffffffff);
+  uint64_t hi_lo = (a >> 32) * (b & 0xffffffff);
+  uint64_t lo_hi = (a & 0xffffffff) * (b >> 32);
+  uint64_t hi_hi = (a >> 32) * (b >> 32);
+  uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xffffffff) + lo_hi;
+  uint64_t upper = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+  uint64_t lower = (cross << 32) | (lo_lo & 0xffffffff);
+  return lower ^ upper;
+#endif
+}
+
+
+/***SHA-1 Helpers***/
+
+
+static SHA1CompressFunc selectSHA1Compress() {
+#ifdef KH_X86
+  if (cpuHasSHANI()) {
+    return sha1CompressSHANI;
+  }
+#endif
+#if defined(KH_NEON) && defined(__ARM_FEATURE_CRYPTO)
+  return sha1CompressARMv8;
+#endif
+  return sha1CompressPortable;
+}
+
+static void sha1Update(SHA1State_t *s, const uint8_t *data, size_t len) {
+  s->total_len += len;
+
+  // Top off a partially filled block first
+  if (s->buf_len) {
+    size_t to_copy = SHA1_BLOCK_LEN - s->buf_len;
+    to_copy = to_copy < len ? to_copy : len;
+    memcpy(s->buf + s->buf_len, data, to_copy);
+    s->buf_len += to_copy;
+    data += to_copy;
+    len -= to_copy;
+    if (s->buf_len < SHA1_BLOCK_LEN) {
+      return;
+    }
+    s->compress(s->state, s->buf, 1);
+    s->buf_len = 0;
+  }
+
+  // Whole blocks are compressed straight out of the caller's memory
+  if (len >= SHA1_BLOCK_LEN) {
+    s->compress(s->state, data, len / SHA1_BLOCK_LEN);
+    data += len - len % SHA1_BLOCK_LEN;
+    len %= SHA1_BLOCK_LEN;
+  }
+
+  memcpy(s->buf, data, len);
+  s->buf_len = len;
+}
+
+static void sha1Final(SHA1State_t *s) {
+  uint64_t bit_len = s->total_len * 8;
+
+  s->buf[s->buf_len++] = 0x80;
+  if (s->buf_len > SHA1_BLOCK_LEN - 8) {
+    memset(s->buf + s->buf_len, 0, SHA1_BLOCK_LEN - s->buf_len);
+    s->compress(s->state, s->buf, 1);
+    s->buf_len = 0;
+  }
+  memset(s->buf + s->buf_len, 0, SHA1_BLOCK_LEN - 8 - s->buf_len);
+  for (int i=0; i < 8; i++) {
+    s->buf[SHA1_BLOCK_LEN - 1 - i] = (uint8_t) (bit_len >> (8 * i));
+  }
+  s->compress(s->state, s->buf, 1);
+}
+
+#define ROL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha1CompressPortable(uint32_t state[5], const uint8_t *blocks, size_t num_blocks) {
+  for (size_t blk=0; blk < num_blocks; blk++) {
+    const uint8_t *p = blocks + blk * SHA1_BLOCK_LEN;
+    uint32_t w[16];
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+
+    for (int t=0; t < 16; t++) {
+      w[t] = ((uint32_t) p[4*t] << 24) | ((uint32_t) p[4*t + 1] << 16) |
+             ((uint32_t) p[4*t + 2] << 8) | ((uint32_t) p[4*t + 3]);
+    }
+
+    for (int t=0; t < 80; t++) {
+      uint32_t f, k, temp;
+      if (t >= 16) {
+        // The message schedule only ever needs the last 16 words, so keep it in a ring
+        uint32_t x = w[(t - 3) & 15] ^ w[(t - 8) & 15] ^ w[(t - 14) & 15] ^ w[t & 15];
+        w[t & 15] = ROL32(x, 1);
+      }
+      if (t < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5A827999;
+      } else if (t < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ED9EBA1;
+      } else if (t < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8F1BBCDC;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xCA62C1D6;
+      }
+      temp = ROL32(a, 5) + f + e + k + w[t & 15];
+      e = d;
+      d = c;
+      c = ROL32(b, 30);
+      b = a;
+      a = temp;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+  }
+}
+
+#ifdef KH_X86
+
+static bool cpuHasSHANI() {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+    return false;
+  }
+  // SSSE3 (bit 9) and SSE4.1 (bit 19) are needed alongside the SHA extensions
+  if (!(ecx & (1 << 9)) || !(ecx & (1 << 19))) {
+    return false;
+  }
+  if (__get_cpuid_max(0, NULL) < 7) {
+    return false;
+  }
+  __cpuid_count(7, 0, eax, ebx, ecx, edx);
+  return (ebx & (1 << 29)) != 0;
+}
+
+/* Four SHA-1 rounds on the SHA-NI unit. Message registers are passed in rotation: m0 holds the
+ * words for these rounds and m1..m3 are advanced towards the words needed 4, 8 and 12 rounds later.
+ */
+#define SHA_NI_ROUNDS(e_in, e_out, m0, m1, m2, m3, func) \
+  e_in = _mm_sha1nexte_epu32(e_in, m0); \
+  e_out = abcd; \
+  m1 = _mm_sha1msg2_epu32(m1, m0); \
+  abcd = _mm_sha1rnds4_epu32(abcd, e_in, func); \
+  m3 = _mm_sha1msg1_epu32(m3, m0); \
+  m2 = _mm_xor_si128(m2, m0);
+
+__attribute__((target("sha,ssse3,sse4.1")))
+static void sha1CompressSHANI(uint32_t state[5], const uint8_t *blocks, size_t num_blocks) {
+  const __m128i byte_swap = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+  __m128i abcd, abcd_save, e0, e0_save, e1;
+  __m128i m0 = _mm_setzero_si128(), m1 = m0, m2 = m0, m3 = m0;
+
+  abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) state), 0x1B);
+  e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+  for (size_t blk=0; blk < num_blocks; blk++) {
+    const uint8_t *p = blocks + blk * SHA1_BLOCK_LEN;
+    abcd_save = abcd;
+    e0_save = e0;
+
+    // Rounds 0-15 load the message as they go
+    m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) p), byte_swap);
+    e0 = _mm_add_epi32(e0, m0);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+    m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (p + 16)), byte_swap);
+    SHA_NI_ROUNDS(e1, e0, m1, m2, m3, m0, 0);
+    m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (p + 32)), byte_swap);
+    SHA_NI_ROUNDS(e0, e1, m2, m3, m0, m1, 0);
+    m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (p + 48)), byte_swap);
+    SHA_NI_ROUNDS(e1, e0, m3, m0, m1, m2, 0);
+
+    // Rounds 16-79
+    SHA_NI_ROUNDS(e0, e1, m0, m1, m2, m3, 0);
+    SHA_NI_ROUNDS(e1, e0, m1, m2, m3, m0, 1);
+    SHA_NI_ROUNDS(e0, e1, m2, m3, m0, m1, 1);
+    SHA_NI_ROUNDS(e1, e0, m3, m0, m1, m2, 1);
+    SHA_NI_ROUNDS(e0, e1, m0, m1, m2, m3, 1);
+    SHA_NI_ROUNDS(e1, e0, m1, m2, m3, m0, 1);
+    SHA_NI_ROUNDS(e0, e1, m2, m3, m0, m1, 2);
+    SHA_NI_ROUNDS(e1, e0, m3, m0, m1, m2, 2);
+    SHA_NI_ROUNDS(e0, e1, m0, m1, m2, m3, 2);
+    SHA_NI_ROUNDS(e1, e0, m1, m2, m3, m0, 2);
+    SHA_NI_ROUNDS(e0, e1, m2, m3, m0, m1, 2);
+    SHA_NI_ROUNDS(e1, e0, m3, m0, m1, m2, 3);
+    SHA_NI_ROUNDS(e0, e1, m0, m1, m2, m3, 3);
+    SHA_NI_ROUNDS(e1, e0, m1, m2, m3, m0, 3);
+    SHA_NI_ROUNDS(e0, e1, m2, m3, m0, m1, 3);
+    SHA_NI_ROUNDS(e1, e0, m3, m0, m1, m2, 3);
+
+    e0 = _mm_sha1nexte_epu32(e0, e0_save);
+    abcd = _mm_add_epi32(abcd, abcd_save);
+  }
+
+  _mm_storeu_si128((__m128i *) state, _mm_shuffle_epi32(abcd, 0x1B));
+  state[4] = _mm_extract_epi32(e0, 3);
+}
+
+#endif
+
+#if defined(KH_NEON) && defined(__ARM_FEATURE_CRYPTO)
+
+static void sha1CompressARMv8(uint32_t state[5], const uint8_t *blocks, size_t num_blocks) {
+  uint32x4_t abcd = vld1q_u32(state);
+  uint32_t e = state[4];
+
+  for (size_t blk=0; blk < num_blocks; blk++) {
+    const uint8_t *p = blocks + blk * SHA1_BLOCK_LEN;
+    uint32x4_t msg[20];
+    uint32x4_t abcd_save = abcd;
+    uint32_t e_save = e;
+
+    for (int g=0; g < 4; g++) {
+      msg[g] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(p + 16 * g)));
+    }
+    for (int g=4; g < 20; g++) {
+      msg[g] = vsha1su1q_u32(vsha1su0q_u32(msg[g - 4], msg[g - 3], msg[g - 2]), msg[g - 1]);
+    }
+
+    // Each group of 4 rounds needs e, which is a rotated copy of a from 4 rounds back
+    for (int g=0; g < 20; g++) {
+      uint32_t next_e = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+      if (g < 5) {
+        abcd = vsha1cq_u32(abcd, e, vaddq_u32(msg[g], vdupq_n_u32(0x5A827999)));
+      } else if (g < 10) {
+        abcd = vsha1pq_u32(abcd, e, vaddq_u32(msg[g], vdupq_n_u32(0x6ED9EBA1)));
+      } else if (g < 15) {
+        abcd = vsha1mq_u32(abcd, e, vaddq_u32(msg[g], vdupq_n_u32(0x8F1BBCDC)));
+      } else {
+        abcd = vsha1pq_u32(abcd, e, vaddq_u32(msg[g], vdupq_n_u32(0xCA62C1D6)));
+      }
+      e = next_e;
+    }
+
+    abcd = vaddq_u32(abcd, abcd_save);
+    e += e_save;
+  }
+
+  vst1q_u32(state, abcd);
+  state[4] = e;
+}
+
+#endif
+
+
+/***Fast128 Helpers***/
+
+
+static AccumulateFunc selectAccumulate() {
+#ifdef KH_X86
+  if (__builtin_cpu_supports("avx2")) {
+    return accumulateAVX2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return accumulateSSE2;
+  }
+#endif
+#ifdef KH_NEON
+  return accumulateNEON;
+#endif
+  return accumulateScalar;
+}
+
+/* The reference accumulator every SIMD variant has to match: for each 64 bit lane i the data is
+ * added to the neighbouring lane and the product of the keyed lane's two 32 bit halves to lane i.
+ */
+static void accumulateScalar(uint64_t acc[4], const uint8_t *stripes, size_t num_stripes,
+                             const uint64_t secret[4]) {
+  for (size_t s=0; s < num_stripes; s++) {
+    const uint8_t *p = stripes + s * KH_STRIPE_LEN;
+    for (int i=0; i < 4; i++) {
+      uint64_t d = readLE64(p + 8 * i);
+      uint64_t dk = d ^ secret[i];
+      acc[i ^ 1] += d;
+      acc[i] += (dk & 0xffffffff) * (dk >> 32);
+    }
+  }
+}
+
+#ifdef KH_X86
+
+__attribute__((target("sse2")))
+static void accumulateSSE2(uint64_t acc[4], const uint8_t *stripes, size_t num_stripes,
+                           const uint64_t secret[4]) {
+  __m128i acc_lo = _mm_loadu_si128((const __m128i *) acc);
+  __m128i acc_hi = _mm_loadu_si128((const __m128i *) (acc + 2));
+  const __m128i secret_lo = _mm_loadu_si128((const __m128i *) secret);
+  const __m128i secret_hi = _mm_loadu_si128((const __m128i *) (secret + 2));
+
+  for (size_t s=0; s < num_stripes; s++) {
+    const uint8_t *p = stripes + s * KH_STRIPE_LEN;
+    __m128i d_lo = _mm_loadu_si128((const __m128i *) p);
+    __m128i d_hi = _mm_loadu_si128((const __m128i *) (p + 16));
+    __m128i dk_lo = _mm_xor_si128(d_lo, secret_lo);
+    __m128i dk_hi = _mm_xor_si128(d_hi, secret_hi);
+
+    // _mm_mul_epu32 multiplies the low halves of each lane; the shuffle brings the high halves down
+    __m128i prod_lo = _mm_mul_epu32(dk_lo, _mm_shuffle_epi32(dk_lo, _MM_SHUFFLE(0, 3, 0, 1)));
+    __m128i prod_hi = _mm_mul_epu32(dk_hi, _mm_shuffle_epi32(dk_hi, _MM_SHUFFLE(0, 3, 0, 1)));
+
+    acc_lo = _mm_add_epi64(acc_lo, _mm_shuffle_epi32(d_lo, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc_hi = _mm_add_epi64(acc_hi, _mm_shuffle_epi32(d_hi, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc_lo = _mm_add_epi64(acc_lo, prod_lo);
+    acc_hi = _mm_add_epi64(acc_hi, prod_hi);
+  }
+
+  _mm_storeu_si128((__m128i *) acc, acc_lo);
+  _mm_storeu_si128((__m128i *) (acc + 2), acc_hi);
+}
+
+__attribute__((target("avx2")))
+static void accumulateAVX2(uint64_t acc[4], const uint8_t *stripes, size_t num_stripes,
+                           const uint64_t secret[4]) {
+  __m256i acc_v = _mm256_loadu_si256((const __m256i *) acc);
+  const __m256i secret_v = _mm256_loadu_si256((const __m256i *) secret);
+
+  for (size_t s=0; s < num_stripes; s++) {
+    __m256i d = _mm256_loadu_si256((const __m256i *) (stripes + s * KH_STRIPE_LEN));
+    __m256i dk = _mm256_xor_si256(d, secret_v);
+    __m256i prod = _mm256_mul_epu32(dk, _mm256_shuffle_epi32(dk, _MM_SHUFFLE(0, 3, 0, 1)));
+    acc_v = _mm256_add_epi64(acc_v, _mm256_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc_v = _mm256_add_epi64(acc_v, prod);
+  }
+
+  _mm256_storeu_si256((__m256i *) acc, acc_v);
+}
+
+#endif
+
+#ifdef KH_NEON
+
+static void accumulateNEON(uint64_t acc[4], const uint8_t *stripes, size_t num_stripes,
+                           const uint64_t secret[4]) {
+  uint64x2_t acc_lo = vld1q_u64(acc);
+  uint64x2_t acc_hi = vld1q_u64(acc + 2);
+  const uint64x2_t secret_lo = vld1q_u64(secret);
+  const uint64x2_t secret_hi = vld1q_u64(secret + 2);
+
+  for (size_t s=0; s < num_stripes; s++) {
+    const uint8_t *p = stripes + s * KH_STRIPE_LEN;
+    uint64x2_t d_lo = vreinterpretq_u64_u8(vld1q_u8(p));
+    uint64x2_t d_hi = vreinterpretq_u64_u8(vld1q_u8(p + 16));
+    uint64x2_t dk_lo = veorq_u64(d_lo, secret_lo);
+    uint64x2_t dk_hi = veorq_u64(d_hi, secret_hi);
+    uint64x2_t prod_lo = vmull_u32(vmovn_u64(dk_lo), vshrn_n_u64(dk_lo, 32));
+    uint64x2_t prod_hi = vmull_u32(vmovn_u64(dk_hi), vshrn_n_u64(dk_hi, 32));
+
+    acc_lo = vaddq_u64(acc_lo, vaddq_u64(vextq_u64(d_lo, d_lo, 1), prod_lo));
+    acc_hi = vaddq_u64(acc_hi, vaddq_u64(vextq_u64(d_hi, d_hi, 1), prod_hi));
+  }
+
+  vst1q_u64(acc, acc_lo);
+  vst1q_u64(acc + 2, acc_hi);
+}
+
+#endif
@@ -0,0 +1,35 @@
+/* key_hash.h
+ * Key hashing engines used by disk_cache to reduce a key to a 128 bit digest
+ */
+
+
+#ifndef KEYHASH_H_
+#define KEYHASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* Compute the first 128 bits of SHA-1(seed || key). If the seed is all zeros it is not prepended,
+ * which makes the result identical to the first 128 bits of SHA-1(key) (the legacy disk_cache key
+ * digest). Uses the SHA-NI or ARMv8 crypto extensions when the CPU has them.
+ * Arguments:
+ * -seed: A 128 bit seed, {0, 0} for none
+ * -key: The key bytes
+ * -key_len: The length of key in bytes
+ * -digest: Where the 128 bit digest is written
+ */
+void KHSHA1(const uint64_t seed[2], const void *key, size_t key_len, uint64_t digest[2]);
+
+/* Compute a seeded, non-cryptographic 128 bit hash of key. The result only depends on the seed and
+ * the key bytes; the SSE2/AVX2/NEON code paths produce exactly the same digest as the scalar one so
+ * a cache can move between machines.
+ * Arguments:
+ * -seed: A 128 bit seed
+ * -key: The key bytes
+ * -key_len: The length of key in bytes
+ * -digest: Where the 128 bit digest is written
+ */
+void KHFast128(const uint64_t seed[2], const void *key, size_t key_len, uint64_t digest[2]);
+
+#endif
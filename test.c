@@ -2,6 +2,7 @@
 #include <string.h>
 
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include "test_helpers.h"
@@ -212,6 +213,52 @@ int testLookupSetsAccessTimeAndReplacesEarliestAccessed() {
   return 0;
 }
 
+int accessTimeGranularityTest() {
+  DCCacheLine_t *line = NULL;
+  DCCache cache = DCMake(WORKING_PATH, 16, 0);
+  DCAdd(cache, "key1", (uint8_t *)"val1", 5);
+  for (int i=0; i < 16; i++) {
+    if (cache->lines[i].last_access_time_in_ms_from_epoch) {
+      line = cache->lines + i;
+    }
+  }
+  uint64_t added_time = line->last_access_time_in_ms_from_epoch;
+
+  // A hit within the granularity leaves the line alone
+  DCSetAccessTimeGranularity(cache, 60000);
+  usleep(2000);
+  DCDataFree(DCLookup(cache, "key1"));
+  uint64_t fresh_hit_time = line->last_access_time_in_ms_from_epoch;
+
+  // One on a line that is older than that updates it
+  line->last_access_time_in_ms_from_epoch = added_time - 120000;
+  DCDataFree(DCLookup(cache, "key1"));
+  uint64_t stale_hit_time = line->last_access_time_in_ms_from_epoch;
+
+  // And without a granularity every hit does
+  DCSetAccessTimeGranularity(cache, 0);
+  usleep(2000);
+  DCDataFree(DCLookup(cache, "key1"));
+  uint64_t exact_hit_time = line->last_access_time_in_ms_from_epoch;
+  DCCloseAndFree(cache);
+
+  if (fresh_hit_time != added_time) {
+    printf("FAILED: accessTimeGranularityTest a recent access time should not be rewritten\n");
+    return 1;
+  }
+  if (stale_hit_time + 60000 < added_time) {
+    printf("FAILED: accessTimeGranularityTest a stale access time should be rewritten\n");
+    return 1;
+  }
+  if (exact_hit_time <= added_time) {
+    printf("FAILED: accessTimeGranularityTest every hit should be recorded by default\n");
+    return 1;
+  }
+
+  printf("PASSED: accessTimeGranularityTest\n");
+  return 0;
+}
+
 int evictionTest() {
   DCCache cache = DCMake(WORKING_PATH, 64, 11);
   DCAdd(cache, "key1", (uint8_t *)"val1", 5);
@@ -285,6 +332,1661 @@ int evictionTest() {
   return 0;
 }
 
+int incrementalEvictionTest() {
+  char key[16];
+  int num_keys = 150;
+  int num_recent_found = 0;
+  DCCache cache = DCMake(WORKING_PATH, 1024, 1000);
+
+  // Once 100 values of 10 bytes don't fit, every add evicts (about) the oldest one, and only it
+  for (int i=0; i < num_keys; i++) {
+    sprintf(key, "key%d", i);
+    DCAdd(cache, key, (uint8_t *) "012345678", 10);
+    usleep(1000);
+  }
+  int num_items = DCNumItems(cache);
+  uint64_t size = cache->current_size_in_bytes;
+  for (int i=num_keys - 20; i < num_keys; i++) {
+    sprintf(key, "key%d", i);
+    DCData result = DCLookup(cache, key);
+    if (result) {
+      num_recent_found ++;
+      DCDataFree(result);
+    }
+  }
+  DCCloseAndFree(cache);
+
+  if (num_items != 99 || size != 990) {
+    printf("FAILED: incrementalEvictionTest an add should only evict what it needs, %d items left\n",
+           num_items);
+    return 1;
+  }
+  if (num_recent_found != 20) {
+    printf("FAILED: incrementalEvictionTest evicted %d of the 20 newest keys\n",
+           20 - num_recent_found);
+    return 1;
+  }
+
+  printf("PASSED: incrementalEvictionTest\n");
+  return 0;
+}
+
+static uint64_t waitForCacheSize(DCCache cache, uint64_t size, double timeout_in_s) {
+  double deadline = fTime() + timeout_in_s;
+  while (cache->current_size_in_bytes > size && fTime() < deadline) {
+    usleep(1000);
+  }
+  DCNumItems(cache); // Takes the lock, so any batch of evictions in progress is done
+  return cache->current_size_in_bytes;
+}
+
+int backgroundEvictionTest() {
+  char key[16];
+  int num_keys = 60;
+  int num_recent_found = 0;
+  DCEvictorOptions_t options;
+  DCCache cache = DCMake(WORKING_PATH, 1024, 1000);
+
+  // 600 bytes is below the hard cap, so the adds themselves don't evict
+  for (int i=0; i < num_keys; i++) {
+    sprintf(key, "key%d", i);
+    DCAdd(cache, key, (uint8_t *) "012345678", 10);
+    usleep(1000);
+  }
+  int num_items_before = DCNumItems(cache);
+
+  DCEvictorOptionsInit(&options);
+  options.high_watermark = 0.5;
+  options.low_watermark = 0.25;
+  bool started = DCStartEvictor(cache, &options);
+  uint64_t size_after_eviction = waitForCacheSize(cache, 250, 5);
+  for (int i=num_keys - 10; i < num_keys; i++) {
+    sprintf(key, "key%d", i);
+    DCData result = DCLookup(cache, key);
+    if (result) {
+      num_recent_found ++;
+      DCDataFree(result);
+    }
+  }
+
+  // Watermarks change at runtime; 50 lines per second takes a while for the 15 lines above 100 bytes
+  options.high_watermark = 0.2;
+  options.low_watermark = 0.1;
+  options.max_evictions_per_second = 50;
+  DCStartEvictor(cache, &options);
+  usleep(50000);
+  DCNumItems(cache);
+  uint64_t size_while_rate_limited = cache->current_size_in_bytes;
+  uint64_t size_after_rate_limited_eviction = waitForCacheSize(cache, 100, 5);
+
+  options.low_watermark = 0.3;
+  bool started_with_bad_watermarks = DCStartEvictor(cache, &options);
+  DCCloseAndFree(cache);
+
+  if (!started || num_items_before != num_keys || size_after_eviction != 250 ||
+      num_recent_found != 10) {
+    printf("FAILED: backgroundEvictionTest should have evicted the oldest keys down to 250 bytes, "
+           "not %llu\n", (unsigned long long) size_after_eviction);
+    return 1;
+  }
+  if (size_while_rate_limited <= 100 || size_after_rate_limited_eviction != 100) {
+    printf("FAILED: backgroundEvictionTest rate limited eviction went from %llu to %llu bytes\n",
+           (unsigned long long) size_while_rate_limited,
+           (unsigned long long) size_after_rate_limited_eviction);
+    return 1;
+  }
+  if (started_with_bad_watermarks) {
+    printf("FAILED: backgroundEvictionTest a low watermark above the high one should be refused\n");
+    return 1;
+  }
+
+  printf("PASSED: backgroundEvictionTest\n");
+  return 0;
+}
+
+int fastHashEngineTest() {
+  DCMakeOptions_t options;
+  DCMakeOptionsInit(&options);
+
+  DCCache cache = DCMakeWithOptions(WORKING_PATH, 16, 0, &options);
+  DCAdd(cache, "key1", (uint8_t *)"val1", 5);
+  uint64_t seed[2] = {cache->header.hash_seed[0], cache->header.hash_seed[1]};
+  DCCloseAndFree(cache);
+
+  DCCache cache2 = DCLoad(WORKING_PATH);
+  DCData r1 = DCLookup(cache2, "key1");
+  bool seed_persisted = cache2->header.hash_engine == DC_HASH_FAST128 &&
+                        cache2->header.hash_seed[0] == seed[0] &&
+                        cache2->header.hash_seed[1] == seed[1];
+  DCCloseAndFree(cache2);
+
+  if (!seed_persisted || (seed[0] == 0 && seed[1] == 0)) {
+    printf("FAILED: fastHashEngineTest hash engine or seed was not persisted\n");
+    return 1;
+  }
+  if (!r1 || strcmp((char *) r1->data, "val1") != 0) {
+    printf("FAILED: fastHashEngineTest should have found 'val1' for 'key1'\n");
+    return 1;
+  }
+  DCDataFree(r1);
+
+  printf("PASSED: fastHashEngineTest\n");
+  return 0;
+}
+
+int loadLegacyHeaderTest() {
+  char path[256];
+  struct stat file_stats;
+  uint8_t empty_line[32] = {0};
+  uint32_t num_lines = 16;
+  uint64_t max_bytes = 0;
+  FILE *outfile;
+
+  // A legacy cache is a 12 byte header followed directly by the lines
+  sprintf(path, "%s/%s", WORKING_PATH, CACHE_FN);
+  outfile = fopen(path, "w");
+  fwrite(&num_lines, sizeof(num_lines), 1, outfile);
+  fwrite(&max_bytes, sizeof(max_bytes), 1, outfile);
+  for (int i=0; i < num_lines; i++) {
+    fwrite(empty_line, sizeof(empty_line), 1, outfile);
+  }
+  fclose(outfile);
+
+  DCCache cache = DCLoad(WORKING_PATH);
+  if (!cache) {
+    printf("FAILED: loadLegacyHeaderTest couldn't load a legacy cache\n");
+    return 1;
+  }
+  DCAdd(cache, "key1", (uint8_t *)"val1", 5);
+  DCCloseAndFree(cache);
+
+  DCCache cache2 = DCLoad(WORKING_PATH);
+  DCData r1 = DCLookup(cache2, "key1");
+  DCCloseAndFree(cache2);
+  stat(path, &file_stats);
+
+  if (!r1 || strcmp((char *) r1->data, "val1") != 0) {
+    printf("FAILED: loadLegacyHeaderTest should have found 'val1' for 'key1'\n");
+    return 1;
+  }
+  DCDataFree(r1);
+  if (file_stats.st_size != 12 + num_lines * sizeof(empty_line)) {
+    printf("FAILED: loadLegacyHeaderTest changed the size of the legacy cache file\n");
+    return 1;
+  }
+
+  printf("PASSED: loadLegacyHeaderTest\n");
+  return 0;
+}
+
+int binaryKeyTest() {
+  uint8_t key_a[] = {0x01, 0x00, 0x02};
+  uint8_t key_b[] = {0x01, 0x00, 0x03}; // Same as key_a up to the '\0'
+
+  DCCache cache = DCMake(WORKING_PATH, 16, 0);
+  DCAddBin(cache, key_a, sizeof(key_a), (uint8_t *)"valA", 5);
+  DCAddBin(cache, key_b, sizeof(key_b), (uint8_t *)"valB", 5);
+  DCAdd(cache, "key1", (uint8_t *)"val1", 5);
+
+  DCData ra = DCLookupBin(cache, key_a, sizeof(key_a));
+  DCData rb = DCLookupBin(cache, key_b, sizeof(key_b));
+  DCData r1 = DCLookupBin(cache, "key1", 4); // A string key is its bytes without the '\0'
+  DCRemoveBin(cache, key_a, sizeof(key_a));
+  DCData ra_removed = DCLookupBin(cache, key_a, sizeof(key_a));
+  DCCloseAndFree(cache);
+
+  if (!ra || !rb || strcmp((char *) ra->data, "valA") != 0 || strcmp((char *) rb->data, "valB") != 0) {
+    printf("FAILED: binaryKeyTest keys differing after a '\\0' should be distinct\n");
+    return 1;
+  }
+  if (!r1 || strcmp((char *) r1->data, "val1") != 0) {
+    printf("FAILED: binaryKeyTest DCLookupBin should find keys added with DCAdd\n");
+    return 1;
+  }
+  if (ra_removed) {
+    printf("FAILED: binaryKeyTest DCRemoveBin should have removed key_a\n");
+    return 1;
+  }
+  DCDataFree(ra);
+  DCDataFree(rb);
+  DCDataFree(r1);
+
+  printf("PASSED: binaryKeyTest\n");
+  return 0;
+}
+
+int keyHandleTest() {
+  DCKey_t key1, key2, digest_key;
+  uint8_t content_digest[16] = {0xde, 0xad, 0xbe, 0xef, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12};
+
+  DCCache cache = DCMake(WORKING_PATH, 16, 0);
+  DCKeyMake(cache, "key1", 4, &key1);
+  DCKeyMake(cache, "key2", 4, &key2);
+  DCKeyFromDigest(cache, content_digest, &digest_key);
+
+  // The typical miss, fetch, add flow with a single hash
+  DCData miss = DCLookupKey(cache, &key1);
+  DCAddKey(cache, &key1, (uint8_t *)"val1", 5);
+  DCAdd(cache, "key2", (uint8_t *)"val2", 5);
+  DCAddKey(cache, &digest_key, (uint8_t *)"valD", 5);
+
+  DCData r1 = DCLookup(cache, "key1");
+  DCData r2 = DCLookupKey(cache, &key2);
+  DCData rd = DCLookupKey(cache, &digest_key);
+  DCRemoveKey(cache, &key1);
+  DCData r1_removed = DCLookup(cache, "key1");
+  DCCloseAndFree(cache);
+
+  if (miss || r1_removed) {
+    printf("FAILED: keyHandleTest found 'key1' when it shouldn't be in the cache\n");
+    return 1;
+  }
+  if (!r1 || !r2 || !rd || strcmp((char *) r1->data, "val1") != 0 ||
+      strcmp((char *) r2->data, "val2") != 0 || strcmp((char *) rd->data, "valD") != 0) {
+    printf("FAILED: keyHandleTest DCKey_t and string keys should find the same entries\n");
+    return 1;
+  }
+  DCDataFree(r1);
+  DCDataFree(r2);
+  DCDataFree(rd);
+
+  printf("PASSED: keyHandleTest\n");
+  return 0;
+}
+
+int bucketedLayoutTest() {
+  DCTableLayout_t layouts[] = {DC_LAYOUT_BUCKETED, DC_LAYOUT_BUCKETED_TWO_CHOICE};
+  uint32_t expected_num_lines[] = {32, 30}; // 29 rounded up to buckets of 4 and 2 lines
+  DCMakeOptions_t options;
+  DCMakeOptionsInit(&options);
+
+  for (int l=0; l < 2; l++) {
+    char key[16], val[16];
+    options.table_layout = layouts[l];
+    DCCache cache = DCMakeWithOptions(WORKING_PATH, 29, 0, &options);
+    uint32_t num_lines = cache->header.num_lines;
+
+    // Every bucket starts on a 64 byte boundary
+    if (num_lines != expected_num_lines[l] || ((uintptr_t) cache->lines) % 64 != 0) {
+      printf("FAILED: bucketedLayoutTest lines should be whole aligned buckets\n");
+      return 1;
+    }
+
+    for (int i=0; i < 8; i++) {
+      sprintf(key, "key%d", i);
+      sprintf(val, "val%d", i);
+      DCAdd(cache, key, (uint8_t *) val, strlen(val) + 1);
+    }
+    DCCloseAndFree(cache);
+
+    DCCache cache2 = DCLoad(WORKING_PATH);
+    int num_found = 0;
+    for (int i=0; i < 8; i++) {
+      sprintf(key, "key%d", i);
+      sprintf(val, "val%d", i);
+      DCData result = DCLookup(cache2, key);
+      if (result && strcmp((char *) result->data, val) == 0) {
+        num_found ++;
+      }
+      if (result) {
+        DCDataFree(result);
+      }
+    }
+    DCCloseAndFree(cache2);
+
+    // With 8 keys in 30 lines a conflict eviction is possible, but it must stay rare
+    if (num_found < 7) {
+      printf("FAILED: bucketedLayoutTest found only %d of 8 keys with layout %d\n", num_found,
+             (int) layouts[l]);
+      return 1;
+    }
+  }
+
+  printf("PASSED: bucketedLayoutTest\n");
+  return 0;
+}
+
+int fingerprintRebuildTest() {
+  DCMakeOptions_t options;
+  DCMakeOptionsInit(&options);
+  options.fingerprint_bits = 16;
+
+  DCCache cache = DCMakeWithOptions(WORKING_PATH, 16, 0, &options);
+  DCAdd(cache, "key1", (uint8_t *)"val1", 5);
+  DCData r1 = DCLookup(cache, "key1");
+
+  // Lose the fingerprints the way a crash between writing a line and its fingerprint could
+  memset(cache->fingerprints, 0, cache->header.num_lines * sizeof(uint16_t));
+  DCData r1_without_fingerprint = DCLookup(cache, "key1");
+  DCCloseAndFree(cache);
+  markNotClosedCleanly(WORKING_PATH "/" CACHE_FN);
+
+  DCCache cache2 = DCLoad(WORKING_PATH);
+  DCData r1_rebuilt = DCLookup(cache2, "key1");
+  DCCloseAndFree(cache2);
+
+  if (!r1 || !r1_rebuilt) {
+    printf("FAILED: fingerprintRebuildTest should have found 'key1'\n");
+    return 1;
+  }
+  if (r1_without_fingerprint) {
+    printf("FAILED: fingerprintRebuildTest lookups should be filtered by the fingerprints\n");
+    return 1;
+  }
+  DCDataFree(r1);
+  DCDataFree(r1_rebuilt);
+
+  printf("PASSED: fingerprintRebuildTest\n");
+  return 0;
+}
+
+int cuckooDisplacementTest() {
+  char key[16], val[16];
+  int num_keys = 58; // ~90% of the table
+  int num_found = 0;
+  DCMakeOptions_t options;
+  DCMakeOptionsInit(&options);
+  options.seed_hash = false; // Keep the placement of the keys the same from run to run
+  options.table_layout = DC_LAYOUT_SCATTERED;
+  options.cuckoo_max_kicks = 64;
+
+  DCCache cache = DCMakeWithOptions(WORKING_PATH, 64, 0, &options);
+  for (int i=0; i < num_keys; i++) {
+    sprintf(key, "key%d", i);
+    sprintf(val, "val%d", i);
+    DCAdd(cache, key, (uint8_t *) val, strlen(val) + 1);
+  }
+  for (int i=0; i < num_keys; i++) {
+    sprintf(key, "key%d", i);
+    sprintf(val, "val%d", i);
+    DCData result = DCLookup(cache, key);
+    if (result && strcmp((char *) result->data, val) == 0) {
+      num_found ++;
+    }
+    if (result) {
+      DCDataFree(result);
+    }
+  }
+  int num_items = DCNumItems(cache);
+  DCCloseAndFree(cache);
+
+  if (num_found != num_keys || num_items != num_keys) {
+    printf("FAILED: cuckooDisplacementTest found %d of %d keys, all should have found room\n",
+           num_found, num_keys);
+    return 1;
+  }
+
+  printf("PASSED: cuckooDisplacementTest\n");
+  return 0;
+}
+
+int numWaysTest() {
+  char key[16], val[16];
+  uint32_t ways[] = {2, 8, 16};
+  DCTableLayout_t layouts[] = {DC_LAYOUT_SCATTERED, DC_LAYOUT_BUCKETED, DC_LAYOUT_BUCKETED_TWO_CHOICE};
+  DCMakeOptions_t options;
+  DCMakeOptionsInit(&options);
+  options.seed_hash = false; // With 2 ways a random seed occasionally puts 3 of the keys in a bucket
+
+  for (int w=0; w < 3; w++) {
+    for (int l=0; l < 3; l++) {
+      int num_found = 0;
+      options.num_ways = ways[w];
+      options.table_layout = layouts[l];
+      DCCache cache = DCMakeWithOptions(WORKING_PATH, 100, 0, &options);
+      for (int i=0; i < 8; i++) {
+        sprintf(key, "key%d", i);
+        sprintf(val, "val%d", i);
+        DCAdd(cache, key, (uint8_t *) val, strlen(val) + 1);
+      }
+      DCCloseAndFree(cache);
+
+      cache = DCLoad(WORKING_PATH);
+      for (int i=0; i < 8; i++) {
+        sprintf(key, "key%d", i);
+        sprintf(val, "val%d", i);
+        DCData result = DCLookup(cache, key);
+        if (result && strcmp((char *) result->data, val) == 0) {
+          num_found ++;
+        }
+        if (result) {
+          DCDataFree(result);
+        }
+      }
+      uint32_t num_ways = cache->header.num_ways;
+      DCCloseAndFree(cache);
+
+      if (num_ways != ways[w] || num_found != 8) {
+        printf("FAILED: numWaysTest found %d of 8 keys with %u ways and layout %d\n", num_found,
+               ways[w], (int) layouts[l]);
+        return 1;
+      }
+    }
+  }
+
+  options.num_ways = 3;
+  if (DCMakeWithOptions(WORKING_PATH, 100, 0, &options)) {
+    printf("FAILED: numWaysTest made a cache with 3 ways\n");
+    return 1;
+  }
+
+  printf("PASSED: numWaysTest\n");
+  return 0;
+}
+
+int compactLinesTest() {
+  char key[16], val[16];
+  int num_found = 0;
+  struct stat stats;
+  DCMakeOptions_t options;
+  DCMakeOptionsInit(&options);
+  options.line_format = DC_LINE_FORMAT_COMPACT;
+
+  DCCache cache = DCMakeWithOptions(WORKING_PATH, 64, 0, &options);
+  for (int i=0; i < 8; i++) {
+    sprintf(key, "key%d", i);
+    sprintf(val, "val%d", i);
+    DCAdd(cache, key, (uint8_t *) val, strlen(val) + 1);
+  }
+  DCRemove(cache, "key0");
+  DCCloseAndFree(cache);
+  stat(WORKING_PATH "/" CACHE_FN, &stats);
+
+  cache = DCLoad(WORKING_PATH);
+  for (int i=0; i < 8; i++) {
+    sprintf(key, "key%d", i);
+    sprintf(val, "val%d", i);
+    DCData result = DCLookup(cache, key);
+    if (result && strcmp((char *) result->data, val) == 0) {
+      num_found ++;
+    }
+    if (result) {
+      DCDataFree(result);
+    }
+  }
+  uint64_t size = cache->current_size_in_bytes;
+  bool resized = DCResize(cache, 128);
+  DCCloseAndFree(cache);
+
+  if (stats.st_size != sizeof(DCCacheHeader_t) + 64 * (sizeof(DCCompactLine_t) + 1)) {
+    printf("FAILED: compactLinesTest the cache file should have 16 byte lines\n");
+    return 1;
+  }
+  if (num_found != 7 || size != 7 * 5) {
+    printf("FAILED: compactLinesTest found %d of 7 keys\n", num_found);
+    return 1;
+  }
+  if (resized) {
+    printf("FAILED: compactLinesTest resized a cache with compact lines\n");
+    return 1;
+  }
+
+  options.table_layout = DC_LAYOUT_SCATTERED;
+  if (DCMakeWithOptions(WORKING_PATH, 64, 0, &options)) {
+    printf("FAILED: compactLinesTest made a scattered cache with compact lines\n");
+    return 1;
+  }
+
+  printf("PASSED: compactLinesTest\n");
+  return 0;
+}
+
+static int countDataFiles() {
+  int num_files = -1;
+  FILE *files = popen("find " WORKING_PATH " -name '*.cache_data' | wc -l", "r");
+  fscanf(files, "%d", &num_files);
+  pclose(files);
+  return num_files;
+}
+
+int convertToCompactLinesTest() {
+  char key[16], val[16];
+  int num_keys = 20;
+  int num_found = 0;
+
+  DCCache cache = DCMake(WORKING_PATH, 256, 0);
+  for (int i=0; i < num_keys; i++) {
+    sprintf(key, "key%d", i);
+    sprintf(val, "val%d", i);
+    DCAdd(cache, key, (uint8_t *) val, strlen(val) + 1);
+  }
+  int num_files_before = countDataFiles();
+  bool converted = DCConvertLineFormat(cache, DC_LINE_FORMAT_COMPACT);
+  DCCloseAndFree(cache);
+
+  cache = DCLoad(WORKING_PATH);
+  for (int i=0; i < num_keys; i++) {
+    sprintf(key, "key%d", i);
+    sprintf(val, "val%d", i);
+    DCData result = DCLookup(cache, key);
+    if (result && strcmp((char *) result->data, val) == 0) {
+      num_found ++;
+    }
+    if (result) {
+      DCDataFree(result);
+    }
+  }
+  bool compact = cache->compact_lines != NULL;
+  int num_items = DCNumItems(cache);
+  DCEvictToSize(cache, 0);
+  DCCloseAndFree(cache);
+
+  // Every data file went with the eviction, so none was left behind under its old name
+  int num_files_left = countDataFiles() - (num_files_before - num_keys);
+
+  if (!converted || !compact) {
+    printf("FAILED: convertToCompactLinesTest the cache should have compact lines\n");
+    return 1;
+  }
+  if (num_found != num_keys || num_items != num_keys || num_files_left != 0) {
+    printf("FAILED: convertToCompactLinesTest found %d of %d keys, %d files left over\n",
+           num_found, num_keys, num_files_left);
+    return 1;
+  }
+
+  printf("PASSED: convertToCompactLinesTest\n");
+  return 0;
+}
+
+int columnarLinesTest() {
+  char key[16], val[16];
+  int num_keys = 20;
+  int num_found = 0;
+  uint64_t expected_size = 0;
+  DCMakeOptions_t options;
+  DCMakeOptionsInit(&options);
+
+  options.seed_hash = false; // With random digests 20 keys in 61 lines occasionally collide
+  // An odd number of lines so that the scans have a tail that doesn't fill a vector
+  DCCache cache = DCMakeWithOptions(WORKING_PATH, 61, 0, &options);
+  for (int i=0; i < num_keys; i++) {
+    sprintf(key, "key%d", i);
+    sprintf(val, "val%d", i);
+    DCAdd(cache, key, (uint8_t *) val, strlen(val) + 1);
+    expected_size += i ? strlen(val) + 1 : 0;
+  }
+  DCRemove(cache, "key0");
+  bool converted = DCConvertLineFormat(cache, DC_LINE_FORMAT_COLUMNAR);
+  DCCloseAndFree(cache);
+
+  cache = DCLoad(WORKING_PATH);
+  for (int i=1; i < num_keys; i++) {
+    sprintf(key, "key%d", i);
+    sprintf(val, "val%d", i);
+    DCData result = DCLookup(cache, key);
+    if (result && strcmp((char *) result->data, val) == 0) {
+      num_found ++;
+    }
+    if (result) {
+      DCDataFree(result);
+    }
+  }
+  bool columnar = cache->columns.last_access_times != NULL;
+  int num_items = DCNumItems(cache);
+  uint64_t size = cache->current_size_in_bytes;
+  DCEvictToSize(cache, 0);
+  int num_items_after_eviction = DCNumItems(cache);
+  DCCloseAndFree(cache);
+
+  if (!converted || !columnar) {
+    printf("FAILED: columnarLinesTest the cache should have columnar lines\n");
+    return 1;
+  }
+  if (num_found != num_keys - 1 || num_items != num_keys - 1 || size != expected_size) {
+    printf("FAILED: columnarLinesTest found %d of %d keys, %d items of %llu bytes\n",
+           num_found, num_keys - 1, num_items, (unsigned long long) size);
+    return 1;
+  }
+  if (num_items_after_eviction != 0) {
+    printf("FAILED: columnarLinesTest %d items were left after evicting everything\n",
+           num_items_after_eviction);
+    return 1;
+  }
+
+  printf("PASSED: columnarLinesTest\n");
+  return 0;
+}
+
+/* Evicting part of an LRU cache takes the oldest keys, in both the row and the columnar format
+ */
+int partialEvictionTest() {
+  char key[16];
+  int num_keys = 30, num_kept = 10;
+  DCLineFormat_t formats[2] = {DC_LINE_FORMAT_FULL, DC_LINE_FORMAT_COLUMNAR};
+  DCMakeOptions_t options;
+  DCMakeOptionsInit(&options);
+  options.seed_hash = false;
+
+  for (int f=0; f < 2; f++) {
+    int num_old_found = 0, num_new_found = 0;
+    options.line_format = formats[f];
+    DCCache cache = DCMakeWithOptions(WORKING_PATH, 128, 0, &options);
+    for (int i=0; i < num_keys; i++) {
+      sprintf(key, "key%02d", i);
+      DCAdd(cache, key, (uint8_t *) "0123456", 8);
+      usleep(1000); // Every key gets an access time of its own
+    }
+    DCEvictToSize(cache, num_kept * 8);
+    for (int i=0; i < num_keys; i++) {
+      sprintf(key, "key%02d", i);
+      DCData result = DCLookup(cache, key);
+      if (result) {
+        num_old_found += i < num_keys - num_kept;
+        num_new_found += i >= num_keys - num_kept;
+        DCDataFree(result);
+      }
+    }
+    DCCloseAndFree(cache);
+
+    if (num_old_found != 0 || num_new_found != num_kept) {
+      printf("FAILED: partialEvictionTest format %d kept %d old and %d of %d new keys\n",
+             formats[f], num_old_found, num_new_found, num_kept);
+      return 1;
+    }
+  }
+
+  printf("PASSED: partialEvictionTest\n");
+  return 0;
+}
+
+int resizeTest() {
+  char key[16], val[16];
+  int num_keys = 40;
+  int num_found_during = 0, num_found_after = 0;
+  struct stat stats;
+  DCMakeOptions_t options;
+  DCMakeOptionsInit(&options);
+
+  DCCache cache = DCMakeWithOptions(WORKING_PATH, 1024, 0, &options);
+  for (int i=0; i < num_keys; i++) {
+    sprintf(key, "key%d", i);
+    sprintf(val, "val%d", i);
+    DCAdd(cache, key, (uint8_t *) val, strlen(val) + 1);
+  }
+  uint64_t size_before = cache->current_size_in_bytes;
+  DCResize(cache, 4096);
+
+  // Half of the keys are looked up while most lines are still in the old table
+  for (int i=0; i < num_keys; i += 2) {
+    sprintf(key, "key%d", i);
+    DCData result = DCLookup(cache, key);
+    num_found_during += result != NULL;
+    if (result) {
+      DCDataFree(result);
+    }
+  }
+  bool resize_in_progress = cache->resize_source != NULL;
+  uint64_t size_during = cache->current_size_in_bytes;
+  DCCloseAndFree(cache);
+
+  // Closing in the middle of the migration must not lose anything
+  DCCache cache2 = DCLoad(WORKING_PATH);
+  DCResizeStep(cache2, UINT32_MAX);
+  for (int i=0; i < num_keys; i++) {
+    sprintf(key, "key%d", i);
+    sprintf(val, "val%d", i);
+    DCData result = DCLookup(cache2, key);
+    if (result && strcmp((char *) result->data, val) == 0) {
+      num_found_after ++;
+    }
+    if (result) {
+      DCDataFree(result);
+    }
+  }
+  uint32_t num_lines = cache2->header.num_lines;
+  int num_items = DCNumItems(cache2);
+  DCCloseAndFree(cache2);
+
+  if (!resize_in_progress || num_found_during != num_keys / 2 || size_during != size_before) {
+    printf("FAILED: resizeTest keys should be found in the old table during the migration\n");
+    return 1;
+  }
+  if (num_lines != 4096 || num_found_after != num_keys || num_items != num_keys) {
+    printf("FAILED: resizeTest found %d of %d keys in %u lines after the resize\n",
+           num_found_after, num_keys, num_lines);
+    return 1;
+  }
+  if (stat(WORKING_PATH "/" CACHE_FN ".migrating", &stats) == 0) {
+    printf("FAILED: resizeTest the old table should have been removed\n");
+    return 1;
+  }
+
+  printf("PASSED: resizeTest\n");
+  return 0;
+}
+
+int loadOptionsTest() {
+  DCLoadOptions_t options;
+  DCCache cache = DCMake(WORKING_PATH, 4096, 0);
+  DCAdd(cache, "key1", (uint8_t *)"val1", 5);
+  DCCloseAndFree(cache);
+
+  DCLoadOptionsInit(&options);
+  options.populate = true;
+  options.huge_pages = true;
+  options.lock = true;
+  cache = DCLoadWithOptions(WORKING_PATH, &options);
+  uint64_t resident_bytes = DCResidentBytes(cache);
+  uint64_t table_bytes = cache->mmap_size;
+  DCData result = DCLookup(cache, "key1");
+  DCCloseAndFree(cache);
+
+  if (resident_bytes != table_bytes) {
+    printf("FAILED: loadOptionsTest only %llu of %llu bytes are resident after populating\n",
+           (unsigned long long) resident_bytes, (unsigned long long) table_bytes);
+    return 1;
+  }
+  if (!result || strcmp((char *) result->data, "val1") != 0) {
+    printf("FAILED: loadOptionsTest should have found 'val1'\n");
+    return 1;
+  }
+  DCDataFree(result);
+
+  printf("PASSED: loadOptionsTest\n");
+  return 0;
+}
+
+int cleanShutdownTest() {
+  DCCacheHeader_t header;
+  struct stat stats;
+  DCMakeOptions_t options;
+  DCMakeOptionsInit(&options);
+
+  DCCache cache = DCMakeWithOptions(WORKING_PATH, 1 << 16, 0, &options);
+  stat(WORKING_PATH "/" CACHE_FN, &stats);
+  DCAdd(cache, "key1", (uint8_t *)"val1", 5);
+  DCAdd(cache, "key2", (uint8_t *)"val22", 6);
+  DCAdd(cache, "key3", (uint8_t *)"val333", 7);
+  DCRemove(cache, "key2");
+  bool open_cache_marked_clean = ((DCCacheHeader_t *) cache->mmap_start)->closed_cleanly;
+  DCCloseAndFree(cache);
+
+  int fd = open(WORKING_PATH "/" CACHE_FN, O_RDONLY);
+  read(fd, &header, sizeof(header));
+  close(fd);
+
+  // Loads after a clean close and after a crash have to agree
+  cache = DCLoad(WORKING_PATH);
+  int num_items_clean = DCNumItems(cache);
+  uint64_t size_clean = cache->current_size_in_bytes;
+  DCAdd(cache, "key4", (uint8_t *)"val4", 5);
+  DCCloseAndFree(cache);
+  markNotClosedCleanly(WORKING_PATH "/" CACHE_FN);
+  cache = DCLoad(WORKING_PATH);
+  int num_items_recovered = DCNumItems(cache);
+  uint64_t size_recovered = cache->current_size_in_bytes;
+  DCCloseAndFree(cache);
+
+  // A DCMake table keeps its fingerprints in the file, so a clean load has nothing to build
+  cache = DCMake(WORKING_PATH, 1 << 16, 0);
+  DCAdd(cache, "key1", (uint8_t *)"val1", 5);
+  DCCloseAndFree(cache);
+  cache = DCLoad(WORKING_PATH);
+  bool default_fingerprints_in_memory = cache->fingerprints_in_memory;
+  DCCloseAndFree(cache);
+
+  // One without them builds them, but trusts the header for the rest
+  options.fingerprint_bits = 0;
+  cache = DCMakeWithOptions(WORKING_PATH, 1 << 16, 0, &options);
+  DCAdd(cache, "key1", (uint8_t *)"val1", 5);
+  DCAdd(cache, "key2", (uint8_t *)"val22", 6);
+  DCCloseAndFree(cache);
+  cache = DCLoad(WORKING_PATH);
+  int num_items_in_memory = DCNumItems(cache);
+  DCData found_in_memory = DCLookup(cache, "key2");
+  if (found_in_memory) {
+    DCDataFree(found_in_memory);
+  }
+  DCCloseAndFree(cache);
+
+  if (stats.st_blocks * 512 >= stats.st_size) {
+    printf("FAILED: cleanShutdownTest the empty table should be a sparse file\n");
+    return 1;
+  }
+  if (open_cache_marked_clean || !header.closed_cleanly || header.num_used_lines != 2 ||
+      header.current_size_in_bytes != 12) {
+    printf("FAILED: cleanShutdownTest the header should have the state of the closed cache\n");
+    return 1;
+  }
+  if (num_items_clean != 2 || size_clean != 12 || num_items_recovered != 3 || size_recovered != 17) {
+    printf("FAILED: cleanShutdownTest loaded %d items of %llu bytes, %d of %llu after a crash\n",
+           num_items_clean, (unsigned long long) size_clean, num_items_recovered,
+           (unsigned long long) size_recovered);
+    return 1;
+  }
+  if (default_fingerprints_in_memory) {
+    printf("FAILED: cleanShutdownTest a DCMake table should keep its fingerprints in the file\n");
+    return 1;
+  }
+  if (num_items_in_memory != 2 || !found_in_memory) {
+    printf("FAILED: cleanShutdownTest a table with fingerprints in memory loaded %d items\n",
+           num_items_in_memory);
+    return 1;
+  }
+
+  printf("PASSED: cleanShutdownTest\n");
+  return 0;
+}
+
+static bool lookupAndFree(DCCache cache, char *key) {
+  DCData result = DCLookup(cache, key);
+  if (result) {
+    DCDataFree(result);
+  }
+  return result != NULL;
+}
+
+/* A scan of one-off keys through a full cache: LRU loses the keys that are used repeatedly, the other
+ * policies keep them
+ */
+static int hotKeysFoundAfterScan(DCReplacementPolicy_t policy) {
+  char key[16];
+  int num_hot_keys = 20;
+  int num_hot_found = 0;
+  DCMakeOptions_t options;
+
+  DCMakeOptionsInit(&options);
+  options.replacement_policy = policy;
+  DCCache cache = DCMakeWithOptions(WORKING_PATH, 1024, 1000, &options);
+  for (int i=0; i < num_hot_keys; i++) {
+    sprintf(key, "hot%d", i);
+    DCAdd(cache, key, (uint8_t *) "012345678", 10);
+  }
+  for (int round=0; round < 3; round++) {
+    for (int i=0; i < num_hot_keys; i++) {
+      sprintf(key, "hot%d", i);
+      lookupAndFree(cache, key);
+    }
+  }
+  usleep(2000);
+
+  // Closing and loading keeps the policy and the state it has in the lines
+  DCCloseAndFree(cache);
+  cache = DCLoad(WORKING_PATH);
+  for (int i=0; i < 300; i++) {
+    sprintf(key, "scan%d", i);
+    DCAdd(cache, key, (uint8_t *) "012345678", 10);
+  }
+  for (int i=0; i < num_hot_keys; i++) {
+    sprintf(key, "hot%d", i);
+    DCData result = DCLookup(cache, key);
+    if (result) {
+      num_hot_found ++;
+      DCDataFree(result);
+    }
+  }
+  DCCloseAndFree(cache);
+  recursiveDeletePath(WORKING_PATH);
+  mkdir(WORKING_PATH, 0777);
+  return num_hot_found;
+}
+
+int replacementPolicyTest() {
+  DCMakeOptions_t options;
+  int lru_found = hotKeysFoundAfterScan(DC_POLICY_LRU);
+  int lfu_found = hotKeysFoundAfterScan(DC_POLICY_LFU);
+  int arc_found = hotKeysFoundAfterScan(DC_POLICY_ARC);
+  int s3fifo_found = hotKeysFoundAfterScan(DC_POLICY_S3FIFO);
+
+  if (lru_found != 0 || lfu_found != 20 || arc_found != 20 || s3fifo_found != 20) {
+    printf("FAILED: replacementPolicyTest hot keys left after a scan: LRU %d, LFU %d, ARC %d, "
+           "S3-FIFO %d of 20\n", lru_found, lfu_found, arc_found, s3fifo_found);
+    return 1;
+  }
+
+  printf("** IGNORE THIS: ");
+  DCMakeOptionsInit(&options);
+  options.table_layout = DC_LAYOUT_BUCKETED;
+  options.line_format = DC_LINE_FORMAT_COMPACT;
+  options.replacement_policy = DC_POLICY_S3FIFO;
+  DCCache cache = DCMakeWithOptions(WORKING_PATH, 1024, 0, &options);
+  if (cache) {
+    printf("FAILED: replacementPolicyTest compact lines have no room for S3-FIFO's state\n");
+    DCCloseAndFree(cache);
+    return 1;
+  }
+
+  printf("PASSED: replacementPolicyTest\n");
+  return 0;
+}
+
+int admissionFilterTest() {
+  char key[16];
+  int num_hot_found = 0, num_one_off_added = 0;
+  DCMakeOptions_t options;
+
+  // A single bucket, so every key would evict one of the 4 others
+  DCMakeOptionsInit(&options);
+  options.table_layout = DC_LAYOUT_BUCKETED;
+  DCCache cache = DCMakeWithOptions(WORKING_PATH, 4, 0, &options);
+  bool enabled = DCSetAdmissionFilter(cache, true);
+  for (int i=0; i < 4; i++) {
+    sprintf(key, "hot%d", i);
+    DCAdd(cache, key, (uint8_t *) "012345678", 10);
+    for (int j=0; j < 3; j++) {
+      lookupAndFree(cache, key);
+    }
+  }
+
+  for (int i=0; i < 20; i++) {
+    sprintf(key, "once%d", i);
+    num_one_off_added += DCAdd(cache, key, (uint8_t *) "012345678", 10);
+  }
+  for (int i=0; i < 4; i++) {
+    sprintf(key, "hot%d", i);
+    DCData result = DCLookup(cache, key);
+    if (result) {
+      num_hot_found ++;
+      DCDataFree(result);
+    }
+  }
+
+  // A key that keeps being asked for gets in
+  for (int i=0; i < 8; i++) {
+    lookupAndFree(cache, "popular");
+  }
+  bool popular_added = DCAdd(cache, "popular", (uint8_t *) "012345678", 10);
+  DCData popular = DCLookup(cache, "popular");
+
+  DCSetAdmissionFilter(cache, false);
+  bool added_without_filter = DCAdd(cache, "once0", (uint8_t *) "012345678", 10);
+  DCCloseAndFree(cache);
+
+  if (!enabled || num_one_off_added != 0 || num_hot_found != 4) {
+    printf("FAILED: admissionFilterTest let %d keys used once in, %d of 4 hot keys are left\n",
+           num_one_off_added, num_hot_found);
+    return 1;
+  }
+  if (!popular_added || !popular || !added_without_filter) {
+    printf("FAILED: admissionFilterTest a frequently used key should have been let in\n");
+    return 1;
+  }
+  DCDataFree(popular);
+
+  printf("PASSED: admissionFilterTest\n");
+  return 0;
+}
+
+int ttlTest() {
+  char key[16];
+  bool is_stale = false, fresh_is_stale = true;
+  int num_live_found = 0;
+  DCCache cache = DCMake(WORKING_PATH, 1024, 100);
+
+  // 5 keys that never expire, then 4 newer ones that do
+  for (int i=0; i < 9; i++) {
+    sprintf(key, "key%d", i);
+    if (i < 5) {
+      DCAdd(cache, key, (uint8_t *) "012345678", 10);
+    } else {
+      DCAddWithTTL(cache, key, (uint8_t *) "012345678", 10, 1);
+    }
+  }
+  bool found_before_expiry = lookupAndFree(cache, "key8");
+  DCData fresh = DCLookupStale(cache, "key0", &fresh_is_stale);
+
+  // The expiry survives a close and load
+  DCCloseAndFree(cache);
+  cache = DCLoad(WORKING_PATH);
+  usleep(1100000);
+  bool found_after_expiry = lookupAndFree(cache, "key8");
+  DCData stale = DCLookupStale(cache, "key8", &is_stale);
+
+  // The expired keys make room for new ones, not the older keys that are still valid
+  DCAdd(cache, "new0", (uint8_t *) "012345678", 10);
+  DCAdd(cache, "new1", (uint8_t *) "012345678", 10);
+  for (int i=0; i < 5; i++) {
+    sprintf(key, "key%d", i);
+    num_live_found += lookupAndFree(cache, key);
+  }
+  DCCloseAndFree(cache);
+
+  if (!found_before_expiry || found_after_expiry) {
+    printf("FAILED: ttlTest a key should be found until it expires and not after\n");
+    return 1;
+  }
+  if (!fresh || fresh_is_stale || !stale || !is_stale ||
+      strcmp((char *) stale->data, "012345678") != 0) {
+    printf("FAILED: ttlTest DCLookupStale should return expired keys marked as stale\n");
+    return 1;
+  }
+  if (num_live_found != 5) {
+    printf("FAILED: ttlTest evicted %d keys that hadn't expired instead of expired ones\n",
+           5 - num_live_found);
+    return 1;
+  }
+  DCDataFree(fresh);
+  DCDataFree(stale);
+
+  printf("PASSED: ttlTest\n");
+  return 0;
+}
+
+/* 10 small keys that are used a few times, then 3 large values that are used once, in a cache
+ * with room for all small keys and 1 large value
+ */
+static int smallKeysFoundAfterLargeAdds(DCReplacementPolicy_t policy) {
+  char key[16];
+  uint8_t small_value[100] = {0}, large_value[1000] = {0};
+  int num_found = 0;
+  DCMakeOptions_t options;
+
+  DCMakeOptionsInit(&options);
+  options.replacement_policy = policy;
+  DCCache cache = DCMakeWithOptions(WORKING_PATH, 1024, 2500, &options);
+  for (int i=0; i < 10; i++) {
+    sprintf(key, "small%d", i);
+    DCAdd(cache, key, small_value, sizeof(small_value));
+    lookupAndFree(cache, key);
+    lookupAndFree(cache, key);
+  }
+  for (int i=0; i < 3; i++) {
+    sprintf(key, "large%d", i);
+    DCAdd(cache, key, large_value, sizeof(large_value));
+  }
+  for (int i=0; i < 10; i++) {
+    sprintf(key, "small%d", i);
+    num_found += lookupAndFree(cache, key);
+  }
+  DCCloseAndFree(cache);
+  recursiveDeletePath(WORKING_PATH);
+  mkdir(WORKING_PATH, 0777);
+  return num_found;
+}
+
+int gdsfTest() {
+  uint8_t value[1000] = {0};
+  DCMakeOptions_t options;
+  DCAddOptions_t add_options;
+  int lru_found = smallKeysFoundAfterLargeAdds(DC_POLICY_LRU);
+  int gdsf_found = smallKeysFoundAfterLargeAdds(DC_POLICY_GDSF);
+
+  if (lru_found == 10 || gdsf_found != 10) {
+    printf("FAILED: gdsfTest small keys left after adding large ones: LRU %d, GDSF %d of 10\n",
+           lru_found, gdsf_found);
+    return 1;
+  }
+
+  // Of two values of the same size, the one that is cheaper to recompute goes first even if newer
+  DCMakeOptionsInit(&options);
+  options.replacement_policy = DC_POLICY_GDSF;
+  DCCache cache = DCMakeWithOptions(WORKING_PATH, 1024, 2500, &options);
+  DCAddOptionsInit(&add_options);
+  add_options.cost = 64;
+  DCAddWithOptions(cache, "costly", value, sizeof(value), &add_options);
+  DCAddWithOptions(cache, "cheap", value, sizeof(value), NULL);
+  DCAdd(cache, "third", value, sizeof(value));
+  bool costly_found = lookupAndFree(cache, "costly");
+  bool cheap_found = lookupAndFree(cache, "cheap");
+  DCCloseAndFree(cache);
+
+  if (!costly_found || cheap_found) {
+    printf("FAILED: gdsfTest the value with the higher cost should have been kept\n");
+    return 1;
+  }
+
+  printf("PASSED: gdsfTest\n");
+  return 0;
+}
+
+int deferredUnlinkTest() {
+  char key[16];
+  int num_found = 0;
+  int files_before = countDataFiles(); // Of earlier tests
+  DCCache cache = DCMake(WORKING_PATH, 1024, 0);
+  bool started = DCStartDeferredUnlink(cache, 2);
+
+  for (int i=0; i < 200; i++) {
+    sprintf(key, "key%d", i);
+    DCAdd(cache, key, (uint8_t *) "012345678", 10);
+  }
+  DCEvictToSize(cache, 0);
+  DCDrainUnlinks(cache);
+  int files_after_eviction = countDataFiles() - files_before;
+
+  // Adding a key right after removing it must not lose the new file to the queued unlink
+  for (int i=0; i < 200; i++) {
+    sprintf(key, "key%d", i);
+    DCAdd(cache, key, (uint8_t *) "012345678", 10);
+    DCRemove(cache, key);
+    DCAdd(cache, key, (uint8_t *) "012345678", 10);
+  }
+  DCDrainUnlinks(cache);
+  for (int i=0; i < 200; i++) {
+    sprintf(key, "key%d", i);
+    num_found += lookupAndFree(cache, key);
+  }
+  DCCloseAndFree(cache);
+
+  // A process that dies with files queued: the next load unlinks them
+  if (fork() == 0) {
+    cache = DCLoad(WORKING_PATH);
+    DCStartDeferredUnlink(cache, 1);
+    DCEvictToSize(cache, 0);
+    _exit(0);
+  }
+  wait(NULL);
+  cache = DCLoad(WORKING_PATH);
+  int items_after_crash = DCNumItems(cache);
+  int files_after_crash = countDataFiles() - files_before;
+  DCCloseAndFree(cache);
+
+  if (!started || files_after_eviction != 0) {
+    printf("FAILED: deferredUnlinkTest %d files were left after evicting everything\n",
+           files_after_eviction);
+    return 1;
+  }
+  if (num_found != 200) {
+    printf("FAILED: deferredUnlinkTest found %d of 200 keys added again after removing them\n",
+           num_found);
+    return 1;
+  }
+  if (items_after_crash != 0 || files_after_crash != 0) {
+    printf("FAILED: deferredUnlinkTest %d items and %d files were left after a crash\n",
+           items_after_crash, files_after_crash);
+    return 1;
+  }
+
+  printf("PASSED: deferredUnlinkTest\n");
+  return 0;
+}
+
+static int countSegmentFiles() {
+  int num_files = -1;
+  FILE *files = popen("find " WORKING_PATH " -name '" CACHE_FN ".segment.*' | wc -l", "r");
+  fscanf(files, "%d", &num_files);
+  pclose(files);
+  return num_files;
+}
+
+// Whether the key's value is value_len bytes of fill
+static bool lookupMatches(DCCache cache, char *key, uint8_t fill, uint64_t value_len) {
+  DCData result = DCLookup(cache, key);
+  bool matches = result && result->data_len == value_len;
+  for (uint64_t i=0; matches && i < value_len; i++) {
+    matches = result->data[i] == fill;
+  }
+  if (result) {
+    DCDataFree(result);
+  }
+  return matches;
+}
+
+static bool lookupMatchesString(DCCache cache, char *key, char *value) {
+  DCData result = DCLookup(cache, key);
+  bool matches = result && result->data_len == strlen(value) + 1 &&
+                 memcmp(result->data, value, result->data_len) == 0;
+  if (result) {
+    DCDataFree(result);
+  }
+  return matches;
+}
+
+int admissionDuringResizeTest() {
+  char key[16], val[16];
+  int num_old_found = 0;
+  DCMakeOptions_t options;
+  DCMakeOptionsInit(&options);
+
+  // A full cache of keys that were used a few times, but for key9, resized from a table so large
+  // that few of its lines are migrated by the lookups below
+  DCCache cache = DCMakeWithOptions(WORKING_PATH, 8192, 55, &options);
+  DCSetAdmissionFilter(cache, true);
+  for (int i=0; i < 10; i++) {
+    sprintf(key, "key%d", i);
+    sprintf(val, "val%d", i);
+    DCAdd(cache, key, (uint8_t *) val, strlen(val) + 1);
+    for (int j=0; i < 9 && j < 3; j++) {
+      lookupAndFree(cache, key);
+    }
+  }
+  DCResize(cache, 16384);
+  for (int i=0; i < 5; i++) {
+    sprintf(key, "key%d", i);
+    lookupAndFree(cache, key);
+  }
+
+  // A key used once is turned away, without touching the keys still in the old table
+  bool cold_added = DCAdd(cache, "cold", (uint8_t *) "cold", 5);
+  for (int i=5; i < 9; i++) {
+    sprintf(key, "key%d", i);
+    sprintf(val, "val%d", i);
+    num_old_found += lookupMatchesString(cache, key, val);
+  }
+  bool resize_in_progress = cache->resize_source != NULL;
+  // A new, larger value of a key still in the old table replaces it like any other key in the
+  // cache, even one the filter would turn away
+  bool replaced = DCAdd(cache, "key9", (uint8_t *) "replaced9", 10);
+  bool replacement_found = lookupMatchesString(cache, "key9", "replaced9");
+  DCCloseAndFree(cache);
+
+  if (!resize_in_progress || cold_added || num_old_found != 4) {
+    printf("FAILED: admissionDuringResizeTest a key used once was let in (%d) or %d of 4 old values "
+           "are left\n", cold_added, num_old_found);
+    return 1;
+  }
+  if (!replaced || !replacement_found) {
+    printf("FAILED: admissionDuringResizeTest a key in the old table was lost when it was added again\n");
+    return 1;
+  }
+
+  printf("PASSED: admissionDuringResizeTest\n");
+  return 0;
+}
+
+/* A key that can get a line by moving others isn't turned away, the filter only guards evictions
+ */
+int admissionWithDisplacementTest() {
+  char key[16], val[16];
+  int num_keys = 58; // ~90% of the table, as in cuckooDisplacementTest
+  int num_added = 0, num_found = 0;
+  DCMakeOptions_t options;
+  DCMakeOptionsInit(&options);
+  options.seed_hash = false;
+  options.table_layout = DC_LAYOUT_SCATTERED;
+  options.cuckoo_max_kicks = 64;
+
+  DCCache cache = DCMakeWithOptions(WORKING_PATH, 64, 0, &options);
+  DCSetAdmissionFilter(cache, true);
+  for (int i=0; i < num_keys; i++) {
+    sprintf(key, "key%d", i);
+    sprintf(val, "val%d", i);
+    num_added += DCAdd(cache, key, (uint8_t *) val, strlen(val) + 1);
+  }
+  for (int i=0; i < num_keys; i++) {
+    sprintf(key, "key%d", i);
+    sprintf(val, "val%d", i);
+    num_found += lookupMatchesString(cache, key, val);
+  }
+  DCCloseAndFree(cache);
+
+  if (num_added != num_keys || num_found != num_keys) {
+    printf("FAILED: admissionWithDisplacementTest added %d and found %d of %d new keys\n",
+           num_added, num_found, num_keys);
+    return 1;
+  }
+
+  printf("PASSED: admissionWithDisplacementTest\n");
+  return 0;
+}
+
+int segmentStorageTest() {
+  char key[16];
+  uint8_t small[1000], large[8000];
+  int num_found = 0, num_found_after_compaction = 0, num_found_after_load = 0;
+  int files_before = countDataFiles();
+  DCMakeOptions_t options;
+  DCMakeOptionsInit(&options);
+  options.storage = DC_STORAGE_SEGMENTS;
+  options.segment_size = 64 * 1024;
+
+  // Values of up to 4 KB go to the segments, so only the large one gets a data file
+  DCCache cache = DCMakeWithOptions(WORKING_PATH, 16384, 0, &options);
+  for (int i=0; i < 400; i++) {
+    sprintf(key, "key%d", i);
+    memset(small, i % 251, sizeof(small));
+    DCAdd(cache, key, small, sizeof(small));
+  }
+  memset(large, 7, sizeof(large));
+  DCAdd(cache, "large", large, sizeof(large));
+  int data_files = countDataFiles() - files_before;
+  int segments_filled = countSegmentFiles();
+
+  // The locations move with the lines of a resize
+  DCResize(cache, 32768);
+  DCResizeStep(cache, UINT32_MAX);
+  for (int i=0; i < 400; i++) {
+    sprintf(key, "key%d", i);
+    num_found += lookupMatches(cache, key, i % 251, sizeof(small));
+  }
+
+  // With nine in ten values removed every segment is mostly empty
+  for (int i=0; i < 400; i++) {
+    sprintf(key, "key%d", i);
+    if (i % 10) {
+      DCRemove(cache, key);
+    }
+  }
+  DCEvictToSize(cache, UINT64_MAX);
+  int segments_compacted = countSegmentFiles();
+  for (int i=0; i < 400; i += 10) {
+    sprintf(key, "key%d", i);
+    num_found_after_compaction += lookupMatches(cache, key, i % 251, sizeof(small));
+  }
+  DCCloseAndFree(cache);
+
+  // Appending after a load must not overwrite the values that are already there
+  cache = DCLoad(WORKING_PATH);
+  for (int i=400; i < 500; i++) {
+    sprintf(key, "key%d", i);
+    memset(small, i % 251, sizeof(small));
+    DCAdd(cache, key, small, sizeof(small));
+  }
+  for (int i=0; i < 500; i++) {
+    sprintf(key, "key%d", i);
+    num_found_after_load += (i < 400 && i % 10) ? 0 : lookupMatches(cache, key, i % 251, sizeof(small));
+  }
+  bool large_found = lookupMatches(cache, "large", 7, sizeof(large));
+  DCEvictToSize(cache, 0);
+  int segments_left = countSegmentFiles();
+  DCCloseAndFree(cache);
+
+  if (data_files != 1 || segments_filled < 7) {
+    printf("FAILED: segmentStorageTest %d data files and %d segments for 400 small values\n",
+           data_files, segments_filled);
+    return 1;
+  }
+  if (num_found != 400 || num_found_after_compaction != 40 || num_found_after_load != 140 ||
+      !large_found) {
+    printf("FAILED: segmentStorageTest found %d of 400 values, %d of 40 after compaction, %d of 140 "
+           "after a load\n", num_found, num_found_after_compaction, num_found_after_load);
+    return 1;
+  }
+  if (segments_compacted > 2 || segments_left > 1) {
+    printf("FAILED: segmentStorageTest %d segments after compaction, %d when empty\n",
+           segments_compacted, segments_left);
+    return 1;
+  }
+
+  printf("PASSED: segmentStorageTest\n");
+  return 0;
+}
+
+int inlineValueTest() {
+  char key[16], val[16];
+  uint8_t large[100];
+  int num_found = 0, num_found_after_load = 0;
+  int files_before = countDataFiles();
+  DCMakeOptions_t options;
+  DCMakeOptionsInit(&options);
+  options.inline_value_bytes = 64;
+
+  // Only the value over 64 bytes gets a data file
+  DCCache cache = DCMakeWithOptions(WORKING_PATH, 16384, 0, &options);
+  for (int i=0; i < 200; i++) {
+    sprintf(key, "key%d", i);
+    sprintf(val, "val%d", i);
+    DCAdd(cache, key, (uint8_t *) val, strlen(val) + 1);
+  }
+  memset(large, 7, sizeof(large));
+  DCAdd(cache, "large", large, sizeof(large));
+  int data_files = countDataFiles() - files_before;
+
+  // A key that grows out of its slot and back
+  DCAdd(cache, "key0", large, sizeof(large));
+  DCAdd(cache, "key0", (uint8_t *) "val0", 5);
+  int data_files_after_overwrite = countDataFiles() - files_before;
+
+  // The values move with the lines of a resize
+  DCResize(cache, 32768);
+  DCResizeStep(cache, UINT32_MAX);
+  for (int i=0; i < 200; i++) {
+    sprintf(key, "key%d", i);
+    sprintf(val, "val%d", i);
+    num_found += lookupMatchesString(cache, key, val);
+  }
+  DCCloseAndFree(cache);
+
+  cache = DCLoad(WORKING_PATH);
+  for (int i=0; i < 200; i++) {
+    sprintf(key, "key%d", i);
+    sprintf(val, "val%d", i);
+    num_found_after_load += lookupMatchesString(cache, key, val);
+  }
+  bool large_found = lookupMatches(cache, "large", 7, sizeof(large));
+  DCEvictToSize(cache, 0);
+  DCCloseAndFree(cache);
+
+  if (data_files != 1 || data_files_after_overwrite != 1) {
+    printf("FAILED: inlineValueTest %d data files for one large value, %d after an overwrite\n",
+           data_files, data_files_after_overwrite);
+    return 1;
+  }
+  if (num_found != 200 || num_found_after_load != 200 || !large_found) {
+    printf("FAILED: inlineValueTest found %d of 200 inline values, %d after a load\n", num_found,
+           num_found_after_load);
+    return 1;
+  }
+
+  printf("PASSED: inlineValueTest\n");
+  return 0;
+}
+
+int slotStorageTest() {
+  char key[16];
+  uint8_t tile[16384], large[20000];
+  int num_found = 0, num_found_after_load = 0;
+  int files_before = countDataFiles();
+  struct stat slots_stats;
+  DCMakeOptions_t options;
+  DCMakeOptionsInit(&options);
+  options.seed_hash = false; // Without relocation, random digests occasionally overfill a bucket
+  options.storage = DC_STORAGE_SLOTS;
+  options.slot_size = sizeof(tile);
+
+  // Full tiles and smaller values go to the slots, only the value that doesn't fit gets a data file
+  DCCache cache = DCMakeWithOptions(WORKING_PATH, 1024, 0, &options);
+  for (int i=0; i < 150; i++) {
+    sprintf(key, "tile%d", i);
+    memset(tile, i, sizeof(tile));
+    DCAdd(cache, key, tile, i < 100 ? sizeof(tile) : 1000);
+  }
+  memset(large, 7, sizeof(large));
+  DCAdd(cache, "large", large, sizeof(large));
+  int data_files = countDataFiles() - files_before;
+  fprintf(stderr, "** IGNORE THIS: ");
+  bool resized = DCResize(cache, 2048);
+  DCCloseAndFree(cache);
+
+  cache = DCLoad(WORKING_PATH);
+  for (int i=0; i < 150; i++) {
+    sprintf(key, "tile%d", i);
+    num_found += lookupMatches(cache, key, i, i < 100 ? sizeof(tile) : 1000);
+  }
+  // Replacing a tile writes over its slot
+  for (int i=0; i < 150; i++) {
+    sprintf(key, "tile%d", i);
+    memset(tile, i + 1, sizeof(tile));
+    DCAdd(cache, key, tile, sizeof(tile));
+  }
+  for (int i=0; i < 150; i++) {
+    sprintf(key, "tile%d", i);
+    num_found_after_load += lookupMatches(cache, key, i + 1, sizeof(tile));
+  }
+  bool large_found = lookupMatches(cache, "large", 7, sizeof(large));
+  DCEvictToSize(cache, 0);
+  int items_after_eviction = DCNumItems(cache);
+  int data_files_after_eviction = countDataFiles() - files_before;
+  stat(WORKING_PATH "/" CACHE_FN ".slots", &slots_stats);
+  uint32_t num_lines = cache->header.num_lines;
+  DCCloseAndFree(cache);
+
+  // A table whose slots are gone can't be loaded
+  unlink(WORKING_PATH "/" CACHE_FN ".slots");
+  fprintf(stderr, "** IGNORE THIS: ");
+  cache = DCLoad(WORKING_PATH);
+  bool loaded_without_slots = cache != NULL;
+  if (cache) {
+    DCCloseAndFree(cache);
+  }
+
+  if (data_files != 1 || resized) {
+    printf("FAILED: slotStorageTest %d data files for one value larger than a slot\n", data_files);
+    return 1;
+  }
+  if (num_found != 150 || num_found_after_load != 150 || !large_found) {
+    printf("FAILED: slotStorageTest found %d of 150 values, %d of 150 after replacing them\n",
+           num_found, num_found_after_load);
+    return 1;
+  }
+  if (items_after_eviction != 0 || data_files_after_eviction != 0 ||
+      slots_stats.st_size != (off_t) num_lines * sizeof(tile) ||
+      slots_stats.st_blocks * 512 < slots_stats.st_size) {
+    printf("FAILED: slotStorageTest the slots file should stay preallocated for %u lines\n",
+           num_lines);
+    return 1;
+  }
+  if (loaded_without_slots) {
+    printf("FAILED: slotStorageTest loaded a cache without its slots file\n");
+    return 1;
+  }
+
+  printf("PASSED: slotStorageTest\n");
+  return 0;
+}
+
+// Whether a view is value_len bytes of fill
+static bool mappedMatches(DCMappedData mapped, uint8_t fill, uint64_t value_len) {
+  bool matches = mapped && mapped->data_len == value_len;
+  for (uint64_t i=0; matches && i < value_len; i++) {
+    matches = mapped->data[i] == fill;
+  }
+  return matches;
+}
+
+int mappedLookupTest() {
+  uint8_t value[200000];
+  DCMakeOptions_t options;
+
+  // A mapped file survives its key being removed, added again (which must not truncate it) and evicted
+  DCCache cache = DCMake(WORKING_PATH, 1024, 0);
+  DCStartDeferredUnlink(cache, 1);
+  memset(value, 3, sizeof(value));
+  DCAdd(cache, "file", value, sizeof(value));
+  DCMappedData file_view = DCLookupMapped(cache, "file");
+  DCMappedData missing_view = DCLookupMapped(cache, "missing");
+  DCRemove(cache, "file");
+  memset(value, 4, sizeof(value));
+  DCAdd(cache, "file", value, sizeof(value));
+  bool file_replaced = lookupMatches(cache, "file", 4, sizeof(value));
+  DCEvictToSize(cache, 0);
+  DCDrainUnlinks(cache);
+  bool file_kept = mappedMatches(file_view, 3, sizeof(value));
+  if (file_view) {
+    DCMappedDataRelease(file_view);
+  }
+  DCCloseAndFree(cache);
+
+  // A mapped range of a segment isn't punched out when its value is removed
+  DCMakeOptionsInit(&options);
+  options.storage = DC_STORAGE_SEGMENTS;
+  options.segment_size = 4 << 20;
+  cache = DCMakeWithOptions(WORKING_PATH, 1024, 0, &options);
+  DCAdd(cache, "first", (uint8_t *) "first", 6);
+  DCAdd(cache, "segment", value, sizeof(value));
+  DCMappedData segment_view = DCLookupMapped(cache, "segment");
+  DCRemove(cache, "segment");
+  bool segment_kept = mappedMatches(segment_view, 4, sizeof(value));
+  if (segment_view) {
+    DCMappedDataRelease(segment_view);
+  }
+  DCCloseAndFree(cache);
+
+  // Inline values are copied, so writing over the inline slot doesn't change the view
+  DCMakeOptionsInit(&options);
+  options.inline_value_bytes = 64;
+  cache = DCMakeWithOptions(WORKING_PATH, 1024, 0, &options);
+  DCAdd(cache, "inline", value, 50);
+  DCMappedData inline_view = DCLookupMapped(cache, "inline");
+  memset(value, 5, sizeof(value));
+  DCAdd(cache, "inline", value, 50);
+  bool inline_kept = mappedMatches(inline_view, 4, 50);
+  if (inline_view) {
+    DCMappedDataRelease(inline_view);
+  }
+  DCCloseAndFree(cache);
+
+  if (!file_replaced || !file_kept || missing_view) {
+    printf("FAILED: mappedLookupTest a mapped file changed when its key was replaced or evicted\n");
+    return 1;
+  }
+  if (!segment_kept || !inline_kept) {
+    printf("FAILED: mappedLookupTest a mapped segment value (%d) or inline value (%d) changed\n",
+           segment_kept, inline_kept);
+    return 1;
+  }
+
+  printf("PASSED: mappedLookupTest\n");
+  return 0;
+}
+
+// Whether DCLookupInto finds value_len bytes of fill, after first reporting the size to a buffer one byte short
+static bool lookupIntoMatches(DCCache cache, char *key, uint8_t fill, uint64_t value_len) {
+  uint8_t buf[value_len + 1];
+  uint64_t len = 0;
+  memset(buf, ~fill, sizeof(buf));
+  bool matches = DCLookupInto(cache, key, buf, value_len - 1, &len) && len == value_len &&
+                 buf[0] != fill;
+  matches = matches && DCLookupInto(cache, key, buf, sizeof(buf), &len) && len == value_len &&
+            buf[value_len] != fill;
+  for (uint64_t i=0; matches && i < value_len; i++) {
+    matches = buf[i] == fill;
+  }
+  return matches;
+}
+
+int lookupIntoTest() {
+  uint8_t value[20000], buf[16];
+  uint64_t len = 0;
+  int num_found = 0;
+  DCMakeOptions_t options;
+  DCMakeOptionsInit(&options);
+  options.storage = DC_STORAGE_SEGMENTS;
+  options.segment_size = 64 * 1024;
+  options.inline_value_bytes = 32;
+
+  // Inline, segment and file values
+  DCCache cache = DCMakeWithOptions(WORKING_PATH, 1024, 0, &options);
+  memset(value, 1, sizeof(value));
+  DCAdd(cache, "inline", value, 20);
+  memset(value, 2, sizeof(value));
+  DCAdd(cache, "segment", value, 2000);
+  memset(value, 3, sizeof(value));
+  DCAdd(cache, "file", value, sizeof(value));
+  num_found += lookupIntoMatches(cache, "inline", 1, 20);
+  num_found += lookupIntoMatches(cache, "segment", 2, 2000);
+  num_found += lookupIntoMatches(cache, "file", 3, sizeof(value));
+  bool missing_found = DCLookupInto(cache, "missing", buf, sizeof(buf), &len);
+
+  // Values that fit the pool's buffers reuse them, larger ones don't
+  bool pool_set = DCSetDataPool(cache, 2, 4096);
+  DCData first = DCLookup(cache, "segment");
+  uint8_t *first_buffer = first ? first->data : NULL;
+  DCDataFree(first);
+  DCData second = DCLookup(cache, "segment");
+  DCData large = DCLookup(cache, "file");
+  bool pool_reused = second && second->pool && second->data == first_buffer &&
+                     second->data_len == 2000 && second->data[1999] == 2 && large && !large->pool;
+  DCDataFree(large);
+  // A pooled DCData outlives the pool
+  DCSetDataPool(cache, 0, 0);
+  bool still_readable = second && second->data[0] == 2;
+  DCDataFree(second);
+  DCCloseAndFree(cache);
+
+  // Slots
+  DCMakeOptionsInit(&options);
+  options.storage = DC_STORAGE_SLOTS;
+  options.slot_size = 4096;
+  cache = DCMakeWithOptions(WORKING_PATH, 1024, 0, &options);
+  memset(value, 4, sizeof(value));
+  DCAdd(cache, "slot", value, 4000);
+  num_found += lookupIntoMatches(cache, "slot", 4, 4000);
+  DCCloseAndFree(cache);
+
+  if (num_found != 4 || missing_found) {
+    printf("FAILED: lookupIntoTest read %d of 4 values into the buffer\n", num_found);
+    return 1;
+  }
+  if (!pool_set || !pool_reused || !still_readable) {
+    printf("FAILED: lookupIntoTest the data pool wasn't reused\n");
+    return 1;
+  }
+
+  printf("PASSED: lookupIntoTest\n");
+  return 0;
+}
+
 int main(int argc, char **argv) {
   //SETUP
   mkdir(WORKING_PATH, 0777);
@@ -298,7 +2000,37 @@ int main(int argc, char **argv) {
   addRecoversIfDirectoryDoesntExist();
   addFailsIfDirectoryNotExistsAndNotWriteable();
   testLookupSetsAccessTimeAndReplacesEarliestAccessed();
+  accessTimeGranularityTest();
   evictionTest();
+  incrementalEvictionTest();
+  backgroundEvictionTest();
+  replacementPolicyTest();
+  admissionFilterTest();
+  admissionWithDisplacementTest();
+  admissionDuringResizeTest();
+  ttlTest();
+  gdsfTest();
+  deferredUnlinkTest();
+  segmentStorageTest();
+  inlineValueTest();
+  slotStorageTest();
+  mappedLookupTest();
+  lookupIntoTest();
+  fastHashEngineTest();
+  loadLegacyHeaderTest();
+  binaryKeyTest();
+  keyHandleTest();
+  bucketedLayoutTest();
+  fingerprintRebuildTest();
+  cuckooDisplacementTest();
+  numWaysTest();
+  compactLinesTest();
+  convertToCompactLinesTest();
+  columnarLinesTest();
+  partialEvictionTest();
+  resizeTest();
+  loadOptionsTest();
+  cleanShutdownTest();
 
   // Cleanup
   recursiveDeletePath(WORKING_PATH);
@@ -1,8 +1,13 @@
 #ifndef TEST_HELPERS_H
 #define TEST_HELPERS_H
 
+#include <fcntl.h>
+#include <stddef.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <unistd.h>
+
+#include "disk_cache.h"
 
 static inline double fTime() {
   struct timeval tv;
@@ -16,6 +21,16 @@ static void recursiveDeletePath(char *path) {
   pclose(popen(buf, "r"));
 }
 
+/* Make a closed cache look like it crashed, so the next DCLoad scans its lines rather than taking
+ * their state from the header. For tests and benchmarks that write lines directly.
+ */
+static void markNotClosedCleanly(char *cache_file_path) {
+  uint32_t closed_cleanly = 0;
+  int fd = open(cache_file_path, O_WRONLY);
+  pwrite(fd, &closed_cleanly, sizeof(closed_cleanly), offsetof(DCCacheHeader_t, closed_cleanly));
+  close(fd);
+}
+
 
 #endif
 